@@ -0,0 +1,324 @@
+/*
+ * Reference: ISO/IEC 13818-7 (ADTS)
+ *            ISO/IEC 14496-3 (LATM/LOAS)
+ *            ETSI TS 102 366 (AC-3, E-AC-3)
+ */
+
+#include <algorithm>
+#include <cstring>
+#include "audio_frame_indexer.h"
+#include "pes_assembler.h"
+#include "ts_tables.h"
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace {
+
+constexpr uint64_t PTS_MASK = (1ULL << 33) - 1;
+
+constexpr uint32_t AAC_sample_rates[16] = {
+	96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+	16000, 12000, 11025, 8000, 7350, 0, 0, 0,
+};
+
+// AC-3 nominal bitrates (kbit/s) by frmsizecod / 2
+constexpr uint16_t AC3_bitrates[19] = {
+	32, 40, 48, 56, 64, 80, 96, 112, 128, 160,
+	192, 224, 256, 320, 384, 448, 512, 576, 640,
+};
+
+// Sync word: first byte, then second byte under mask
+struct SyncWord
+{
+	uint8_t first;
+	uint8_t mask;
+	uint8_t second;
+};
+
+// Returns the offset of the first sync word in p[0, length), or length
+size_t find_sync_word(const uint8_t* p, const size_t length, const SyncWord sync)
+{
+	size_t i = 0;
+	if (length < 2) {
+		return length;
+	}
+
+#if defined(__SSE2__) || defined(_M_X64)
+	// 16 candidate positions per step: both bytes are compared in parallel
+	const auto first = _mm_set1_epi8(static_cast<char>(sync.first));
+	const auto mask = _mm_set1_epi8(static_cast<char>(sync.mask));
+	const auto second = _mm_set1_epi8(static_cast<char>(sync.second));
+	for (; i + 17 <= length; i += 16) {
+		const auto a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+		const auto b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i + 1));
+		const auto match = _mm_and_si128(_mm_cmpeq_epi8(a, first),
+			_mm_cmpeq_epi8(_mm_and_si128(b, mask), second));
+		const auto bits = static_cast<uint32_t>(_mm_movemask_epi8(match));
+		if (bits) {
+#if defined(_MSC_VER)
+			unsigned long index;
+			_BitScanForward(&index, bits);
+			return i + index;
+#else
+			return i + __builtin_ctz(bits);
+#endif
+		}
+	}
+#endif
+
+	for (; i + 1 < length; ++i) {
+		if (p[i] == sync.first && (p[i + 1] & sync.mask) == sync.second) {
+			return i;
+		}
+	}
+	return length;
+}
+
+} // namespace
+
+AudioFrameIndexer::AudioFrameIndexer() :
+	audios(TS_PID_MAX)
+{}
+
+void AudioFrameIndexer::on_PMT(const ProgramMapSection& PMT)
+{
+	for (const auto& info : PMT.ES_list) {
+		Codec codec;
+		switch (static_cast<StreamType>(info.stream_type)) {
+		case StreamType::STREAM_AUDIO_AAC:
+			codec = Codec::ADTS;
+			break;
+		case StreamType::STREAM_AUDIO_MP4:
+			codec = Codec::LATM;
+			break;
+		case StreamType::STREAM_AUDIO_AC3:
+		case StreamType::STREAM_AUDIO_DDPLUS:
+			codec = Codec::AC3;
+			break;
+		default:
+			continue;
+		}
+
+		auto& audio = audios[info.elementary_PID];
+		if (!audio || audio->codec != codec) {
+			audio = std::make_unique<AudioPID>();
+			audio->codec = codec;
+			audio->synced = false;
+			audio->sample_rate = 0;
+			audio->buffer_offset = 0;
+			audio->buffer_position = 0;
+			audio->next_PTS = UINT64_MAX;
+		}
+	}
+}
+
+void AudioFrameIndexer::on_frame(std::function<void(const AudioFrame&)> handler)
+{
+	this->handler = std::move(handler);
+}
+
+void AudioFrameIndexer::on_PES(const PesData& pes)
+{
+	const auto& audio = audios[pes.PID];
+	if (!audio) {
+		return;
+	}
+
+	// Frames may straddle PES packets: the new payload joins the leftover
+	auto& buffer = audio->buffer;
+	const auto pes_start = buffer.size();
+	pes.copy_payload(&payload);
+	buffer.insert(buffer.end(), payload.begin(), payload.end());
+
+	auto PES_PTS = (pes.header.PTS_DTS_flags & 0x2) ? pes.header.PTS : UINT64_MAX;
+
+	SyncWord sync;
+	size_t header_length;
+	switch (audio->codec) {
+	case Codec::ADTS: sync = { 0xff, 0xf6, 0xf0 }; header_length = 7;  break; // syncword, layer '00'
+	case Codec::LATM: sync = { 0x56, 0xe0, 0xe0 }; header_length = 3;  break; // syncword 0x2B7
+	default:          sync = { 0x0b, 0xff, 0x77 }; header_length = 7;  break;
+	}
+
+	const auto n = buffer.size();
+	size_t i = 0;
+	while (i + header_length <= n) {
+		FrameHeader header;
+		if (!audio->synced || !parse_header(*audio, &buffer[i], n - i, &header)) {
+			audio->synced = false;
+			i += find_sync_word(&buffer[i], n - i, sync);
+			if (i + header_length > n) {
+				break;
+			}
+			if (!parse_header(*audio, &buffer[i], n - i, &header)) {
+				++i;
+				continue;
+			}
+			// A lone sync word may be payload data: the next frame must follow
+			const auto next = i + header.size;
+			if (next + 2 <= n && !(buffer[next] == sync.first && (buffer[next + 1] & sync.mask) == sync.second)) {
+				++i;
+				continue;
+			}
+			audio->synced = true;
+		}
+
+		if (i + header.size > n) {
+			break; // completed by the next PES
+		}
+
+		AudioFrame frame;
+		frame.PID = pes.PID;
+		frame.position = i >= pes_start ? pes.position : audio->buffer_position;
+		frame.es_offset = audio->buffer_offset + i;
+		frame.size = header.size;
+		frame.samples = header.samples;
+		frame.sample_rate = header.sample_rate;
+
+		// The PTS of a PES belongs to the first frame starting in it
+		if (i >= pes_start && PES_PTS != UINT64_MAX) {
+			frame.PTS = PES_PTS;
+			PES_PTS = UINT64_MAX;
+		}
+		else {
+			frame.PTS = audio->next_PTS;
+		}
+		if (frame.PTS != UINT64_MAX && header.sample_rate) {
+			audio->next_PTS = (frame.PTS + header.samples * 90000ULL / header.sample_rate) & PTS_MASK;
+		}
+
+		frames.push_back(frame);
+		if (handler) {
+			handler(frame);
+		}
+		i += header.size;
+	}
+
+	// The leftover starts in this PES, possibly at its first byte
+	i = std::min(i, n);
+	if (i >= pes_start) {
+		audio->buffer_position = pes.position;
+	}
+	audio->buffer_offset += i;
+	buffer.erase(buffer.begin(), buffer.begin() + i);
+}
+
+bool AudioFrameIndexer::parse_header(AudioPID& audio, const uint8_t* p, const size_t length,
+	FrameHeader* header) const
+{
+	switch (audio.codec) {
+	case Codec::ADTS: {
+		if (length < 7 || p[0] != 0xff || (p[1] & 0xf6) != 0xf0) {
+			return false;
+		}
+		const auto sampling_frequency_index = (p[2] >> 2) & 0x0f;
+		const uint32_t frame_length = (p[3] & 0x03) << 11 | p[4] << 3 | p[5] >> 5;
+		const auto number_of_raw_data_blocks_in_frame = p[6] & 0x03;
+		header->size = frame_length;
+		header->samples = static_cast<uint16_t>(1024 * (number_of_raw_data_blocks_in_frame + 1));
+		header->sample_rate = AAC_sample_rates[sampling_frequency_index];
+		return frame_length >= 7 && header->sample_rate;
+	}
+
+	case Codec::LATM: {
+		if (length < 3 || p[0] != 0x56 || (p[1] & 0xe0) != 0xe0) {
+			return false;
+		}
+		const uint32_t audioMuxLengthBytes = (p[1] & 0x1f) << 8 | p[2];
+		header->size = 3 + audioMuxLengthBytes;
+		header->samples = 1024;
+		parse_LATM_config(audio, p + 3, std::min<size_t>(length - 3, audioMuxLengthBytes));
+		header->sample_rate = audio.sample_rate;
+		return audioMuxLengthBytes > 0;
+	}
+
+	case Codec::AC3: {
+		if (length < 7 || p[0] != 0x0b || p[1] != 0x77) {
+			return false;
+		}
+		const auto bsid = p[5] >> 3;
+		const auto fscod = p[4] >> 6;
+		if (bsid > 10) {
+			// E-AC-3: frmsiz is given in 16-bit words
+			const uint32_t frmsiz = (p[2] & 0x07) << 8 | p[3];
+			header->size = (frmsiz + 1) * 2;
+			if (fscod == 3) {
+				constexpr uint32_t reduced_rates[3] = { 24000, 22050, 16000 };
+				const auto fscod2 = (p[4] >> 4) & 0x03;
+				header->sample_rate = fscod2 < 3 ? reduced_rates[fscod2] : 0;
+				header->samples = 256 * 6;
+			}
+			else {
+				constexpr uint16_t blocks[4] = { 1, 2, 3, 6 };
+				constexpr uint32_t rates[3] = { 48000, 44100, 32000 };
+				header->sample_rate = rates[fscod];
+				header->samples = 256 * blocks[(p[4] >> 4) & 0x03];
+			}
+			return header->sample_rate != 0;
+		}
+
+		const auto frmsizecod = p[4] & 0x3f;
+		if (fscod == 3 || frmsizecod >= 38) {
+			return false;
+		}
+		const uint32_t kbps = AC3_bitrates[frmsizecod / 2];
+		uint32_t words;
+		switch (fscod) {
+		case 0:  words = kbps * 2; header->sample_rate = 48000; break;
+		case 1:  words = kbps * 320 / 147 + (frmsizecod & 1); header->sample_rate = 44100; break;
+		default: words = kbps * 3; header->sample_rate = 32000; break;
+		}
+		header->size = words * 2;
+		header->samples = 1536;
+		return true;
+	}
+
+	default:
+		return false;
+	}
+}
+
+// Picks the sampling frequency out of a StreamMuxConfig (audioMuxVersion 0)
+bool AudioFrameIndexer::parse_LATM_config(AudioPID& audio, const uint8_t* p, const size_t length) const
+{
+	size_t bit = 0;
+	auto read_bits = [&](const int count) -> uint32_t {
+		uint32_t value = 0;
+		for (auto i = 0; i < count; ++i, ++bit) {
+			const auto b = bit / 8 < length ? (p[bit / 8] >> (7 - bit % 8)) & 1 : 0;
+			value = value << 1 | b;
+		}
+		return value;
+	};
+
+	const auto useSameStreamMux = read_bits(1);
+	if (useSameStreamMux) {
+		return audio.sample_rate != 0;
+	}
+	const auto audioMuxVersion = read_bits(1);
+	if (audioMuxVersion != 0) {
+		return false;
+	}
+	read_bits(1); // allStreamsSameTimeFraming
+	read_bits(6); // numSubFrames
+	read_bits(4); // numProgram
+	read_bits(3); // numLayer
+
+	// AudioSpecificConfig
+	if (read_bits(5) == 31) { // audioObjectType
+		read_bits(6);
+	}
+	const auto samplingFrequencyIndex = read_bits(4);
+	const auto sample_rate = samplingFrequencyIndex == 0x0f ? read_bits(24)
+		: AAC_sample_rates[samplingFrequencyIndex];
+	if (bit > length * 8 || !sample_rate) {
+		return false;
+	}
+	audio.sample_rate = sample_rate;
+	return true;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <cinttypes>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "ts_packet.h"
+
+struct ProgramMapSection;
+struct PesData;
+
+struct AudioFrame
+{
+	uint16_t PID;
+	uint64_t PTS;          // 90kHz; extrapolated for frames after the first of a PES
+	uint64_t position;     // byte offset of the TS packet starting the PES the frame starts in
+	uint64_t es_offset;    // byte offset in the elementary stream of PID
+	uint32_t size;         // bytes, headers included
+	uint16_t samples;      // per channel
+	uint32_t sample_rate;
+};
+
+// Splits the audio PES payloads of AAC (ADTS, LATM/LOAS) and AC-3/E-AC-3
+// streams into frames. The sync word search is vectorized; once in sync
+// the walk hops from frame to frame by the header's frame length.
+class AudioFrameIndexer
+{
+public:
+	AudioFrameIndexer();
+	~AudioFrameIndexer() = default;
+
+	void on_PMT(const ProgramMapSection& PMT);
+	void on_PES(const PesData& pes);
+
+	// Called for each frame as it is found
+	void on_frame(std::function<void(const AudioFrame&)> handler);
+
+	const std::vector<AudioFrame>& get_frames() const { return frames; }
+
+private:
+	enum class Codec : uint8_t { none, ADTS, LATM, AC3 };
+
+	struct FrameHeader
+	{
+		uint32_t size;
+		uint16_t samples;
+		uint32_t sample_rate;
+	};
+
+	struct AudioPID
+	{
+		Codec    codec;
+		bool     synced;
+		uint32_t sample_rate;   // LATM: from the last StreamMuxConfig
+		std::vector<uint8_t> buffer; // bytes not yet split into frames
+		uint64_t buffer_offset; // es_offset of buffer[0]
+		uint64_t buffer_position;
+		uint64_t next_PTS;
+	};
+
+	// Returns false when p holds no valid header (length: bytes available)
+	bool parse_header(AudioPID& audio, const uint8_t* p, const size_t length,
+		FrameHeader* header) const;
+	bool parse_LATM_config(AudioPID& audio, const uint8_t* p, const size_t length) const;
+
+	std::vector<std::unique_ptr<AudioPID>> audios; // indexed by PID
+	std::vector<uint8_t> payload;
+	std::vector<AudioFrame> frames;
+	std::function<void(const AudioFrame&)> handler;
+};
@@ -0,0 +1,63 @@
+#include "es_extractor.h"
+#include "ts_tables.h"
+
+ElementaryStreamExtractor::ElementaryStreamExtractor(
+	const std::string& output_prefix, const uint16_t program_number) :
+	output_prefix(output_prefix),
+	program_number(program_number),
+	success(true),
+	outputs(TS_PID_MAX)
+{}
+
+void ElementaryStreamExtractor::on_PMT(const ProgramMapSection& PMT)
+{
+	if (program_number != 0 && PMT.program_number != program_number) {
+		return;
+	}
+
+	for (const auto& info : PMT.ES_list) {
+		auto& output = outputs[info.elementary_PID];
+		if (output) {
+			continue;
+		}
+
+		auto extension = get_stream_type(info.stream_type);
+		if (extension == "unknown") {
+			extension = ".es";
+		}
+
+		char PID_str[8];
+		snprintf(PID_str, sizeof(PID_str), "%04x", info.elementary_PID);
+		const auto file_path = output_prefix + "_" + PID_str + extension;
+
+		output = std::make_unique<VectoredWriter>();
+		if (!output->open(file_path)) {
+			success = false;
+		}
+	}
+}
+
+void ElementaryStreamExtractor::on_PES(const PesData& pes)
+{
+	const auto& output = outputs[pes.PID];
+	if (!output || !output->is_open()) {
+		return;
+	}
+
+	pes.payload_slices(&slices);
+	for (const auto& slice : slices) {
+		if (!output->append(slice)) {
+			success = false;
+		}
+	}
+}
+
+bool ElementaryStreamExtractor::close()
+{
+	for (auto& output : outputs) {
+		if (output && !output->close()) {
+			success = false;
+		}
+	}
+	return success;
+}
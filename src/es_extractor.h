@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cinttypes>
+#include <memory>
+#include <string>
+#include <vector>
+#include "pes_assembler.h"
+#include "vectored_writer.h"
+
+struct ProgramMapSection;
+
+// Writes every elementary stream of one program (or of all programs)
+// to its own file, named <prefix>_<PID>.<ext> after the stream_type.
+class ElementaryStreamExtractor
+{
+public:
+	// program_number 0 selects every program
+	ElementaryStreamExtractor(const std::string& output_prefix, const uint16_t program_number = 0);
+	~ElementaryStreamExtractor() = default;
+
+	void on_PMT(const ProgramMapSection& PMT);
+	void on_PES(const PesData& pes);
+
+	bool close();
+
+private:
+	std::string output_prefix;
+	uint16_t    program_number;
+	bool        success;
+
+	// Indexed by PID; null for PIDs that are not extracted
+	std::vector<std::unique_ptr<VectoredWriter>> outputs;
+	std::vector<PayloadSlice> slices;
+};
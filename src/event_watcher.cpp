@@ -0,0 +1,65 @@
+/*
+ * Reference: ARIB STD-B10 Part 2 5.2.7
+ */
+
+#include "event_watcher.h"
+#include "ts_tables.h"
+#include "crc32.h"
+
+static uint64_t service_key(const uint16_t service_id, const uint16_t transport_stream_id,
+	const uint16_t original_network_id)
+{
+	return (uint64_t)original_network_id << 32 | (uint64_t)transport_stream_id << 16 | service_id;
+}
+
+void EventWatcher::on_change(std::function<void(const EventChange&)> handler)
+{
+	change_handler = std::move(handler);
+}
+
+int32_t EventWatcher::get_event_id(const uint16_t service_id, const uint16_t transport_stream_id,
+	const uint16_t original_network_id) const
+{
+	const auto found = services.find(service_key(service_id, transport_stream_id, original_network_id));
+	return found != services.end() ? found->second.event_id : -1;
+}
+
+void EventWatcher::on_section(const uint16_t PID, const uint8_t* section, const uint16_t length)
+{
+	// EIT p/f actual, present section, current_next_indicator
+	if (PID != 0x12 || section[0] != 0x4E || length < 18 || section[6] != 0 || !(section[5] & 0x01)) {
+		return;
+	}
+
+	const uint16_t service_id          = section[3] << 8 | section[4];
+	const uint8_t  version_number      = (section[5] >> 1) & 0x1F;
+	const uint16_t transport_stream_id = section[8] << 8 | section[9];
+	const uint16_t original_network_id = section[10] << 8 | section[11];
+
+	const auto key = service_key(service_id, transport_stream_id, original_network_id);
+	auto found = services.find(key);
+	if (found != services.end() && found->second.version_number == version_number) {
+		return;
+	}
+
+	// A section with no event loop: nothing is on
+	const int32_t event_id = length >= 14 + 12 + crc::CRC32_SIZE ? section[14] << 8 | section[15] : -1;
+	if (found != services.end() && found->second.event_id == event_id) {
+		if (crc::_crc32(section, length) == 0) {
+			found->second.version_number = version_number;
+		}
+		return;
+	}
+
+	EventInformationSection EIT;
+	if (!EIT.parse(section, nullptr)) {
+		return;
+	}
+	const auto previous_event_id = found != services.end() ? found->second.event_id : -1;
+	services[key] = { version_number, event_id };
+
+	if (change_handler) {
+		change_handler({ service_id, transport_stream_id, original_network_id,
+			previous_event_id, event_id, EIT });
+	}
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cinttypes>
+#include <functional>
+#include <map>
+
+struct EventInformationSection;
+
+// Present event of a service, taken from EIT p/f actual (table_id 0x4E)
+struct EventChange
+{
+	uint16_t service_id;
+	uint16_t transport_stream_id;
+	uint16_t original_network_id;
+	int32_t  previous_event_id; // -1: none (first seen, or nothing was on)
+	int32_t  event_id;          // -1: nothing on now
+
+	// Section 0 the change came in, fully decoded
+	const EventInformationSection& EIT;
+};
+
+// Tells when the present event of a service changes, for starting and
+// stopping recordings. Fed with every section (TransportStream::on_section),
+// it looks only at section 0 of EIT p/f actual on PID 0x12, and only at its
+// version and first event_id. The section is decoded (descriptors and
+// text) only when the event_id has changed.
+class EventWatcher
+{
+public:
+	void on_change(std::function<void(const EventChange&)> handler);
+	void on_section(const uint16_t PID, const uint8_t* section, const uint16_t length);
+
+	// Present event_id of a service, or -1
+	int32_t get_event_id(const uint16_t service_id, const uint16_t transport_stream_id,
+		const uint16_t original_network_id) const;
+
+private:
+	struct Service
+	{
+		uint8_t version_number;
+		int32_t event_id;
+	};
+
+	// By original_network_id, transport_stream_id and service_id
+	std::map<uint64_t, Service> services;
+
+	std::function<void(const EventChange&)> change_handler;
+};
@@ -0,0 +1,115 @@
+/*
+ * Reference: ARIB STD-B10 Part 2 6.2.24
+ */
+
+#include <algorithm>
+#include "ews_detector.h"
+#include "crc32.h"
+
+void EwsDetector::on_alert(std::function<void(const EmergencyAlert&)> handler)
+{
+	alert_handler = std::move(handler);
+}
+
+size_t EwsDetector::get_active_count() const
+{
+	size_t count = 0;
+	for (const auto& program : programs) {
+		for (const auto& warning : program.second.warnings) {
+			count += warning.second.start;
+		}
+	}
+	return count;
+}
+
+void EwsDetector::on_section(const uint16_t, const uint8_t* section, const uint16_t length)
+{
+	// PMT, current_next_indicator
+	if (section[0] != 0x02 || length < 16 || !(section[5] & 0x01)) {
+		return;
+	}
+
+	const uint16_t program_number = section[3] << 8 | section[4];
+	const auto CRC = (uint32_t)section[length - 4] << 24 | section[length - 3] << 16
+		| section[length - 2] << 8 | section[length - 1];
+
+	const auto found = programs.find(program_number);
+	if (found != programs.end() && found->second.CRC == CRC) {
+		return;
+	}
+	if (crc::_crc32(section, length) != 0) {
+		return;
+	}
+	auto& program = programs[program_number];
+	program.CRC = CRC;
+
+	const auto program_info_length = (section[10] & 0x0F) << 8 | section[11];
+	const auto p = section + 12;
+	const auto end = std::min(p + program_info_length, section + length - crc::CRC32_SIZE);
+	scan(program_number, p, end, &program);
+}
+
+void EwsDetector::scan(const uint16_t program_number, const uint8_t* p, const uint8_t* end, Program* program)
+{
+	for (auto& warning : program->warnings) {
+		warning.second.seen = false;
+	}
+
+	while (p + 2 <= end) {
+		const auto descriptor_tag = p[0];
+		const auto descriptor_length = p[1];
+		const auto next = p + 2 + descriptor_length;
+		if (next > end) {
+			break;
+		}
+		if (descriptor_tag != 0xFC) {
+			p = next;
+			continue;
+		}
+
+		p += 2;
+		while (p + 4 <= next) {
+			EmergencyAlert alert;
+			alert.program_number  = program_number;
+			alert.service_id      = p[0] << 8 | p[1];
+			alert.start           = p[2] >> 7;
+			alert.signal_level    = (p[2] >> 6) & 0x01;
+			const auto area_code_length = std::min<size_t>(p[3], next - (p + 4));
+			alert.area_code_data  = p + 4;
+			alert.area_code_count = static_cast<uint8_t>(area_code_length / 2);
+			p += 4 + area_code_length;
+
+			const auto inserted = program->warnings.emplace(alert.service_id, Warning());
+			auto& warning = inserted.first->second;
+			const size_t area_code_bytes = alert.area_code_count * 2;
+			const auto changed = inserted.second
+				|| warning.start != alert.start || warning.signal_level != alert.signal_level
+				|| warning.area_code_data.size() != area_code_bytes
+				|| !std::equal(warning.area_code_data.begin(), warning.area_code_data.end(), alert.area_code_data);
+			warning.seen = true;
+			if (!changed) {
+				continue;
+			}
+
+			warning.start = alert.start;
+			warning.signal_level = alert.signal_level;
+			warning.area_code_data.assign(alert.area_code_data, alert.area_code_data + area_code_bytes);
+			if (alert_handler) {
+				alert_handler(alert);
+			}
+		}
+		p = next;
+	}
+
+	// Warnings no longer signalled have ended
+	for (auto it = program->warnings.begin(); it != program->warnings.end();) {
+		if (it->second.seen) {
+			++it;
+			continue;
+		}
+		if (it->second.start && alert_handler) {
+			alert_handler({ program_number, it->first, false, it->second.signal_level, nullptr, 0 });
+		}
+		it = program->warnings.erase(it);
+	}
+}
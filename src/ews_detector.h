@@ -0,0 +1,64 @@
+#pragma once
+
+#include <cinttypes>
+#include <functional>
+#include <map>
+#include <vector>
+
+// Start or end of an emergency warning broadcast for one service, from the
+// emergency information descriptor (0xFC) of a PMT
+struct EmergencyAlert
+{
+	uint16_t program_number;
+	uint16_t service_id;
+	bool     start;          // start_end_flag
+	uint8_t  signal_level;   // 0: first type start signal, 1: second type
+
+	// Area codes as in the descriptor: 16 bits each, the code in the top 12.
+	// Valid only during the call.
+	const uint8_t* area_code_data;
+	uint8_t        area_code_count;
+
+	uint16_t area_code(const size_t index) const
+	{
+		return (area_code_data[index * 2] << 8 | area_code_data[index * 2 + 1]) >> 4;
+	}
+};
+
+// Always-on watch of the PMTs for emergency warnings. Fed with every
+// section (TransportStream::on_section); a PMT whose CRC has not changed
+// is passed over, and the program_info loop of one that has is scanned in
+// place for the descriptor, without decoding the PMT. The handler is
+// called from within the section that starts or ends a warning, or
+// changes its level or areas. A warning whose descriptor is dropped from
+// the PMT ends with no area codes.
+class EwsDetector
+{
+public:
+	void on_alert(std::function<void(const EmergencyAlert&)> handler);
+	void on_section(const uint16_t PID, const uint8_t* section, const uint16_t length);
+
+	// Services with a warning on now
+	size_t get_active_count() const;
+
+private:
+	struct Warning
+	{
+		bool    start;
+		uint8_t signal_level;
+		std::vector<uint8_t> area_code_data;
+		bool    seen; // in the current PMT version
+	};
+
+	struct Program
+	{
+		uint32_t CRC;
+		std::map<uint16_t, Warning> warnings; // by service_id
+	};
+
+	void scan(const uint16_t program_number, const uint8_t* p, const uint8_t* end, Program* program);
+
+	std::map<uint16_t, Program> programs; // by program_number
+
+	std::function<void(const EmergencyAlert&)> alert_handler;
+};
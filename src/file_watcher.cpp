@@ -0,0 +1,82 @@
+#include <chrono>
+#include <thread>
+#include "file_watcher.h"
+
+#if defined(__linux__)
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+FileWatcher::FileWatcher()
+#if defined(__linux__)
+	: fd(-1),
+	watch(-1)
+#endif
+{}
+
+FileWatcher::~FileWatcher()
+{
+	close();
+}
+
+bool FileWatcher::open(const std::string& file_path)
+{
+	close();
+
+#if defined(__linux__)
+	fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+	watch = inotify_add_watch(fd, file_path.c_str(),
+		IN_MODIFY | IN_CLOSE_WRITE | IN_MOVE_SELF | IN_DELETE_SELF | IN_ATTRIB);
+	if (watch < 0) {
+		close();
+		return false;
+	}
+	return true;
+#else
+	(void)file_path;
+	return false;
+#endif
+}
+
+void FileWatcher::close()
+{
+#if defined(__linux__)
+	if (fd >= 0) {
+		::close(fd);
+	}
+	fd = -1;
+	watch = -1;
+#endif
+}
+
+bool FileWatcher::wait(const int timeout_ms)
+{
+#if defined(__linux__)
+	if (fd >= 0) {
+		struct pollfd pfd = { fd, POLLIN, 0 };
+		if (poll(&pfd, 1, timeout_ms) <= 0) {
+			return false;
+		}
+		// Events only wake us up; the file itself tells what changed
+		alignas(struct inotify_event) char events[4096];
+		while (read(fd, events, sizeof(events)) > 0) {
+		}
+		return true;
+	}
+#endif
+	std::this_thread::sleep_for(std::chrono::milliseconds(timeout_ms));
+	return false;
+}
+
+int FileWatcher::get_fd() const
+{
+#if defined(__linux__)
+	return fd;
+#else
+	return -1;
+#endif
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <string>
+
+// Waits for a file being written by another process to change.
+// Uses inotify where available and falls back to sleeping for the
+// timeout, after which the caller checks the file itself.
+class FileWatcher
+{
+public:
+	FileWatcher();
+	~FileWatcher();
+
+	FileWatcher(const FileWatcher&) = delete;
+	FileWatcher& operator=(const FileWatcher&) = delete;
+
+	// Returns false when the file cannot be watched (wait() then polls)
+	bool open(const std::string& file_path);
+	void close();
+
+	// Blocks until the file is modified or timeout_ms passes.
+	// Returns false on timeout; the file may still have changed.
+	bool wait(const int timeout_ms);
+
+	// Descriptor readable on a change, for epoll (-1 when polling)
+	int get_fd() const;
+
+private:
+#if defined(__linux__)
+	int fd;
+	int watch;
+#endif
+};
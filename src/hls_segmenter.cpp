@@ -0,0 +1,210 @@
+/*
+ * Reference: RFC 8216 HTTP Live Streaming
+ *            ITU-T Rec. H.222.0 (05/2006)
+ */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include "hls_segmenter.h"
+#include "pcr_tracker.h"
+#include "ts_tables.h"
+
+// PTS are 33-bit
+constexpr uint64_t PTS_MASK = (1ULL << 33) - 1;
+
+HLSSegmenter::HLSSegmenter(const std::string& output_prefix, const uint16_t program_number,
+	const double target_duration) :
+	output_prefix(output_prefix),
+	program_number(program_number),
+	target_duration(static_cast<uint64_t>(target_duration * PCR_FREQUENCY)),
+	success(true),
+	video_PID(TS_PID_MAX),
+	PCR_PID(TS_PID_MAX),
+	clock(0),
+	last_PCR(UINT64_MAX),
+	segment_start(0),
+	segment_PTS(UINT64_MAX),
+	writer(program_number),
+	segment_open(false),
+	pending_position(UINT64_MAX),
+	pending_clock(0)
+{
+	pending.reserve(max_pending);
+	keyframe_indexer.on_keyframe([this](const Keyframe& keyframe) { on_keyframe(keyframe); });
+}
+
+void HLSSegmenter::on_PMT(const ProgramMapSection& PMT)
+{
+	if (PMT.program_number != program_number) {
+		return;
+	}
+
+	keyframe_indexer.on_PMT(PMT);
+	PCR_PID = PMT.PCR_PID;
+
+	// Segments are cut on the first video stream
+	video_PID = TS_PID_MAX;
+	for (const auto& info : PMT.ES_list) {
+		if (keyframe_indexer.is_video_PID(info.elementary_PID)) {
+			video_PID = info.elementary_PID;
+			break;
+		}
+	}
+}
+
+void HLSSegmenter::on_section(const uint16_t PID, const uint8_t* section, const uint16_t length)
+{
+	writer.on_section(PID, section, length);
+}
+
+void HLSSegmenter::on_PCR(const uint16_t PID, const uint64_t PCR, const bool discontinuity_indicator)
+{
+	if (PID != PCR_PID) {
+		return;
+	}
+
+	if (last_PCR != UINT64_MAX) {
+		const auto delta = (PCR + PCR_WRAP - last_PCR) % PCR_WRAP;
+		// Across a discontinuity the time base restarts: the clock holds
+		if (!discontinuity_indicator && delta <= PCR_FREQUENCY) {
+			clock += delta;
+		}
+	}
+	last_PCR = PCR;
+}
+
+void HLSSegmenter::on_packet(const uint16_t PID, const uint8_t* packet, const uint64_t position,
+	const std::shared_ptr<uint8_t>& block)
+{
+	if (PID == video_PID && (packet[1] & 0x40)) {
+		// The previous PES was not a keyframe, or was too long to hold
+		write_pending();
+		pending_position = position;
+		pending_clock = clock;
+	}
+
+	if (pending_position != UINT64_MAX) {
+		pending.push_back({ PID, packet, block });
+	}
+	else if (segment_open) {
+		writer.on_packet(PID, packet, block);
+	}
+
+	// May call on_keyframe() for the PES being held
+	keyframe_indexer.on_packet(PID, packet, position);
+
+	if (pending.size() >= max_pending) {
+		write_pending();
+	}
+}
+
+void HLSSegmenter::on_keyframe(const Keyframe& keyframe)
+{
+	if (keyframe.PID != video_PID || keyframe.position != pending_position) {
+		return;
+	}
+
+	if (!segment_open || elapsed(keyframe.PTS) >= target_duration) {
+		end_segment(keyframe.PTS);
+		segment_start = pending_clock;
+		segment_PTS = keyframe.PTS;
+		start_segment();
+	}
+	write_pending();
+}
+
+void HLSSegmenter::start_segment()
+{
+	char index_str[16];
+	snprintf(index_str, sizeof(index_str), "_%05zu.ts", segments.size());
+	const auto file_path = output_prefix + index_str;
+
+	// The playlist refers to segments relative to itself
+	const auto separator = file_path.find_last_of("/\\");
+	segments.push_back({ separator == std::string::npos ? file_path : file_path.substr(separator + 1), 0.0 });
+
+	if (!writer.open(file_path)) {
+		success = false;
+		return;
+	}
+	writer.write_tables();
+	segment_open = true;
+}
+
+void HLSSegmenter::end_segment(const uint64_t end_PTS)
+{
+	if (!segment_open) {
+		return;
+	}
+	if (!writer.close()) {
+		success = false;
+	}
+	segment_open = false;
+
+	segments.back().duration = static_cast<double>(elapsed(end_PTS)) / PCR_FREQUENCY;
+}
+
+uint64_t HLSSegmenter::elapsed(const uint64_t PTS) const
+{
+	const auto by_PCR = pending_clock - segment_start;
+	if (PTS == UINT64_MAX || segment_PTS == UINT64_MAX) {
+		return by_PCR;
+	}
+
+	// The PTS jumps at a discontinuity, where the PCR clock holds
+	const auto by_PTS = ((PTS - segment_PTS) & PTS_MASK) * 300;
+	const auto difference = by_PTS > by_PCR ? by_PTS - by_PCR : by_PCR - by_PTS;
+	return difference > PCR_FREQUENCY ? by_PCR : by_PTS;
+}
+
+void HLSSegmenter::write_pending()
+{
+	if (segment_open) {
+		for (const auto& held : pending) {
+			writer.on_packet(held.PID, held.packet, held.block);
+		}
+	}
+	// Packets before the first keyframe are not decodable and are dropped
+	pending.clear();
+	pending_position = UINT64_MAX;
+}
+
+bool HLSSegmenter::close()
+{
+	write_pending();
+	// The last segment ends at the last PCR
+	pending_clock = clock;
+	end_segment(UINT64_MAX);
+
+	return write_playlist() && success;
+}
+
+/* RFC 8216 4.3 */
+bool HLSSegmenter::write_playlist()
+{
+	const auto file_path = output_prefix + ".m3u8";
+	auto file = fopen(file_path.c_str(), "w");
+	if (!file) {
+		fprintf(stderr, "file open failed. [%s]\n", file_path.c_str());
+		return false;
+	}
+
+	// EXT-X-TARGETDURATION bounds every EXTINF rounded to the nearest integer
+	double target = 0.0;
+	for (const auto& segment : segments) {
+		target = std::max(target, std::round(segment.duration));
+	}
+
+	fprintf(file, "#EXTM3U\n");
+	fprintf(file, "#EXT-X-VERSION:3\n");
+	fprintf(file, "#EXT-X-TARGETDURATION:%.0f\n", target);
+	fprintf(file, "#EXT-X-MEDIA-SEQUENCE:0\n");
+	fprintf(file, "#EXT-X-PLAYLIST-TYPE:VOD\n");
+	for (const auto& segment : segments) {
+		fprintf(file, "#EXTINF:%.3f,\n%s\n", segment.duration, segment.name.c_str());
+	}
+	fprintf(file, "#EXT-X-ENDLIST\n");
+
+	return fclose(file) == 0;
+}
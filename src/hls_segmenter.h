@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cinttypes>
+#include <memory>
+#include <string>
+#include <vector>
+#include "keyframe_indexer.h"
+#include "partial_ts_writer.h"
+
+struct ProgramMapSection;
+
+// Splits one program into segments of about target_duration seconds for
+// HTTP Live Streaming. Segments are cut only in front of the PES packet of
+// a video keyframe, and each starts with the PAT and PMT. Segment lengths
+// are the PTS differences of the keyframes, and the PCR for the last one.
+// Files are <prefix>_<n>.ts, listed in the playlist <prefix>.m3u8.
+class HLSSegmenter
+{
+public:
+	HLSSegmenter(const std::string& output_prefix, const uint16_t program_number,
+		const double target_duration);
+	~HLSSegmenter() = default;
+
+	void on_PMT(const ProgramMapSection& PMT);
+	void on_section(const uint16_t PID, const uint8_t* section, const uint16_t length);
+	void on_PCR(const uint16_t PID, const uint64_t PCR, const bool discontinuity_indicator);
+	// block owns packet; packets are written without a copy
+	void on_packet(const uint16_t PID, const uint8_t* packet, const uint64_t position,
+		const std::shared_ptr<uint8_t>& block);
+
+	// Ends the last segment and writes the playlist
+	bool close();
+
+private:
+	struct Segment
+	{
+		std::string name;
+		double      duration; // seconds
+	};
+
+	// A packet held back until its keyframe is decided
+	struct PendingPacket
+	{
+		uint16_t PID;
+		const uint8_t* packet;
+		std::shared_ptr<uint8_t> block;
+	};
+
+	// Packets held back at most; the keyframe is decided long before
+	static constexpr size_t max_pending = 256;
+
+	void on_keyframe(const Keyframe& keyframe);
+	void start_segment();
+	void end_segment(const uint64_t end_PTS);
+	// Time from the start of the segment to a keyframe at pending_clock, in 27MHz
+	uint64_t elapsed(const uint64_t PTS) const;
+	void write_pending();
+	bool write_playlist();
+
+	std::string output_prefix;
+	uint16_t    program_number;
+	uint64_t    target_duration; // 27MHz
+	bool        success;
+
+	uint16_t video_PID;
+	uint16_t PCR_PID;
+
+	// PCR unwrapped, and its value when the current segment started
+	uint64_t clock;
+	uint64_t last_PCR;
+	uint64_t segment_start;
+	uint64_t segment_PTS; // of the keyframe starting the segment
+
+	KeyframeIndexer  keyframe_indexer;
+	PartialTSWriter  writer;
+	bool             segment_open;
+
+	// Packets since the last PES start on video_PID
+	std::vector<PendingPacket> pending;
+	uint64_t pending_position;
+	uint64_t pending_clock;
+
+	std::vector<Segment> segments;
+};
@@ -0,0 +1,597 @@
+/*
+ * Reference: RFC 3550 RTP: A Transport Protocol for Real-Time Applications
+ *            RFC 2250 RTP Payload Format for MPEG1/MPEG2 Video
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include "input_source.h"
+#include "ts_packet.h"
+
+#if defined(_WIN32)
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <io.h>
+#include <fcntl.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+constexpr uintptr_t no_socket = INVALID_SOCKET;
+#else
+constexpr int no_socket = -1;
+#endif
+
+PipeSource::PipeSource() :
+	fd(-1),
+	nonblocking(false)
+{}
+
+PipeSource::~PipeSource()
+{
+	close();
+}
+
+bool PipeSource::open(const std::string& path)
+{
+	close();
+
+	if (path.empty() || path == "-") {
+#if defined(_WIN32)
+		fd = _fileno(stdin);
+		_setmode(fd, _O_BINARY);
+#else
+		fd = STDIN_FILENO;
+#endif
+		return true;
+	}
+
+#if defined(_WIN32)
+	fd = _open(path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+	fd = ::open(path.c_str(), O_RDONLY);
+#endif
+	if (fd < 0) {
+		fprintf(stderr, "file open failed. [%s]\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+void PipeSource::close()
+{
+	// Standard input is left open (and blocking)
+#if !defined(_WIN32)
+	if (nonblocking && fd >= 0) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	}
+#endif
+	nonblocking = false;
+	if (fd > 2) {
+#if defined(_WIN32)
+		_close(fd);
+#else
+		::close(fd);
+#endif
+	}
+	fd = -1;
+}
+
+size_t PipeSource::read(uint8_t* dst, const size_t length)
+{
+	if (fd < 0) {
+		return 0;
+	}
+
+	for (;;) {
+#if defined(_WIN32)
+		const auto result = _read(fd, dst, static_cast<unsigned int>(std::min<size_t>(length, INT32_MAX)));
+#else
+		const auto result = ::read(fd, dst, length);
+#endif
+		if (result >= 0) {
+			return static_cast<size_t>(result);
+		}
+#if !defined(_WIN32)
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			// Left non-blocking by read_ready()
+			struct pollfd pfd = { fd, POLLIN, 0 };
+			poll(&pfd, 1, -1);
+			continue;
+		}
+#endif
+		if (errno != EINTR) {
+			fprintf(stderr, "read failed. [%s]\n", strerror(errno));
+			return 0;
+		}
+	}
+}
+
+size_t PipeSource::read_ready(uint8_t* dst, const size_t length, bool* end)
+{
+	*end = false;
+	if (fd < 0) {
+		*end = true;
+		return 0;
+	}
+
+#if defined(_WIN32)
+	// No non-blocking pipes: only what is queued is read
+	DWORD available = 0;
+	if (PeekNamedPipe(reinterpret_cast<HANDLE>(_get_osfhandle(fd)), nullptr, 0, nullptr, &available, nullptr)
+		&& !available) {
+		return 0;
+	}
+	// A redirected file, or a pipe whose writer has gone
+	const auto count = read(dst, available ? std::min<size_t>(length, available) : length);
+	*end = count == 0;
+	return count;
+#else
+	if (!nonblocking) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		nonblocking = true;
+	}
+
+	for (;;) {
+		const auto result = ::read(fd, dst, length);
+		if (result > 0) {
+			return static_cast<size_t>(result);
+		}
+		if (result == 0) {
+			*end = true;
+			return 0;
+		}
+		if (errno == EAGAIN || errno == EWOULDBLOCK) {
+			return 0;
+		}
+		if (errno != EINTR) {
+			fprintf(stderr, "read failed. [%s]\n", strerror(errno));
+			*end = true;
+			return 0;
+		}
+	}
+#endif
+}
+
+FileSource::FileSource() :
+	fd(-1)
+{}
+
+FileSource::~FileSource()
+{
+	close();
+}
+
+bool FileSource::open(const std::string& file_path)
+{
+	close();
+
+#if defined(_WIN32)
+	fd = _open(file_path.c_str(), _O_RDONLY | _O_BINARY);
+#else
+	fd = ::open(file_path.c_str(), O_RDONLY);
+#endif
+	if (fd < 0) {
+		fprintf(stderr, "file open failed. [%s]\n", file_path.c_str());
+		return false;
+	}
+	// Without inotify, read() polls and get_fd() is -1
+	watcher.open(file_path);
+	return true;
+}
+
+void FileSource::close()
+{
+	if (fd >= 0) {
+#if defined(_WIN32)
+		_close(fd);
+#else
+		::close(fd);
+#endif
+	}
+	fd = -1;
+	watcher.close();
+}
+
+size_t FileSource::read_file(uint8_t* dst, const size_t length)
+{
+	for (;;) {
+#if defined(_WIN32)
+		const auto result = _read(fd, dst, static_cast<unsigned int>(std::min<size_t>(length, INT32_MAX)));
+#else
+		const auto result = ::read(fd, dst, length);
+#endif
+		if (result >= 0) {
+			return static_cast<size_t>(result);
+		}
+		if (errno != EINTR) {
+			fprintf(stderr, "read failed. [%s]\n", strerror(errno));
+			return 0;
+		}
+	}
+}
+
+size_t FileSource::read(uint8_t* dst, const size_t length)
+{
+	while (fd >= 0) {
+		if (const auto count = read_file(dst, length)) {
+			return count;
+		}
+		watcher.wait(poll_interval);
+	}
+	return 0;
+}
+
+size_t FileSource::read_ready(uint8_t* dst, const size_t length, bool* end)
+{
+	*end = fd < 0;
+	if (*end) {
+		return 0;
+	}
+
+	if (const auto count = read_file(dst, length)) {
+		return count;
+	}
+	// Take the pending notifications before the last look, so that a write
+	// after it is notified again
+	watcher.wait(0);
+	return read_file(dst, length);
+}
+
+UdpSource::UdpSource() :
+	sock(no_socket),
+	timeout_ms(-1),
+	batch(batch_size * datagram_size),
+	ready_offset(0),
+	sequencing(false),
+	next_sequence_number(0),
+	held(reorder_depth),
+	held_count(0),
+	lost_packets(0),
+	reordered_packets(0),
+	sequence_resets(0)
+{}
+
+UdpSource::~UdpSource()
+{
+	close();
+}
+
+bool UdpSource::open(const std::string& address, const uint16_t port,
+	const std::string& interface_address)
+{
+	close();
+
+#if defined(_WIN32)
+	WSADATA wsa_data;
+	if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+		return false;
+	}
+#endif
+
+	struct sockaddr_in local = {};
+	local.sin_family = AF_INET;
+	local.sin_port = htons(port);
+	local.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	struct in_addr group = {};
+	auto multicast = false;
+	if (!address.empty()) {
+		if (inet_pton(AF_INET, address.c_str(), &group) != 1) {
+			fprintf(stderr, "invalid address. [%s]\n", address.c_str());
+			return false;
+		}
+		multicast = IN_MULTICAST(ntohl(group.s_addr));
+		if (!multicast) {
+			local.sin_addr = group;
+		}
+	}
+
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock == no_socket) {
+		fprintf(stderr, "socket failed.\n");
+		return false;
+	}
+
+	// Several receivers may share a multicast group on one host
+	const int reuse = 1;
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&reuse), sizeof(reuse));
+	// Room for bursts while the parser works on the previous batch
+	const int receive_buffer = 8 << 20;
+	setsockopt(sock, SOL_SOCKET, SO_RCVBUF, reinterpret_cast<const char*>(&receive_buffer), sizeof(receive_buffer));
+
+	if (bind(sock, reinterpret_cast<const struct sockaddr*>(&local), sizeof(local)) != 0) {
+		fprintf(stderr, "bind failed. [%s:%u]\n", address.c_str(), port);
+		close();
+		return false;
+	}
+
+	if (multicast) {
+		struct ip_mreq request = {};
+		request.imr_multiaddr = group;
+		request.imr_interface.s_addr = htonl(INADDR_ANY);
+		if (!interface_address.empty()) {
+			inet_pton(AF_INET, interface_address.c_str(), &request.imr_interface);
+		}
+		if (setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+			reinterpret_cast<const char*>(&request), sizeof(request)) != 0) {
+			fprintf(stderr, "multicast join failed. [%s]\n", address.c_str());
+			close();
+			return false;
+		}
+	}
+
+	set_timeout(timeout_ms);
+
+	ready.clear();
+	ready_offset = 0;
+	sequencing = false;
+	held_count = 0;
+	for (auto& slot : held) {
+		slot.used = false;
+	}
+	return true;
+}
+
+void UdpSource::close()
+{
+	if (sock == no_socket) {
+		return;
+	}
+#if defined(_WIN32)
+	closesocket(sock);
+	WSACleanup();
+#else
+	::close(sock);
+#endif
+	sock = no_socket;
+}
+
+void UdpSource::set_timeout(const int timeout_ms)
+{
+	this->timeout_ms = timeout_ms;
+	if (sock == no_socket) {
+		return;
+	}
+
+	// 0 blocks forever
+#if defined(_WIN32)
+	const DWORD timeout = timeout_ms < 0 ? 0 : timeout_ms;
+#else
+	struct timeval timeout = {};
+	if (timeout_ms > 0) {
+		timeout.tv_sec = timeout_ms / 1000;
+		timeout.tv_usec = (timeout_ms % 1000) * 1000;
+	}
+#endif
+	setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+}
+
+size_t UdpSource::read(uint8_t* dst, const size_t length)
+{
+	bool end;
+	while (ready_offset == ready.size()) {
+		ready.clear();
+		ready_offset = 0;
+		if (!receive_batch(true, &end)) {
+			// End of input: what is held will not be completed
+			release_held(true);
+			if (ready.empty()) {
+				return 0;
+			}
+		}
+	}
+
+	const auto count = std::min(length, ready.size() - ready_offset);
+	std::memcpy(dst, &ready[ready_offset], count);
+	ready_offset += count;
+	return count;
+}
+
+size_t UdpSource::read_ready(uint8_t* dst, const size_t length, bool* end)
+{
+	*end = false;
+	while (ready_offset == ready.size()) {
+		ready.clear();
+		ready_offset = 0;
+		if (!receive_batch(false, end)) {
+			if (!*end) {
+				return 0;
+			}
+			release_held(true);
+			if (ready.empty()) {
+				return 0;
+			}
+			*end = false; // reported by the next call
+		}
+	}
+
+	const auto count = std::min(length, ready.size() - ready_offset);
+	std::memcpy(dst, &ready[ready_offset], count);
+	ready_offset += count;
+	return count;
+}
+
+bool UdpSource::receive_batch(const bool wait, bool* end)
+{
+	*end = true;
+	if (sock == no_socket) {
+		return false;
+	}
+
+#if defined(__linux__)
+	// One system call takes every datagram already queued, up to batch_size
+	struct mmsghdr messages[batch_size];
+	struct iovec iov[batch_size];
+	for (size_t i = 0; i < batch_size; ++i) {
+		iov[i].iov_base = &batch[i * datagram_size];
+		iov[i].iov_len = datagram_size;
+		messages[i] = {};
+		messages[i].msg_hdr.msg_iov = &iov[i];
+		messages[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	int count;
+	do {
+		count = recvmmsg(sock, messages, batch_size, wait ? MSG_WAITFORONE : MSG_DONTWAIT, nullptr);
+	} while (count < 0 && errno == EINTR);
+	if (count <= 0) {
+		*end = wait || (errno != EAGAIN && errno != EWOULDBLOCK);
+		return false;
+	}
+
+	for (auto i = 0; i < count; ++i) {
+		if (!(messages[i].msg_hdr.msg_flags & MSG_TRUNC)) {
+			on_datagram(&batch[i * datagram_size], messages[i].msg_len);
+		}
+	}
+#else
+	int length;
+	do {
+#if defined(_WIN32)
+		// Only called without wait once a datagram is known to be there
+		length = recv(sock, reinterpret_cast<char*>(batch.data()), datagram_size, 0);
+#else
+		length = recv(sock, reinterpret_cast<char*>(batch.data()), datagram_size, wait ? 0 : MSG_DONTWAIT);
+#endif
+	} while (length < 0 && errno == EINTR);
+	if (length <= 0) {
+#if !defined(_WIN32)
+		*end = wait || (errno != EAGAIN && errno != EWOULDBLOCK);
+#endif
+		return false;
+	}
+	on_datagram(batch.data(), length);
+#endif
+	*end = false;
+	return true;
+}
+
+/* RFC 3550 5.1, RFC 2250 2 */
+void UdpSource::on_datagram(const uint8_t* data, const size_t length)
+{
+	// Raw TS: datagrams start with a sync_byte
+	if (length == 0 || data[0] == TS_SYNC_BYTE) {
+		ready.insert(ready.end(), data, data + length);
+		return;
+	}
+
+	// RTP version 2 header
+	if ((data[0] >> 6) != 2 || length < 12) {
+		return;
+	}
+	const auto padding = (data[0] & 0x20) != 0;
+	const auto extension = (data[0] & 0x10) != 0;
+	const auto CSRC_count = data[0] & 0x0f;
+	const uint16_t sequence_number = data[2] << 8 | data[3];
+
+	size_t header_length = 12 + 4 * CSRC_count;
+	if (extension) {
+		if (header_length + 4 > length) {
+			return;
+		}
+		header_length += 4 + 4 * (data[header_length + 2] << 8 | data[header_length + 3]);
+	}
+	auto end = length;
+	if (padding) {
+		end -= std::min<size_t>(data[length - 1], end);
+	}
+	if (header_length >= end) {
+		return;
+	}
+	const auto payload = data + header_length;
+	const auto payload_length = end - header_length;
+
+	if (!sequencing) {
+		sequencing = true;
+		next_sequence_number = sequence_number;
+	}
+
+	auto distance = static_cast<int16_t>(sequence_number - next_sequence_number);
+	if (distance < -static_cast<int16_t>(reorder_depth)) {
+		// Too far back to be late: the sender restarted its sequence.
+		// What is held goes out, and the sequence follows the new one.
+		release_held(true);
+		++sequence_resets;
+		next_sequence_number = sequence_number;
+		distance = 0;
+	}
+	else if (distance < 0) {
+		// Duplicate, or late past the window and already counted lost
+		return;
+	}
+	if (distance == 0 && held_count == 0) {
+		ready.insert(ready.end(), payload, payload + payload_length);
+		++next_sequence_number;
+		return;
+	}
+
+	if (distance >= static_cast<int16_t>(reorder_depth)) {
+		// The window is full: whatever is missing before it is lost
+		const uint16_t window_start = sequence_number - reorder_depth + 1;
+		while (static_cast<int16_t>(window_start - next_sequence_number) > 0) {
+			if (!held_count) {
+				lost_packets += static_cast<uint16_t>(window_start - next_sequence_number);
+				next_sequence_number = window_start;
+				break;
+			}
+			auto& slot = held[next_sequence_number % reorder_depth];
+			if (slot.used) {
+				ready.insert(ready.end(), slot.data, slot.data + slot.length);
+				slot.used = false;
+				--held_count;
+			}
+			else {
+				++lost_packets;
+			}
+			++next_sequence_number;
+		}
+		release_held(false);
+		distance = static_cast<int16_t>(sequence_number - next_sequence_number);
+	}
+
+	auto& slot = held[sequence_number % reorder_depth];
+	if (slot.used) {
+		return; // duplicate
+	}
+	if (distance == 0 && held_count) {
+		++reordered_packets;
+	}
+	std::memcpy(slot.data, payload, payload_length);
+	slot.length = static_cast<uint16_t>(payload_length);
+	slot.used = true;
+	++held_count;
+
+	release_held(false);
+}
+
+// Moves held packets in sequence to ready, stopping at the first gap
+// unless skip_gap is set
+void UdpSource::release_held(const bool skip_gap)
+{
+	while (held_count) {
+		auto& slot = held[next_sequence_number % reorder_depth];
+		if (slot.used) {
+			ready.insert(ready.end(), slot.data, slot.data + slot.length);
+			slot.used = false;
+			--held_count;
+		}
+		else if (skip_gap) {
+			++lost_packets;
+		}
+		else {
+			break;
+		}
+		++next_sequence_number;
+	}
+}
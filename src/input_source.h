@@ -0,0 +1,150 @@
+#pragma once
+
+#include <cinttypes>
+#include <string>
+#include <vector>
+#include "file_watcher.h"
+
+// A non-seekable byte stream the parser reads from instead of a file
+class InputSource
+{
+public:
+	virtual ~InputSource() = default;
+
+	// Blocks until some bytes are available and copies at most length of
+	// them to dst. Returns 0 at the end of the input.
+	virtual size_t read(uint8_t* dst, const size_t length) = 0;
+
+	// Like read() without blocking: returns 0 with *end unset when nothing
+	// is ready yet
+	virtual size_t read_ready(uint8_t* dst, const size_t length, bool* end) = 0;
+
+	// Descriptor that becomes readable when read_ready() has something,
+	// for epoll (-1 if there is none)
+	virtual int get_fd() const = 0;
+};
+
+// Standard input, or a pipe / FIFO opened by path
+class PipeSource : public InputSource
+{
+public:
+	PipeSource();
+	~PipeSource() override;
+
+	PipeSource(const PipeSource&) = delete;
+	PipeSource& operator=(const PipeSource&) = delete;
+
+	// "-" (or empty) selects standard input
+	bool open(const std::string& path);
+	void close();
+
+	size_t read(uint8_t* dst, const size_t length) override;
+	size_t read_ready(uint8_t* dst, const size_t length, bool* end) override;
+	int get_fd() const override { return fd; }
+
+private:
+	int  fd;
+	bool nonblocking; // O_NONBLOCK set by read_ready()
+};
+
+// A file still being written, read as it grows. It never ends by itself.
+class FileSource : public InputSource
+{
+public:
+	FileSource();
+	~FileSource() override;
+
+	FileSource(const FileSource&) = delete;
+	FileSource& operator=(const FileSource&) = delete;
+
+	bool open(const std::string& file_path);
+	void close();
+
+	size_t read(uint8_t* dst, const size_t length) override;
+	size_t read_ready(uint8_t* dst, const size_t length, bool* end) override;
+	// The inotify descriptor; files themselves are always readable
+	int get_fd() const override { return watcher.get_fd(); }
+
+private:
+	// Longest wait in read() without a change notification
+	static constexpr int poll_interval = 50; // ms
+
+	size_t read_file(uint8_t* dst, const size_t length);
+
+	int fd;
+	FileWatcher watcher;
+};
+
+// TS over UDP, unicast or multicast (IPv4), with or without RTP headers.
+// Datagrams are received in batches; RTP packets are put back in sequence
+// order within a window of reorder_depth packets, and given up as lost
+// past it.
+class UdpSource : public InputSource
+{
+public:
+	UdpSource();
+	~UdpSource() override;
+
+	UdpSource(const UdpSource&) = delete;
+	UdpSource& operator=(const UdpSource&) = delete;
+
+	// address is the multicast group to join, or the local address to bind
+	// ("" for any). interface selects the interface of a multicast group.
+	bool open(const std::string& address, const uint16_t port,
+		const std::string& interface_address = "");
+	void close();
+
+	// read() ends the input after timeout_ms without datagrams (default: never)
+	void set_timeout(const int timeout_ms);
+
+	size_t read(uint8_t* dst, const size_t length) override;
+	size_t read_ready(uint8_t* dst, const size_t length, bool* end) override;
+	int get_fd() const override { return static_cast<int>(sock); }
+
+	uint64_t get_lost_packets() const { return lost_packets; }
+	uint64_t get_reordered_packets() const { return reordered_packets; }
+	// Times the RTP sequence jumped back past the window (sender restarts)
+	uint64_t get_sequence_resets() const { return sequence_resets; }
+
+private:
+	// Datagrams received per call, and the largest one taken
+	static constexpr size_t batch_size    = 64;
+	static constexpr size_t datagram_size = 2048;
+	// RTP packets held waiting for a missing sequence number
+	static constexpr size_t reorder_depth = 16;
+
+	struct Held
+	{
+		bool     used;
+		uint16_t length;
+		uint8_t  data[datagram_size];
+	};
+
+	// Returns false on timeout or error; with wait unset also when no
+	// datagram is queued, telling the cases apart by *end
+	bool receive_batch(const bool wait, bool* end);
+	void on_datagram(const uint8_t* data, const size_t length);
+	void release_held(const bool skip_gap);
+
+#if defined(_WIN32)
+	uintptr_t sock;
+#else
+	int sock;
+#endif
+	int timeout_ms;
+
+	std::vector<uint8_t> batch;   // batch_size datagrams of datagram_size
+
+	// TS bytes ready to be read, from ready_offset on
+	std::vector<uint8_t> ready;
+	size_t ready_offset;
+
+	bool     sequencing;          // an RTP packet has been seen
+	uint16_t next_sequence_number;
+	std::vector<Held> held;       // indexed by sequence_number % reorder_depth
+	size_t   held_count;
+
+	uint64_t lost_packets;
+	uint64_t reordered_packets;
+	uint64_t sequence_resets;
+};
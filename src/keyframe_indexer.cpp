@@ -0,0 +1,251 @@
+/*
+ * Reference: ITU-T Rec. H.262 | ISO/IEC 13818-2
+ *            ITU-T Rec. H.264 | ISO/IEC 14496-10
+ *            ITU-T Rec. H.265 | ISO/IEC 23008-2
+ */
+
+#include <algorithm>
+#include <cstring>
+#include "keyframe_indexer.h"
+#include "ts_tables.h"
+
+// Bytes after a start code needed to classify the unit
+constexpr size_t unit_header_length = 8;
+
+// Reads the slice_type of an H.264 slice header: first_mb_in_slice and
+// slice_type are the first two ue(v) after the NAL unit header
+static bool read_slice_type(const uint8_t* p, const size_t length, uint32_t* slice_type)
+{
+	// Drop emulation_prevention_three_byte
+	uint8_t rbsp[unit_header_length];
+	size_t rbsp_length = 0;
+	for (size_t i = 0; i < length && rbsp_length < sizeof(rbsp); ++i) {
+		if (i >= 2 && p[i] == 0x03 && p[i - 1] == 0x00 && p[i - 2] == 0x00) {
+			continue;
+		}
+		rbsp[rbsp_length++] = p[i];
+	}
+
+	size_t bit = 0;
+	auto read_bit = [&]() -> int {
+		if (bit >= rbsp_length * 8) {
+			return -1;
+		}
+		const auto value = (rbsp[bit / 8] >> (7 - bit % 8)) & 1;
+		++bit;
+		return value;
+	};
+	auto read_ue = [&](uint32_t* value) {
+		int leading_zero_bits = 0;
+		for (int b = read_bit(); b == 0; b = read_bit()) {
+			if (++leading_zero_bits > 31) {
+				return false;
+			}
+		}
+		uint32_t suffix = 0;
+		for (auto i = 0; i < leading_zero_bits; ++i) {
+			const auto b = read_bit();
+			if (b < 0) {
+				return false;
+			}
+			suffix = suffix << 1 | b;
+		}
+		*value = (1U << leading_zero_bits) - 1 + suffix;
+		return bit <= rbsp_length * 8;
+	};
+
+	uint32_t first_mb_in_slice;
+	return read_ue(&first_mb_in_slice) && read_ue(slice_type);
+}
+
+KeyframeIndexer::KeyframeIndexer() :
+	videos(TS_PID_MAX)
+{}
+
+void KeyframeIndexer::on_PMT(const ProgramMapSection& PMT)
+{
+	for (const auto& info : PMT.ES_list) {
+		Codec codec;
+		switch (static_cast<StreamType>(info.stream_type)) {
+		case StreamType::STREAM_VIDEO_MPEG1:
+		case StreamType::STREAM_VIDEO_MPEG2:
+			codec = Codec::MPEG2;
+			break;
+		case StreamType::STREAM_VIDEO_AVC:
+			codec = Codec::H264;
+			break;
+		case StreamType::STREAM_VIDEO_HEVC:
+			codec = Codec::HEVC;
+			break;
+		default:
+			continue;
+		}
+
+		auto& video = videos[info.elementary_PID];
+		if (!video || video->codec != codec) {
+			video = std::make_unique<VideoPID>();
+			*video = {};
+			video->codec = codec;
+		}
+	}
+}
+
+void KeyframeIndexer::on_keyframe(std::function<void(const Keyframe&)> handler)
+{
+	this->handler = std::move(handler);
+}
+
+void KeyframeIndexer::on_packet(const uint16_t PID, const uint8_t* packet, const uint64_t position)
+{
+	const auto& video = videos[PID];
+	if (!video || !(packet[3] & 0x10)) {
+		return;
+	}
+
+	const auto has_adaptation_field = (packet[3] & 0x20) != 0;
+	const size_t payload_offset = has_adaptation_field ? 5 + packet[4] : 4;
+	if (payload_offset >= TS_PACKET_SIZE) {
+		return;
+	}
+	const auto payload = packet + payload_offset;
+	const auto payload_length = TS_PACKET_SIZE - payload_offset;
+
+	if (!(packet[1] & 0x40)) {
+		if (video->scanning) {
+			if (++video->scanned_packets < max_scan_packets) {
+				scan(*video, payload, payload_length);
+			}
+			else {
+				video->scanning = false;
+			}
+		}
+		return;
+	}
+
+	// A new PES packet
+	const auto random_access = has_adaptation_field && packet[4] > 0 && (packet[5] & 0x40);
+	if (random_access) {
+		video->hinted = true;
+	}
+	video->scanning = !video->hinted || random_access;
+	if (!video->scanning) {
+		return;
+	}
+
+	PesPacket pes;
+	uint16_t header_length;
+	if (!parse_PES_header(payload, payload_length, &pes, &header_length) || header_length > payload_length) {
+		video->scanning = false;
+		return;
+	}
+
+	video->frame = { PID, (pes.PTS_DTS_flags & 0x2) ? pes.PTS : UINT64_MAX, position,
+		FrameType::I, random_access };
+	video->parameter_sets = false;
+	video->scanned_packets = 0;
+	video->carry_length = 0;
+
+	scan(*video, payload + header_length, payload_length - header_length);
+}
+
+void KeyframeIndexer::scan(VideoPID& video, const uint8_t* payload, const size_t length)
+{
+	// Start codes may straddle packets: the tail of the last payload goes first
+	uint8_t buffer[sizeof(video.carry) + TS_PACKET_SIZE];
+	std::memcpy(buffer, video.carry, video.carry_length);
+	std::memcpy(buffer + video.carry_length, payload, length);
+	const auto n = video.carry_length + length;
+
+	for (size_t i = 0; i + 3 <= n; ++i) {
+		if (buffer[i] != 0x00 || buffer[i + 1] != 0x00 || buffer[i + 2] != 0x01) {
+			continue;
+		}
+		if (n - (i + 3) < unit_header_length) {
+			// Classified with the next packet
+			video.carry_length = static_cast<uint8_t>(n - i);
+			std::memcpy(video.carry, &buffer[i], video.carry_length);
+			return;
+		}
+		if (check_unit(video, &buffer[i + 3], n - (i + 3))) {
+			video.scanning = false;
+			return;
+		}
+	}
+
+	video.carry_length = static_cast<uint8_t>(std::min<size_t>(n, 2));
+	std::memcpy(video.carry, &buffer[n - video.carry_length], video.carry_length);
+}
+
+bool KeyframeIndexer::check_unit(VideoPID& video, const uint8_t* p, const size_t length)
+{
+	switch (video.codec) {
+	case Codec::MPEG2:
+		if (p[0] == 0xb3 || p[0] == 0xb8) { // sequence_header_code, group_start_code
+			video.parameter_sets = true;
+			return false;
+		}
+		if (p[0] == 0x00) { // picture_start_code
+			const auto picture_coding_type = (p[2] >> 3) & 0x07;
+			if (picture_coding_type == 1) {
+				emit(video, FrameType::I);
+			}
+			return true;
+		}
+		return false;
+
+	case Codec::H264: {
+		const auto nal_unit_type = p[0] & 0x1f;
+		if (nal_unit_type == 7) { // SPS
+			video.parameter_sets = true;
+			return false;
+		}
+		if (nal_unit_type == 5) {
+			emit(video, FrameType::IDR);
+			return true;
+		}
+		if (nal_unit_type == 1) {
+			// An I slice after an SPS: a recovery point of an open GOP
+			uint32_t slice_type;
+			if (video.parameter_sets && read_slice_type(p + 1, length - 1, &slice_type)
+				&& (slice_type % 5 == 2 || slice_type % 5 == 4)) {
+				emit(video, FrameType::I);
+			}
+			return true;
+		}
+		return false;
+	}
+
+	case Codec::HEVC: {
+		const auto nal_unit_type = (p[0] >> 1) & 0x3f;
+		if (nal_unit_type >= 32 && nal_unit_type <= 34) { // VPS, SPS, PPS
+			video.parameter_sets = true;
+			return false;
+		}
+		if (nal_unit_type >= 32) {
+			return false;
+		}
+		if (nal_unit_type >= 16 && nal_unit_type <= 18) {
+			emit(video, FrameType::BLA);
+		}
+		else if (nal_unit_type == 19 || nal_unit_type == 20) {
+			emit(video, FrameType::IDR);
+		}
+		else if (nal_unit_type == 21) {
+			emit(video, FrameType::CRA);
+		}
+		return true; // the first VCL NAL unit decides
+	}
+
+	default:
+		return true;
+	}
+}
+
+void KeyframeIndexer::emit(VideoPID& video, const FrameType type)
+{
+	video.frame.type = type;
+	keyframes.push_back(video.frame);
+	if (handler) {
+		handler(video.frame);
+	}
+}
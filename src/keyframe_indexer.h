@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cinttypes>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "ts_packet.h"
+
+struct ProgramMapSection;
+
+enum class FrameType : uint8_t
+{
+	I,   // MPEG-2 I picture, or H.264 I slice without IDR (open GOP)
+	IDR, // H.264/HEVC instantaneous decoding refresh
+	CRA, // HEVC clean random access
+	BLA, // HEVC broken link access
+};
+
+struct Keyframe
+{
+	uint16_t  PID;
+	uint64_t  PTS;       // 90kHz; UINT64_MAX when the PES has none
+	uint64_t  position;  // byte offset of the first TS packet of the PES
+	FrameType type;
+	bool      random_access_indicator;
+};
+
+// Finds I/IDR/IRAP pictures of the video PIDs without decoding them.
+// Only the start of each PES payload is scanned for start codes; once a
+// PID has set random_access_indicator, PES packets without it are
+// skipped, the flag being trusted as a hint.
+class KeyframeIndexer
+{
+public:
+	KeyframeIndexer();
+	~KeyframeIndexer() = default;
+
+	void on_PMT(const ProgramMapSection& PMT);
+	void on_packet(const uint16_t PID, const uint8_t* packet, const uint64_t position);
+
+	// Called for each keyframe as it is found
+	void on_keyframe(std::function<void(const Keyframe&)> handler);
+
+	const std::vector<Keyframe>& get_keyframes() const { return keyframes; }
+	// Whether PID is a video stream looked at for keyframes
+	bool is_video_PID(const uint16_t PID) const { return static_cast<bool>(videos[PID]); }
+
+private:
+	enum class Codec : uint8_t { none, MPEG2, H264, HEVC };
+
+	// Scan state of the PES being looked at on one PID
+	struct VideoPID
+	{
+		Codec    codec;
+		bool     hinted;      // random_access_indicator has been seen
+		bool     scanning;
+		bool     parameter_sets; // sequence header / SPS / VPS seen in this PES
+		uint8_t  scanned_packets;
+		Keyframe frame;
+		uint8_t  carry[16];   // unscanned tail of the previous payload
+		uint8_t  carry_length;
+	};
+
+	// Packets of a PES scanned before giving up on finding a picture
+	static constexpr uint8_t max_scan_packets = 8;
+
+	void scan(VideoPID& video, const uint8_t* payload, const size_t length);
+	// Returns true once the PES is decided (keyframe or not)
+	bool check_unit(VideoPID& video, const uint8_t* p, const size_t length);
+	void emit(VideoPID& video, const FrameType type);
+
+	std::vector<std::unique_ptr<VideoPID>> videos; // indexed by PID
+	std::vector<Keyframe> keyframes;
+	std::function<void(const Keyframe&)> handler;
+};
@@ -0,0 +1,176 @@
+/*
+ * Reference: ITU-T Rec. H.222.0 (05/2006)
+ *            ARIB TR-B14
+ */
+
+#include <algorithm>
+#include "partial_ts_writer.h"
+#include "crc32.h"
+#include "ts_tables.h"
+
+PartialTSWriter::PartialTSWriter(const uint16_t program_number) :
+	program_number(program_number),
+	program_map_PID(TS_PID_MAX),
+	success(true),
+	pass_PIDs(TS_PID_MAX, false),
+	PAT_continuity_counter(0x0f),
+	PMT_continuity_counter(0x0f)
+{}
+
+bool PartialTSWriter::open(const std::string& file_path)
+{
+	success = output.open(file_path);
+	return success;
+}
+
+bool PartialTSWriter::close()
+{
+	return output.close() && success;
+}
+
+void PartialTSWriter::set_stream_filter(
+	std::function<bool(const uint8_t stream_type, const uint16_t PID)> filter)
+{
+	stream_filter = std::move(filter);
+}
+
+void PartialTSWriter::on_packet(const uint16_t PID, const uint8_t* packet,
+	const std::shared_ptr<uint8_t>& block)
+{
+	if (!pass_PIDs[PID] || !output.is_open()) {
+		return;
+	}
+	// aliases the input block: the packet is not copied
+	if (!output.append(PayloadSlice{ std::shared_ptr<const uint8_t>(block, packet), TS_PACKET_SIZE })) {
+		success = false;
+	}
+}
+
+void PartialTSWriter::on_section(const uint16_t PID, const uint8_t* section, const uint16_t length)
+{
+	if (PID == 0x0000 && section[0] == 0x00) {
+		write_PAT(section);
+	}
+	else if (PID == program_map_PID && section[0] == 0x02) {
+		write_PMT(section, length);
+	}
+}
+
+/* ITU-T Rec. H.222.0 */
+void PartialTSWriter::write_PAT(const uint8_t* section)
+{
+	ProgramAssociationSection PAT;
+	if (!PAT.parse(section, nullptr)) {
+		return;
+	}
+
+	// Only the selected program is left
+	ProgramAssociationSection partial = PAT;
+	partial.network_PIDs.clear();
+	partial.PMT_list.clear();
+	for (const auto& info : PAT.PMT_list) {
+		if (info.program_number == program_number) {
+			partial.PMT_list.push_back(info);
+		}
+	}
+	if (partial.PMT_list.empty()) {
+		return;
+	}
+
+	program_map_PID = partial.PMT_list.front().program_map_PID;
+
+	partial.write(&PAT_data);
+	write_section(0x0000, PAT_data);
+}
+
+/* ITU-T Rec. H.222.0 */
+void PartialTSWriter::write_PMT(const uint8_t* section, const uint16_t length)
+{
+	ProgramMapSection PMT;
+	if (!PMT.parse(section, nullptr) || PMT.program_number != program_number) {
+		return;
+	}
+
+	// The descriptors are kept as they are, so the section is rebuilt from
+	// the original bytes leaving out the ES loop entries filtered away
+	const auto es_loop = 12 + PMT.program_info_length;
+	const auto end = length - crc::CRC32_SIZE;
+
+	PMT_data.assign(section, section + es_loop);
+
+	std::fill(pass_PIDs.begin(), pass_PIDs.end(), false);
+	// The null PID stands for no PCR, and no CA_PID
+	auto pass = [this](const uint16_t PID) {
+		if (PID != 0x1FFF) {
+			pass_PIDs[PID] = true;
+		}
+	};
+	// ECMs the program or one of its streams is scrambled with (CA_descriptor)
+	auto pass_ECM_PIDs = [&pass](const uint8_t* p, const uint8_t* tail) {
+		while (p + 2 <= tail) {
+			const auto descriptor_tag = p[0];
+			const auto descriptor_length = p[1];
+			if (descriptor_tag == 0x09 && descriptor_length >= 4 && p + 6 <= tail) {
+				pass((p[4] & 0x1f) << 8 | p[5]);
+			}
+			p += 2 + descriptor_length;
+		}
+	};
+	pass_ECM_PIDs(section + 12, section + std::min<size_t>(es_loop, end));
+
+	for (auto i = es_loop; i + 5 <= end;) {
+		const auto stream_type = section[i];
+		const uint16_t elementary_PID = (section[i + 1] & 0x1f) << 8 | section[i + 2];
+		const auto entry_length = 5 + ((section[i + 3] & 0x0f) << 8 | section[i + 4]);
+		if (i + entry_length > end) {
+			break;
+		}
+
+		if (!stream_filter || stream_filter(stream_type, elementary_PID)) {
+			PMT_data.insert(PMT_data.end(), section + i, section + i + entry_length);
+			pass(elementary_PID);
+			pass_ECM_PIDs(section + i + 5, section + i + entry_length);
+		}
+		i += entry_length;
+	}
+	pass(PMT.PCR_PID);
+
+	const auto section_length = PMT_data.size() - 3 + crc::CRC32_SIZE;
+	PMT_data[1] = (PMT_data[1] & 0xf0) | ((section_length >> 8) & 0x0f);
+	PMT_data[2] = section_length & 0xff;
+
+	const auto CRC_32 = crc::_crc32(PMT_data.data(), PMT_data.size());
+	PMT_data.push_back((CRC_32 >> 24) & 0xff);
+	PMT_data.push_back((CRC_32 >> 16) & 0xff);
+	PMT_data.push_back((CRC_32 >>  8) & 0xff);
+	PMT_data.push_back( CRC_32        & 0xff);
+
+	write_section(program_map_PID, PMT_data);
+}
+
+void PartialTSWriter::write_tables()
+{
+	if (!PAT_data.empty()) {
+		write_section(0x0000, PAT_data);
+	}
+	if (!PMT_data.empty()) {
+		write_section(program_map_PID, PMT_data);
+	}
+}
+
+void PartialTSWriter::write_section(const uint16_t PID, const std::vector<uint8_t>& section)
+{
+	if (!output.is_open()) {
+		return;
+	}
+
+	auto& continuity_counter = (PID == 0x0000) ? PAT_continuity_counter : PMT_continuity_counter;
+
+	packet_data.clear();
+	packetize_section(PID, section.data(), static_cast<uint16_t>(section.size()),
+		&continuity_counter, &packet_data);
+
+	if (!output.append(packet_data.data(), packet_data.size())) {
+		success = false;
+	}
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cinttypes>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "vectored_writer.h"
+
+// Cuts a multiplex down to one program (partial TS).
+// The program's elementary streams, PCR and ECMs are passed through
+// untouched, the PAT and the PMT are regenerated, and every other PID is
+// dropped.
+// Output is plain 188-byte TS whatever the input unit size.
+class PartialTSWriter
+{
+public:
+	explicit PartialTSWriter(const uint16_t program_number);
+	~PartialTSWriter() = default;
+
+	bool open(const std::string& file_path);
+	bool close();
+
+	// Selects the elementary streams kept in the PMT (default: all of them)
+	void set_stream_filter(std::function<bool(const uint8_t stream_type, const uint16_t PID)> filter);
+
+	void on_section(const uint16_t PID, const uint8_t* section, const uint16_t length);
+	// block owns packet; passed-through packets are queued without a copy
+	void on_packet(const uint16_t PID, const uint8_t* packet, const std::shared_ptr<uint8_t>& block);
+
+	// Writes the last regenerated PAT and PMT again (e.g. at the head of a new file)
+	void write_tables();
+
+private:
+	void write_PAT(const uint8_t* section);
+	void write_PMT(const uint8_t* section, const uint16_t length);
+	void write_section(const uint16_t PID, const std::vector<uint8_t>& section);
+
+	uint16_t program_number;
+	uint16_t program_map_PID;
+	bool     success;
+
+	std::function<bool(const uint8_t, const uint16_t)> stream_filter;
+
+	// PIDs copied to the output as they are
+	std::vector<bool> pass_PIDs;
+
+	// Continuity counters of the regenerated PAT/PMT
+	uint8_t PAT_continuity_counter;
+	uint8_t PMT_continuity_counter;
+
+	// Regenerated sections, kept for write_tables()
+	std::vector<uint8_t> PAT_data;
+	std::vector<uint8_t> PMT_data;
+	std::vector<uint8_t> packet_data;
+
+	VectoredWriter output;
+};
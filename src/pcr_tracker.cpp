@@ -0,0 +1,188 @@
+/*
+ * Reference: ITU-T Rec. H.222.0 (05/2006) 2.4.2.2
+ *            ETSI TR 101 290 5.3.2
+ */
+
+#include "pcr_tracker.h"
+#include "ts_tables.h"
+
+double PcrTracker::Clock::ticks_per_byte() const
+{
+	if (segment_count < 2) {
+		return 0;
+	}
+	const auto n = static_cast<double>(segment_count);
+	const auto denominator = n * sum_xx - sum_x * sum_x;
+	if (denominator <= 0) {
+		return 0;
+	}
+	return (n * sum_xy - sum_x * sum_y) / denominator;
+}
+
+double PcrTracker::Clock::average_bytes_per_tick() const
+{
+	const auto bytes = closed_bytes + (last_position - first_position);
+	const auto ticks = closed_ticks + (last_PCR - first_PCR);
+	if (!ticks) {
+		return 0;
+	}
+	return static_cast<double>(bytes) / ticks;
+}
+
+bool PcrTracker::Clock::estimate_PCR(const uint64_t position, uint64_t* PCR) const
+{
+	const auto slope = ticks_per_byte();
+	if (slope <= 0) {
+		return false;
+	}
+	// y = mean_y + slope * (x - mean_x), both relative to the segment start
+	const auto n = static_cast<double>(segment_count);
+	const auto x = static_cast<double>(position) - static_cast<double>(first_position);
+	const auto y = sum_y / n + slope * (x - sum_x / n);
+	*PCR = first_PCR + static_cast<int64_t>(y);
+	return true;
+}
+
+PcrTracker::PcrTracker(const uint8_t unit_size) :
+	unit_size(unit_size),
+	clocks(TS_PID_MAX),
+	packet_counts(TS_PID_MAX, 0),
+	total_packets(0)
+{}
+
+void PcrTracker::on_PMT(const ProgramMapSection& PMT)
+{
+	program_PCR_PIDs[PMT.program_number] = PMT.PCR_PID;
+}
+
+void PcrTracker::on_packet(const uint16_t PID)
+{
+	++packet_counts[PID];
+	++total_packets;
+}
+
+void PcrTracker::on_PCR(const uint16_t PID, const uint64_t PCR, const uint64_t position,
+	const bool discontinuity_indicator)
+{
+	auto& clock = clocks[PID];
+	if (!clock) {
+		clock = std::make_unique<Clock>();
+		*clock = {};
+		clock->PCR_PID = PID;
+		clock->last_raw_PCR = PCR;
+		start_segment(*clock, PCR, position);
+		return;
+	}
+
+	// 2^33 * 300 wraps after about 26.5 hours
+	if (PCR < clock->last_raw_PCR && clock->last_raw_PCR - PCR > PCR_WRAP / 2) {
+		clock->wrap_offset += PCR_WRAP;
+		++clock->wrap_count;
+	}
+	clock->last_raw_PCR = PCR;
+	const auto unwrapped = PCR + clock->wrap_offset;
+
+	auto discontinuity = discontinuity_indicator || unwrapped < clock->last_PCR
+		|| position <= clock->last_position;
+	if (!discontinuity) {
+		// The last local rate rather than the fit, which VBR streams drift from
+		const auto elapsed = unwrapped - clock->last_PCR;
+		if (clock->last_ticks_per_byte > 0) {
+			const auto expected = static_cast<uint64_t>(
+				(position - clock->last_position) * clock->last_ticks_per_byte);
+			const auto error = elapsed > expected ? elapsed - expected : expected - elapsed;
+			discontinuity = error > max_PCR_error;
+		}
+		else {
+			discontinuity = elapsed > max_PCR_gap;
+		}
+	}
+
+	if (discontinuity) {
+		++clock->discontinuity_count;
+		clock->closed_bytes += clock->last_position - clock->first_position;
+		clock->closed_ticks += clock->last_PCR - clock->first_PCR;
+		// A new time base: forget the wrap state of the old one
+		clock->wrap_offset = 0;
+		clock->last_raw_PCR = PCR;
+		clock->last_ticks_per_byte = 0;
+		start_segment(*clock, PCR, position);
+		return;
+	}
+
+	clock->last_ticks_per_byte =
+		static_cast<double>(unwrapped - clock->last_PCR) / (position - clock->last_position);
+
+	const auto x = static_cast<double>(position - clock->first_position);
+	const auto y = static_cast<double>(unwrapped - clock->first_PCR);
+	clock->sum_x  += x;
+	clock->sum_y  += y;
+	clock->sum_xx += x * x;
+	clock->sum_xy += x * y;
+	++clock->segment_count;
+	++clock->PCR_count;
+
+	clock->last_PCR = unwrapped;
+	clock->last_position = position;
+}
+
+void PcrTracker::start_segment(Clock& clock, const uint64_t PCR, const uint64_t position)
+{
+	clock.first_PCR = clock.last_PCR = PCR;
+	clock.first_position = clock.last_position = position;
+	clock.segment_count = 1;
+	clock.sum_x = clock.sum_y = clock.sum_xx = clock.sum_xy = 0;
+	++clock.PCR_count;
+}
+
+const PcrTracker::Clock* PcrTracker::get_clock(const uint16_t PCR_PID) const
+{
+	return PCR_PID < TS_PID_MAX ? clocks[PCR_PID].get() : nullptr;
+}
+
+const PcrTracker::Clock* PcrTracker::get_program_clock(const uint16_t program_number) const
+{
+	const auto found = program_PCR_PIDs.find(program_number);
+	return found != program_PCR_PIDs.end() ? get_clock(found->second) : nullptr;
+}
+
+const PcrTracker::Clock* PcrTracker::get_reference_clock() const
+{
+	const Clock* reference = nullptr;
+	for (const auto& clock : clocks) {
+		if (clock && (!reference || clock->PCR_count > reference->PCR_count)) {
+			reference = clock.get();
+		}
+	}
+	return reference;
+}
+
+double PcrTracker::instant_bitrate() const
+{
+	const auto clock = get_reference_clock();
+	if (!clock || clock->last_ticks_per_byte <= 0) {
+		return 0;
+	}
+	return to_TS_bitrate(1 / clock->last_ticks_per_byte);
+}
+
+double PcrTracker::average_bitrate() const
+{
+	const auto clock = get_reference_clock();
+	return clock ? to_TS_bitrate(clock->average_bytes_per_tick()) : 0;
+}
+
+double PcrTracker::PID_bitrate(const uint16_t PID) const
+{
+	// The PID's share of the packets, at the mux bitrate
+	if (!total_packets || PID >= TS_PID_MAX) {
+		return 0;
+	}
+	return average_bitrate() * packet_counts[PID] / total_packets;
+}
+
+double PcrTracker::to_TS_bitrate(const double bytes_per_tick) const
+{
+	// Positions count whole units; only the 188 TS bytes are transport rate
+	return bytes_per_tick * 8. * PCR_FREQUENCY * TS_PACKET_SIZE / unit_size;
+}
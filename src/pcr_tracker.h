@@ -0,0 +1,114 @@
+#pragma once
+
+#include <cinttypes>
+#include <map>
+#include <memory>
+#include <vector>
+#include "ts_packet.h"
+
+struct ProgramMapSection;
+
+// PCR: 33-bit base at 90kHz and 9-bit extension, in 27MHz units
+constexpr uint64_t PCR_FREQUENCY = 27'000'000;
+constexpr uint64_t PCR_WRAP      = (1ULL << 33) * 300;
+
+// Result of TransportStream::probe_stream()
+struct StreamProbe
+{
+	uint16_t program_number;
+	uint16_t PCR_PID;
+	uint64_t file_size;
+
+	// Raw PCR samples, from the first to the last PCR of the file
+	struct Sample
+	{
+		uint64_t PCR;
+		uint64_t position;
+	};
+	std::vector<Sample> samples;
+
+	double duration; // seconds between the first and the last PCR
+	double bitrate;  // TS bit/s
+	bool   discontinuity; // a span between samples did not fit the others
+};
+
+// Follows the PCR of each PCR_PID and fits it linearly against the byte
+// position in the stream. Bitrates are derived from the fit; PCR jumps
+// and wraparound are detected on the way. Everything is O(1) per packet.
+class PcrTracker
+{
+public:
+	// Clock of one PCR_PID, reset at each discontinuity
+	struct Clock
+	{
+		uint16_t PCR_PID;
+		uint32_t PCR_count;
+		uint32_t discontinuity_count;
+		uint32_t wrap_count;
+
+		// PCR values are unwrapped: they keep growing across wraparound
+		uint64_t first_PCR;
+		uint64_t last_PCR;
+		uint64_t first_position;
+		uint64_t last_position;
+		uint64_t last_raw_PCR;
+		uint64_t wrap_offset;
+
+		// Between the last two PCRs (0: not known yet)
+		double last_ticks_per_byte;
+
+		// Least squares fit of the current segment, relative to its first PCR
+		uint32_t segment_count;
+		double sum_x, sum_y, sum_xx, sum_xy;
+
+		// Segments closed by a discontinuity
+		uint64_t closed_bytes;
+		uint64_t closed_ticks;
+
+		// 27MHz ticks per byte fitted over the current segment (0: not known yet)
+		double ticks_per_byte() const;
+		// Bytes per 27MHz tick over every segment
+		double average_bytes_per_tick() const;
+		// Unwrapped PCR expected at position in the current segment
+		bool estimate_PCR(const uint64_t position, uint64_t* PCR) const;
+	};
+
+	// unit_size: bytes per packet in the input (188, 192 or 204)
+	explicit PcrTracker(const uint8_t unit_size = TS_PACKET_SIZE);
+	~PcrTracker() = default;
+
+	void on_PMT(const ProgramMapSection& PMT);
+	void on_packet(const uint16_t PID);
+	void on_PCR(const uint16_t PID, const uint64_t PCR, const uint64_t position,
+		const bool discontinuity_indicator);
+
+	void set_unit_size(const uint8_t unit_size) { this->unit_size = unit_size; }
+
+	const Clock* get_clock(const uint16_t PCR_PID) const;
+	const Clock* get_program_clock(const uint16_t program_number) const;
+	// The clock with the most PCRs, used for the mux bitrate
+	const Clock* get_reference_clock() const;
+
+	// TS bitrates in bit/s; 0 until two PCRs have been seen
+	double instant_bitrate() const;
+	double average_bitrate() const;
+	double PID_bitrate(const uint16_t PID) const;
+
+private:
+	// A PCR further than this from the one predicted at the last rate is
+	// a discontinuity (ETSI TR 101 290 PCR_discontinuity_indicator_error)
+	static constexpr uint64_t max_PCR_error = PCR_FREQUENCY / 10;
+	// Without a rate yet, the gap allowed between two PCRs
+	static constexpr uint64_t max_PCR_gap   = PCR_FREQUENCY;
+
+	void start_segment(Clock& clock, const uint64_t PCR, const uint64_t position);
+	double to_TS_bitrate(const double bytes_per_tick) const;
+
+	uint8_t unit_size;
+
+	std::vector<std::unique_ptr<Clock>> clocks; // indexed by PCR_PID
+	std::map<uint16_t, uint16_t> program_PCR_PIDs;
+
+	std::vector<uint64_t> packet_counts; // indexed by PID
+	uint64_t total_packets;
+};
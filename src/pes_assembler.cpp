@@ -0,0 +1,210 @@
+/*
+ * Reference: ITU-T Rec. H.222.0 (05/2006)
+ */
+
+#include <algorithm>
+#include <cstring>
+#include "pes_assembler.h"
+
+// Copies n bytes starting at offset out of a scatter list
+static size_t gather_bytes(const std::vector<PayloadSlice>& slices,
+	size_t offset, uint8_t* dst, size_t n)
+{
+	size_t copied = 0;
+	for (const auto& slice : slices) {
+		if (copied == n) {
+			break;
+		}
+		if (offset >= slice.length) {
+			offset -= slice.length;
+			continue;
+		}
+		const auto count = std::min<size_t>(slice.length - offset, n - copied);
+		std::memcpy(dst + copied, slice.data.get() + offset, count);
+		copied += count;
+		offset = 0;
+	}
+	return copied;
+}
+
+// PES_packet_length == 0: the packet ends where the next one starts
+static bool is_unbounded(const PesData& pes)
+{
+	if (pes.length < 6) {
+		return false;
+	}
+	uint8_t prefix[6];
+	gather_bytes(pes.slices, 0, prefix, sizeof(prefix));
+	return (prefix[4] << 8 | prefix[5]) == 0;
+}
+
+void PesData::payload_slices(std::vector<PayloadSlice>* out) const
+{
+	out->clear();
+
+	size_t skip = header_length;
+	for (const auto& slice : slices) {
+		if (skip >= slice.length) {
+			skip -= slice.length;
+			continue;
+		}
+		// aliases the same block, starting after the skipped bytes
+		out->push_back({ std::shared_ptr<const uint8_t>(slice.data, slice.data.get() + skip),
+			static_cast<uint16_t>(slice.length - skip) });
+		skip = 0;
+	}
+}
+
+void PesData::copy_payload(std::vector<uint8_t>* out) const
+{
+	out->resize(payload_length());
+	copy_payload(out->data(), out->size());
+}
+
+size_t PesData::copy_payload(uint8_t* dst, const size_t dst_size) const
+{
+	return gather_bytes(slices, header_length, dst, std::min(dst_size, payload_length()));
+}
+
+PesAssembler::PesAssembler()
+	: pending(TS_PID_MAX)
+{}
+
+void PesAssembler::on_PES(std::function<void(const PesData&)> handler)
+{
+	this->handler = std::move(handler);
+}
+
+void PesAssembler::push(const uint16_t PID, const bool unit_start, const int8_t random_access,
+	const uint64_t position, const std::shared_ptr<uint8_t>& block,
+	const uint8_t* payload, const uint16_t length)
+{
+	auto& pes = pending[PID];
+
+	if (unit_start) {
+		if (pes && pes->length) {
+			// A bounded PES packet still short of its length lost packets
+			if (is_unbounded(*pes)) {
+				complete(*pes);
+			}
+			else {
+				drop(PID);
+			}
+		}
+		if (!pes) {
+			pes = std::make_unique<PesData>();
+			pes->length = 0;
+		}
+		pes->PID = PID;
+		pes->position = position;
+		pes->random_access_indicator = random_access;
+	}
+	else if (!pes || pes->length == 0) {
+		// the start of this PES packet was not seen
+		return;
+	}
+
+	if (pes->length + length > max_PES_length) {
+		drop(PID);
+		return;
+	}
+
+	// No copy: the slice shares ownership of the packet block
+	pes->slices.push_back({ std::shared_ptr<const uint8_t>(block, payload), length });
+	pes->length += length;
+
+	if (pes->length < 6) {
+		return;
+	}
+
+	uint8_t prefix[6];
+	gather_bytes(pes->slices, 0, prefix, sizeof(prefix));
+	const uint16_t PES_packet_length = prefix[4] << 8 | prefix[5];
+	if (PES_packet_length == 0) {
+		return;
+	}
+
+	const size_t total_length = 6 + PES_packet_length;
+	if (pes->length >= total_length) {
+		// the last TS packet may be padded past the end of the PES packet
+		pes->slices.back().length -= static_cast<uint16_t>(pes->length - total_length);
+		pes->length = total_length;
+		complete(*pes);
+	}
+}
+
+void PesAssembler::drop(const uint16_t PID)
+{
+	auto& pes = pending[PID];
+	if (pes) {
+		pes->slices.clear();
+		pes->length = 0;
+	}
+}
+
+void PesAssembler::drop_all()
+{
+	for (auto& pes : pending) {
+		if (pes) {
+			pes->slices.clear();
+			pes->length = 0;
+		}
+	}
+}
+
+bool PesAssembler::drop_oldest()
+{
+	const PesData* oldest = nullptr;
+	for (const auto& pes : pending) {
+		if (pes && pes->length && (!oldest || pes->position < oldest->position)) {
+			oldest = pes.get();
+		}
+	}
+	if (!oldest) {
+		return false;
+	}
+	drop(oldest->PID);
+	return true;
+}
+
+void PesAssembler::flush()
+{
+	for (auto& pes : pending) {
+		if (!pes || !pes->length) {
+			continue;
+		}
+		if (is_unbounded(*pes)) {
+			complete(*pes);
+		}
+		else {
+			drop(pes->PID);
+		}
+	}
+}
+
+void PesAssembler::complete(PesData& pes)
+{
+	// The header is parsed in place when it lies in the first slice, as
+	// far as PES_header_data_length tells, and gathered otherwise
+	constexpr size_t max_header_length = 9 + 255;
+	const auto& first = pes.slices.front();
+	const auto header_bytes = std::min(pes.length,
+		first.length >= 9 ? 9 + static_cast<size_t>(first.data.get()[8]) : max_header_length);
+
+	bool success;
+	if (first.length >= header_bytes) {
+		success = parse_PES_header(first.data.get(), first.length, &pes.header, &pes.header_length);
+	}
+	else {
+		uint8_t header[max_header_length];
+		gather_bytes(pes.slices, 0, header, header_bytes);
+		success = parse_PES_header(header, header_bytes, &pes.header, &pes.header_length);
+	}
+
+	if (success && pes.header_length <= pes.length && handler) {
+		handler(pes);
+	}
+
+	pes.slices.clear();
+	pes.length = 0;
+}
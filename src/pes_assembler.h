@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cinttypes>
+#include <functional>
+#include <memory>
+#include <vector>
+#include "ts_packet.h"
+
+// A slice of a packet buffer. data shares ownership of the whole block
+// the slice lives in, so the bytes stay valid while the slice is held.
+struct PayloadSlice
+{
+	std::shared_ptr<const uint8_t> data;
+	uint16_t length;
+};
+
+// A PES packet reassembled across TS packets.
+// slices cover the whole PES packet (header included) as a scatter list
+// over the packet buffers; bytes are copied only by copy_payload().
+struct PesData
+{
+	uint16_t  PID;
+	PesPacket header;
+	uint16_t  header_length;           // offset of the first PES_packet_data_byte
+	uint64_t  position;                // byte offset of the first TS packet
+	int8_t    random_access_indicator; // of the first TS packet
+
+	std::vector<PayloadSlice> slices;
+	size_t length;                     // total bytes in slices
+
+	size_t payload_length() const { return length - header_length; }
+
+	// Slices covering PES_packet_data_byte only (no copy)
+	void payload_slices(std::vector<PayloadSlice>* out) const;
+
+	// Copies PES_packet_data_byte into contiguous memory
+	void copy_payload(std::vector<uint8_t>* out) const;
+	size_t copy_payload(uint8_t* dst, const size_t dst_size) const;
+};
+
+class PesAssembler
+{
+public:
+	PesAssembler();
+	~PesAssembler() = default;
+
+	PesAssembler(PesAssembler&&) = default;
+	PesAssembler& operator=(PesAssembler&&) = default;
+
+	void on_PES(std::function<void(const PesData&)> handler);
+	bool enabled() const { return static_cast<bool>(handler); }
+
+	// Feeds the payload of one TS packet. block owns the payload bytes.
+	void push(const uint16_t PID, const bool unit_start, const int8_t random_access,
+		const uint64_t position, const std::shared_ptr<uint8_t>& block,
+		const uint8_t* payload, const uint16_t length);
+
+	// Discards the PES packet being assembled on PID (e.g. on packet loss)
+	void drop(const uint16_t PID);
+	void drop_all();
+	// Discards the PES packet that started first. Returns false when none
+	// is being assembled.
+	bool drop_oldest();
+
+	// Emits every unbounded PES packet still pending (end of stream)
+	void flush();
+
+private:
+	// A PES packet growing past this is dropped, which bounds the blocks
+	// held by a PID whose next payload_unit_start_indicator never comes
+	static constexpr size_t max_PES_length = 16 << 20;
+
+	void complete(PesData& pes);
+
+	std::vector<std::unique_ptr<PesData>> pending;
+	std::function<void(const PesData&)> handler;
+};
@@ -0,0 +1,213 @@
+#include <algorithm>
+#include "service_map.h"
+
+const ProgramMapSection* ServiceMap::find_PMT(const uint16_t program_number) const
+{
+	const auto found = PMTs.find(program_number);
+	return found != PMTs.end() ? found->second.get() : nullptr;
+}
+
+const ServiceDescriptionSection::ServiceInfo* ServiceMap::find_service(const uint16_t service_id) const
+{
+	for (const auto& section : SDT) {
+		for (const auto& service : section.second->service_info_list) {
+			if (service.service_id == service_id) {
+				return &service;
+			}
+		}
+	}
+	return nullptr;
+}
+
+ServiceMapPublisher::ServiceMapPublisher() :
+	current(new ServiceMap()),
+	epoch(1),
+	generation(0)
+{
+	for (auto& slot : slots) {
+		slot.used.store(false, std::memory_order_relaxed);
+		slot.epoch.store(0, std::memory_order_relaxed);
+	}
+}
+
+ServiceMapPublisher::~ServiceMapPublisher()
+{
+	delete current.load(std::memory_order_relaxed);
+	for (const auto& entry : retired) {
+		delete entry.map;
+	}
+}
+
+std::unique_ptr<ServiceMap> ServiceMapPublisher::next_map() const
+{
+	auto map = std::make_unique<ServiceMap>(*current.load(std::memory_order_relaxed));
+	map->generation = generation + 1;
+	return map;
+}
+
+void ServiceMapPublisher::publish(std::unique_ptr<ServiceMap> map)
+{
+	generation = map->generation;
+	const auto old = current.exchange(map.release(), std::memory_order_seq_cst);
+
+	// Readers entering from now on announce a later epoch, and see the new map
+	retired.push_back({ old, epoch.fetch_add(1, std::memory_order_seq_cst) });
+	reclaim();
+}
+
+void ServiceMapPublisher::reclaim()
+{
+	auto oldest = UINT64_MAX;
+	for (const auto& slot : slots) {
+		const auto reader_epoch = slot.epoch.load(std::memory_order_seq_cst);
+		if (reader_epoch) {
+			oldest = std::min(oldest, reader_epoch);
+		}
+	}
+
+	const auto end = std::remove_if(retired.begin(), retired.end(), [oldest](const Retired& entry) {
+		if (entry.epoch < oldest) {
+			delete entry.map;
+			return true;
+		}
+		return false;
+	});
+	retired.erase(end, retired.end());
+}
+
+void ServiceMapPublisher::on_PAT(const ProgramAssociationSection& PAT)
+{
+	if (!PAT.current_next_indicator) {
+		return;
+	}
+	const auto& last = current.load(std::memory_order_relaxed)->PAT;
+	if (last && last->version_number == PAT.version_number
+		&& last->transport_stream_id == PAT.transport_stream_id) {
+		return;
+	}
+
+	auto map = next_map();
+	map->PAT = std::make_shared<const ProgramAssociationSection>(PAT);
+
+	// The PMTs of the programs gone go with them
+	for (auto it = map->PMTs.begin(); it != map->PMTs.end();) {
+		const auto listed = std::any_of(PAT.PMT_list.begin(), PAT.PMT_list.end(),
+			[it](const ProgramAssociationSection::PMTInfo& info) { return info.program_number == it->first; });
+		it = listed ? std::next(it) : map->PMTs.erase(it);
+	}
+	publish(std::move(map));
+}
+
+void ServiceMapPublisher::on_PMT(const ProgramMapSection& PMT)
+{
+	if (!PMT.current_next_indicator) {
+		return;
+	}
+	const auto last_map = current.load(std::memory_order_relaxed);
+	if (last_map->PAT) {
+		const auto& PMT_list = last_map->PAT->PMT_list;
+		const auto listed = std::any_of(PMT_list.begin(), PMT_list.end(),
+			[&PMT](const ProgramAssociationSection::PMTInfo& info) { return info.program_number == PMT.program_number; });
+		if (!listed) {
+			return;
+		}
+	}
+	const auto last = last_map->find_PMT(PMT.program_number);
+	if (last && last->version_number == PMT.version_number) {
+		return;
+	}
+
+	auto map = next_map();
+	map->PMTs[PMT.program_number] = std::make_shared<const ProgramMapSection>(PMT);
+	publish(std::move(map));
+}
+
+// Stores section into sections, dropping those of another version
+template <typename Section>
+static void update_sections(std::map<uint8_t, std::shared_ptr<const Section>>* sections,
+	const Section& section)
+{
+	for (auto it = sections->begin(); it != sections->end();) {
+		it = it->second->version_number != section.version_number ? sections->erase(it) : std::next(it);
+	}
+	(*sections)[section.section_number] = std::make_shared<const Section>(section);
+}
+
+void ServiceMapPublisher::on_NIT(const NetworkInformationSection& NIT)
+{
+	// Actual network only
+	if (NIT.table_id != 0x40 || !NIT.current_next_indicator) {
+		return;
+	}
+	const auto& last = current.load(std::memory_order_relaxed)->NIT;
+	const auto found = last.find(NIT.section_number);
+	if (found != last.end() && found->second->version_number == NIT.version_number) {
+		return;
+	}
+
+	auto map = next_map();
+	update_sections(&map->NIT, NIT);
+	publish(std::move(map));
+}
+
+void ServiceMapPublisher::on_SDT(const ServiceDescriptionSection& SDT)
+{
+	// Actual TS only
+	if (SDT.table_id != 0x42 || !SDT.current_next_indicator) {
+		return;
+	}
+	const auto& last = current.load(std::memory_order_relaxed)->SDT;
+	const auto found = last.find(SDT.section_number);
+	if (found != last.end() && found->second->version_number == SDT.version_number) {
+		return;
+	}
+
+	auto map = next_map();
+	update_sections(&map->SDT, SDT);
+	publish(std::move(map));
+}
+
+ServiceMapReader::ServiceMapReader(ServiceMapPublisher* publisher) :
+	publisher(publisher),
+	slot(nullptr)
+{
+	for (auto& candidate : publisher->slots) {
+		auto used = false;
+		if (candidate.used.compare_exchange_strong(used, true, std::memory_order_acquire)) {
+			slot = &candidate;
+			break;
+		}
+	}
+}
+
+ServiceMapReader::~ServiceMapReader()
+{
+	if (slot) {
+		slot->epoch.store(0, std::memory_order_release);
+		slot->used.store(false, std::memory_order_release);
+	}
+}
+
+ServiceMapReader::Snapshot ServiceMapReader::acquire()
+{
+	if (!slot) {
+		return Snapshot(nullptr, nullptr);
+	}
+	slot->epoch.store(publisher->epoch.load(std::memory_order_seq_cst), std::memory_order_seq_cst);
+	return Snapshot(&slot->epoch, publisher->current.load(std::memory_order_seq_cst));
+}
+
+ServiceMapReader::Snapshot::Snapshot(Snapshot&& other) noexcept :
+	epoch(other.epoch),
+	map(other.map)
+{
+	other.epoch = nullptr;
+	other.map = nullptr;
+}
+
+ServiceMapReader::Snapshot::~Snapshot()
+{
+	if (epoch) {
+		epoch->store(0, std::memory_order_release);
+	}
+}
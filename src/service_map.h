@@ -0,0 +1,135 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cinttypes>
+#include <map>
+#include <memory>
+#include <vector>
+#include "ts_tables.h"
+
+// The decoded PAT, PMTs, NIT and SDT of the actual TS at one point of the
+// stream. Never modified once published; tables unchanged between two
+// snapshots are shared by them.
+struct ServiceMap
+{
+	uint64_t generation; // counts the publications, from 0 (nothing seen yet)
+
+	std::shared_ptr<const ProgramAssociationSection> PAT;
+	// By program_number, only for the programs of PAT
+	std::map<uint16_t, std::shared_ptr<const ProgramMapSection>> PMTs;
+	// Actual network / TS tables, by section_number
+	std::map<uint8_t, std::shared_ptr<const NetworkInformationSection>> NIT;
+	std::map<uint8_t, std::shared_ptr<const ServiceDescriptionSection>> SDT;
+
+	const ProgramMapSection* find_PMT(const uint16_t program_number) const;
+	const ServiceDescriptionSection::ServiceInfo* find_service(const uint16_t service_id) const;
+};
+
+// Keeps the current ServiceMap for threads querying it while the parser
+// thread goes on. The parser feeds it from the on_PAT / on_PMT / on_NIT /
+// on_SDT handlers; on a version change a new snapshot is built aside and
+// swapped in with one atomic store, so readers never lock and never see a
+// table half updated.
+// Replaced snapshots are reclaimed by epochs: a reader announces the epoch
+// it entered in, and a snapshot retired at epoch E is freed by the parser
+// thread once no reader is left in E or earlier.
+class ServiceMapPublisher
+{
+public:
+	ServiceMapPublisher();
+	// No reader may be left
+	~ServiceMapPublisher();
+
+	ServiceMapPublisher(const ServiceMapPublisher&) = delete;
+	ServiceMapPublisher& operator=(const ServiceMapPublisher&) = delete;
+
+	// Parser thread only
+	void on_PAT(const ProgramAssociationSection& PAT);
+	void on_PMT(const ProgramMapSection& PMT);
+	void on_NIT(const NetworkInformationSection& NIT);
+	void on_SDT(const ServiceDescriptionSection& SDT);
+
+	uint64_t get_generation() const { return generation; }
+	// Snapshots replaced but still held by a reader
+	size_t get_retired_count() const { return retired.size(); }
+
+	// Readers registered at once
+	static constexpr size_t max_readers = 64;
+
+private:
+	friend class ServiceMapReader;
+
+	struct alignas(64) ReaderSlot
+	{
+		std::atomic<bool>     used;
+		std::atomic<uint64_t> epoch; // 0: not reading
+	};
+
+	struct Retired
+	{
+		const ServiceMap* map;
+		uint64_t epoch;
+	};
+
+	// Copy of the current snapshot to be modified and published
+	std::unique_ptr<ServiceMap> next_map() const;
+	void publish(std::unique_ptr<ServiceMap> map);
+	void reclaim();
+
+	std::atomic<const ServiceMap*> current;
+	std::atomic<uint64_t> epoch; // from 1
+	std::array<ReaderSlot, max_readers> slots;
+
+	// Parser thread only
+	uint64_t generation;
+	std::vector<Retired> retired;
+};
+
+// A query thread's handle on a ServiceMapPublisher. Each thread keeps its
+// own; one snapshot is held at a time.
+class ServiceMapReader
+{
+public:
+	// Holds the snapshot current when it was acquired until destroyed.
+	// Copy out the shared_ptr of a table to keep it longer.
+	class Snapshot
+	{
+	public:
+		Snapshot(Snapshot&& other) noexcept;
+		~Snapshot();
+
+		Snapshot(const Snapshot&) = delete;
+		Snapshot& operator=(const Snapshot&) = delete;
+		Snapshot& operator=(Snapshot&&) = delete;
+
+		// nullptr when the reader is not registered
+		const ServiceMap* get() const { return map; }
+		const ServiceMap* operator->() const { return map; }
+
+	private:
+		friend class ServiceMapReader;
+		Snapshot(std::atomic<uint64_t>* epoch, const ServiceMap* map) :
+			epoch(epoch), map(map) {}
+
+		std::atomic<uint64_t>* epoch;
+		const ServiceMap* map;
+	};
+
+	// Takes one of the max_readers slots of publisher
+	explicit ServiceMapReader(ServiceMapPublisher* publisher);
+	~ServiceMapReader();
+
+	ServiceMapReader(const ServiceMapReader&) = delete;
+	ServiceMapReader& operator=(const ServiceMapReader&) = delete;
+
+	// False when every slot was taken
+	bool is_registered() const { return slot != nullptr; }
+
+	// Wait-free; a stalled holder only delays reclamation
+	Snapshot acquire();
+
+private:
+	ServiceMapPublisher* publisher;
+	ServiceMapPublisher::ReaderSlot* slot;
+};
@@ -0,0 +1,380 @@
+#include <cstdio>
+#include <cstring>
+#include <new>
+#include "shared_ring.h"
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+using namespace shared_ring;
+
+static size_t align_record(const size_t length)
+{
+	return (length + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+}
+
+#if defined(__linux__)
+// Shared (not private) futexes: the waiters are in other processes
+static void futex_wait(std::atomic<uint32_t>* word, const uint32_t value, const int timeout_ms)
+{
+	struct timespec timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = (timeout_ms % 1000) * 1000000L;
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, value,
+		timeout_ms < 0 ? nullptr : &timeout, nullptr, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t>* word)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT32_MAX, nullptr, nullptr, 0);
+}
+#endif
+
+SharedRingWriter::SharedRingWriter() :
+	fd(-1),
+	mapping(nullptr),
+	mapping_size(0),
+	header(nullptr),
+	data(nullptr),
+	mask(0),
+	head(0),
+	tail(0)
+{}
+
+SharedRingWriter::~SharedRingWriter()
+{
+	close();
+}
+
+bool SharedRingWriter::open(const std::string& name, const size_t capacity)
+{
+	close();
+
+#if defined(__linux__)
+	uint64_t size = 4096;
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	fd = name.empty()
+		? memfd_create("ts_parser_ring", MFD_CLOEXEC)
+		: shm_open(name.c_str(), O_CREAT | O_RDWR | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "shared memory open failed. [%s]\n", name.c_str());
+		return false;
+	}
+	this->name = name;
+
+	mapping_size = DATA_OFFSET + size;
+	if (ftruncate(fd, mapping_size) != 0) {
+		close();
+		return false;
+	}
+	const auto address = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (address == MAP_FAILED) {
+		close();
+		return false;
+	}
+	mapping = static_cast<uint8_t*>(address);
+
+	header = new (mapping) RingHeader;
+	header->version = VERSION;
+	header->capacity = size;
+	header->head.store(0, std::memory_order_relaxed);
+	header->tail.store(0, std::memory_order_relaxed);
+	header->notify.store(0, std::memory_order_relaxed);
+	header->waiters.store(0, std::memory_order_relaxed);
+	data = mapping + DATA_OFFSET;
+	mask = size - 1;
+	head = 0;
+	tail = 0;
+
+	// Consumers check the magic last
+	std::atomic_thread_fence(std::memory_order_release);
+	std::memcpy(header->magic, MAGIC, sizeof(MAGIC));
+	return true;
+#else
+	(void)name;
+	(void)capacity;
+	fprintf(stderr, "shared memory ring is not supported on this platform.\n");
+	return false;
+#endif
+}
+
+void SharedRingWriter::close()
+{
+#if defined(__linux__)
+	if (mapping) {
+		munmap(mapping, mapping_size);
+	}
+	if (fd >= 0) {
+		::close(fd);
+	}
+	// Consumers already attached keep their mapping
+	if (!name.empty()) {
+		shm_unlink(name.c_str());
+	}
+#endif
+	name.clear();
+	fd = -1;
+	mapping = nullptr;
+	header = nullptr;
+	data = nullptr;
+}
+
+void SharedRingWriter::release_space(const uint64_t new_head)
+{
+	const auto capacity = mask + 1;
+	while (tail < head && new_head - tail > capacity) {
+		const auto remaining = capacity - (tail & mask);
+		if (remaining < sizeof(RecordHeader)) {
+			tail += remaining;
+			continue;
+		}
+		RecordHeader record;
+		std::memcpy(&record, data + (tail & mask), sizeof(record));
+		tail += align_record(record.length);
+	}
+}
+
+bool SharedRingWriter::write(const RecordType type, const uint16_t PID, const uint64_t value,
+	const uint8_t* payload, const size_t length)
+{
+	if (!header) {
+		return false;
+	}
+
+	const auto capacity = mask + 1;
+	const auto record_length = sizeof(RecordHeader) + length;
+	const auto aligned_length = align_record(record_length);
+	if (aligned_length > capacity / 2) {
+		return false;
+	}
+
+	// Records do not wrap: skip to the start of the buffer
+	auto start = head;
+	const auto remaining = capacity - (start & mask);
+	if (remaining < aligned_length) {
+		start += remaining;
+	}
+	const auto new_head = start + aligned_length;
+
+	// Consumers learn of the overwrite from the tail before it happens
+	release_space(new_head);
+	header->tail.store(tail, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	if (start != head && remaining >= sizeof(RecordHeader)) {
+		const RecordHeader padding = { static_cast<uint32_t>(remaining), RecordType::padding, 0, 0, head, 0 };
+		std::memcpy(data + (head & mask), &padding, sizeof(padding));
+	}
+
+	const RecordHeader record = { static_cast<uint32_t>(record_length), type, 0, PID, start, value };
+	std::memcpy(data + (start & mask), &record, sizeof(record));
+	if (length) {
+		std::memcpy(data + (start & mask) + sizeof(record), payload, length);
+	}
+
+	head = new_head;
+	header->head.store(head, std::memory_order_release);
+
+#if defined(__linux__)
+	header->notify.fetch_add(1, std::memory_order_release);
+	// The system call is made only when somebody sleeps
+	if (header->waiters.load(std::memory_order_seq_cst)) {
+		futex_wake(&header->notify);
+	}
+#endif
+	return true;
+}
+
+SharedRingReader::SharedRingReader() :
+	fd(-1),
+	mapping(nullptr),
+	mapping_size(0),
+	header(nullptr),
+	data(nullptr),
+	capacity(0),
+	mask(0),
+	cursor(0),
+	dropped_bytes(0)
+{}
+
+SharedRingReader::~SharedRingReader()
+{
+	close();
+}
+
+bool SharedRingReader::open(const std::string& name, const bool from_oldest)
+{
+	close();
+
+#if defined(__linux__)
+	const auto shared_fd = shm_open(name.c_str(), O_RDWR, 0);
+	if (shared_fd < 0) {
+		fprintf(stderr, "shared memory open failed. [%s]\n", name.c_str());
+		return false;
+	}
+	return map(shared_fd, from_oldest);
+#else
+	(void)name;
+	(void)from_oldest;
+	return false;
+#endif
+}
+
+bool SharedRingReader::open_fd(const int fd, const bool from_oldest)
+{
+	close();
+
+#if defined(__linux__)
+	const auto shared_fd = dup(fd);
+	return shared_fd >= 0 && map(shared_fd, from_oldest);
+#else
+	(void)fd;
+	(void)from_oldest;
+	return false;
+#endif
+}
+
+bool SharedRingReader::map(const int shared_fd, const bool from_oldest)
+{
+#if defined(__linux__)
+	fd = shared_fd;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < DATA_OFFSET) {
+		close();
+		return false;
+	}
+	mapping_size = static_cast<size_t>(st.st_size);
+	// Writable for the futex words only
+	const auto address = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (address == MAP_FAILED) {
+		close();
+		return false;
+	}
+	mapping = static_cast<uint8_t*>(address);
+	header = reinterpret_cast<RingHeader*>(mapping);
+
+	if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version != VERSION
+		|| DATA_OFFSET + header->capacity != mapping_size) {
+		fprintf(stderr, "unsupported shared memory ring.\n");
+		close();
+		return false;
+	}
+	std::atomic_thread_fence(std::memory_order_acquire);
+
+	data = mapping + DATA_OFFSET;
+	capacity = header->capacity;
+	mask = capacity - 1;
+	cursor = from_oldest
+		? header->tail.load(std::memory_order_acquire)
+		: header->head.load(std::memory_order_acquire);
+	dropped_bytes = 0;
+	return true;
+#else
+	(void)shared_fd;
+	(void)from_oldest;
+	return false;
+#endif
+}
+
+void SharedRingReader::close()
+{
+#if defined(__linux__)
+	if (mapping) {
+		munmap(mapping, mapping_size);
+	}
+	if (fd >= 0) {
+		::close(fd);
+	}
+#endif
+	fd = -1;
+	mapping = nullptr;
+	header = nullptr;
+	data = nullptr;
+}
+
+bool SharedRingReader::read(SharedRingRecord* record)
+{
+	if (!header) {
+		return false;
+	}
+
+	for (;;) {
+		const auto head = header->head.load(std::memory_order_acquire);
+		if (cursor >= head) {
+			return false;
+		}
+
+		const auto tail = header->tail.load(std::memory_order_acquire);
+		if (cursor < tail) {
+			dropped_bytes += tail - cursor;
+			cursor = tail;
+			continue;
+		}
+
+		const auto remaining = capacity - (cursor & mask);
+		if (remaining < sizeof(RecordHeader)) {
+			cursor += remaining;
+			continue;
+		}
+
+		RecordHeader header_copy;
+		std::memcpy(&header_copy, data + (cursor & mask), sizeof(header_copy));
+		const auto valid = header_copy.position == cursor
+			&& header_copy.length >= sizeof(RecordHeader) && header_copy.length <= remaining;
+		if (valid && header_copy.type != RecordType::padding) {
+			record->type = header_copy.type;
+			record->PID = header_copy.PID;
+			record->value = header_copy.value;
+			record->data.assign(data + (cursor & mask) + sizeof(RecordHeader),
+				data + (cursor & mask) + header_copy.length);
+		}
+
+		// The copy counts only if the producer has not reached it meanwhile
+		std::atomic_thread_fence(std::memory_order_acquire);
+		const auto new_tail = header->tail.load(std::memory_order_relaxed);
+		if (cursor < new_tail) {
+			dropped_bytes += new_tail - cursor;
+			cursor = new_tail;
+			continue;
+		}
+		if (!valid) {
+			// Cannot happen unless the producer is not this format: resynchronize
+			dropped_bytes += head - cursor;
+			cursor = head;
+			return false;
+		}
+
+		cursor += align_record(header_copy.length);
+		if (header_copy.type != RecordType::padding) {
+			return true;
+		}
+	}
+}
+
+void SharedRingReader::wait(const int timeout_ms)
+{
+	if (!header) {
+		return;
+	}
+#if defined(__linux__)
+	header->waiters.fetch_add(1, std::memory_order_seq_cst);
+	const auto notify = header->notify.load(std::memory_order_acquire);
+	if (cursor >= header->head.load(std::memory_order_acquire)) {
+		futex_wait(&header->notify, notify, timeout_ms);
+	}
+	header->waiters.fetch_sub(1, std::memory_order_relaxed);
+#else
+	(void)timeout_ms;
+#endif
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <atomic>
+#include <cinttypes>
+#include <string>
+#include <vector>
+
+// Single-producer / multi-consumer ring of parse events in shared memory,
+// so that one parse can serve several processes on the host.
+// The producer never waits: it overwrites the oldest records, and each
+// consumer keeps its own cursor, finding out afterwards when it has been
+// overrun (seqlock style) and skipping to the oldest record left.
+//
+// Shared memory layout (host byte order):
+//   RingHeader, then capacity bytes of records, each 8-byte aligned:
+//     RecordHeader, payload
+//   A record never wraps; the bytes left at the end of the buffer are
+//   skipped (with a padding record when one fits).
+namespace shared_ring
+{
+	enum class RecordType : uint8_t
+	{
+		padding       = 0,
+		packet        = 1, // the 188-byte packet; value: byte offset in the stream
+		section       = 2, // a complete section; value: byte offset in the stream
+		table_version = 3, // a section whose version or CRC changed; value: byte offset
+		PCR           = 4, // value: PCR in 27MHz; payload: PCRRecord
+		table_delta   = 5, // a change in a PMT, SDT or EIT sub-table; value: byte
+		                   // offset of the section completing it; payload: TableDeltaRecord
+	};
+
+	constexpr char     MAGIC[4] = { 'T', 'S', 'R', 'G' };
+	constexpr uint32_t VERSION  = 2;
+
+	struct RingHeader
+	{
+		char     magic[4];
+		uint32_t version;
+		uint64_t capacity;                     // power of two
+
+		// Written by the producer only
+		alignas(64) std::atomic<uint64_t> head; // end of the last record, in bytes ever written
+		std::atomic<uint64_t> tail;             // start of the oldest intact record
+
+		// Wake-ups for waiting consumers (futex words)
+		alignas(64) std::atomic<uint32_t> notify;
+		std::atomic<uint32_t> waiters;
+	};
+
+	struct RecordHeader
+	{
+		uint32_t   length;   // header and payload, before alignment
+		RecordType type;
+		uint8_t    reserved;
+		uint16_t   PID;
+		uint64_t   position; // where the record starts, to tell a torn read
+		uint64_t   value;
+	};
+
+	struct PCRRecord
+	{
+		uint64_t position;   // byte offset of the packet in the stream
+		uint8_t  discontinuity_indicator;
+		uint8_t  reserved[7];
+	};
+
+	// One TableDelta, with the version of the sub-table it leads to
+	struct TableDeltaRecord
+	{
+		uint8_t  type;           // TableDelta::Type
+		uint8_t  table_id;
+		uint8_t  version_number;
+		uint8_t  section_number; // of the section completing the version
+		uint16_t id;             // as in TableDelta
+		uint16_t item;
+		uint64_t old_value;
+		uint64_t new_value;
+	};
+
+	constexpr size_t ALIGNMENT = 8;
+	constexpr size_t DATA_OFFSET = (sizeof(RingHeader) + 63) & ~size_t(63);
+}
+
+struct SharedRingRecord
+{
+	shared_ring::RecordType type;
+	uint16_t PID;
+	uint64_t value;
+	std::vector<uint8_t> data;
+};
+
+class SharedRingWriter
+{
+public:
+	SharedRingWriter();
+	~SharedRingWriter();
+
+	SharedRingWriter(const SharedRingWriter&) = delete;
+	SharedRingWriter& operator=(const SharedRingWriter&) = delete;
+
+	// name is a POSIX shared memory name ("/tsring"); empty creates an
+	// anonymous memfd, handed to consumers with get_fd() (fork, SCM_RIGHTS).
+	// capacity is rounded up to a power of two.
+	bool open(const std::string& name, const size_t capacity);
+	void close();
+	int get_fd() const { return fd; }
+
+	// Returns false when the record is larger than half the ring
+	bool write(const shared_ring::RecordType type, const uint16_t PID, const uint64_t value,
+		const uint8_t* data, const size_t length);
+
+private:
+	// Moves the tail past the records that writing up to new_head overwrites
+	void release_space(const uint64_t new_head);
+
+	std::string name;
+	int      fd;
+	uint8_t* mapping;
+	size_t   mapping_size;
+	shared_ring::RingHeader* header;
+	uint8_t* data;
+	uint64_t mask;
+	uint64_t head;  // local copies of the shared cursors
+	uint64_t tail;
+};
+
+class SharedRingReader
+{
+public:
+	SharedRingReader();
+	~SharedRingReader();
+
+	SharedRingReader(const SharedRingReader&) = delete;
+	SharedRingReader& operator=(const SharedRingReader&) = delete;
+
+	// from_oldest starts at the oldest record left instead of new ones
+	bool open(const std::string& name, const bool from_oldest = false);
+	bool open_fd(const int fd, const bool from_oldest = false);
+	void close();
+
+	// Takes the next record; false when there is none yet
+	bool read(SharedRingRecord* record);
+	// Blocks until the producer writes or timeout_ms passes (-1: forever)
+	void wait(const int timeout_ms);
+
+	// Bytes of records overwritten before this consumer read them
+	uint64_t get_dropped_bytes() const { return dropped_bytes; }
+
+private:
+	bool map(const int fd, const bool from_oldest);
+
+	int      fd;
+	uint8_t* mapping;
+	size_t   mapping_size;
+	shared_ring::RingHeader* header; // waiters is written
+	const uint8_t* data;
+	uint64_t capacity;
+	uint64_t mask;
+	uint64_t cursor;
+	uint64_t dropped_bytes;
+};
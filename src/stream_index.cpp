@@ -0,0 +1,316 @@
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include "stream_index.h"
+#include "crc32.h"
+
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using namespace stream_index;
+
+StreamIndexWriter::StreamIndexWriter(const uint8_t unit_size, const uint8_t offset,
+	const uint64_t file_size, const uint32_t file_CRC) :
+	unit_size(unit_size),
+	offset(offset),
+	file_size(file_size),
+	file_CRC(file_CRC),
+	unit_count(0),
+	runs(TS_PID_MAX),
+	packet_counts(TS_PID_MAX, 0),
+	last_PCR(TS_PID_MAX, UINT64_MAX),
+	last_PTS(TS_PID_MAX, UINT64_MAX)
+{}
+
+void StreamIndexWriter::on_packet(const uint16_t PID, const uint8_t* packet,
+	const uint64_t position, const PidType type)
+{
+	const auto unit = static_cast<uint32_t>(position / unit_size);
+	unit_count = std::max<uint64_t>(unit_count, unit + 1ULL);
+	++packet_counts[PID];
+
+	auto& PID_runs = runs[PID];
+	if (!PID_runs.empty() && PID_runs.back().first_unit + PID_runs.back().unit_count == unit
+		&& PID_runs.back().unit_count < UINT32_MAX) {
+		++PID_runs.back().unit_count;
+	}
+	else {
+		PID_runs.push_back({ unit, 1 });
+	}
+
+	// Random access points and PTS are taken from the first packet of a PES
+	if (type != PidType::PES || !(packet[1] & 0x40)) {
+		return;
+	}
+
+	const auto has_adaptation_field = (packet[3] & 0x20) != 0;
+	if (has_adaptation_field && packet[4] > 0 && (packet[5] & 0x40)) {
+		random_access_points.push_back({ position, PID, {} });
+	}
+
+	const size_t payload_offset = has_adaptation_field ? 5 + packet[4] : 4;
+	if (!(packet[3] & 0x10) || payload_offset >= TS_PACKET_SIZE) {
+		return;
+	}
+
+	PesPacket pes;
+	uint16_t header_length;
+	if (!parse_PES_header(packet + payload_offset, TS_PACKET_SIZE - payload_offset, &pes, &header_length)
+		|| !(pes.PTS_DTS_flags & 0x2)) {
+		return;
+	}
+
+	auto& last = last_PTS[PID];
+	if (last == UINT64_MAX || ((pes.PTS - last) & ((1ULL << 33) - 1)) >= PTS_interval) {
+		PTS_checkpoints.push_back({ position, pes.PTS, PID, {} });
+		last = pes.PTS;
+	}
+}
+
+void StreamIndexWriter::on_PCR(const uint16_t PID, const uint64_t PCR, const uint64_t position)
+{
+	auto& last = last_PCR[PID];
+	if (last == UINT64_MAX || (PCR + (1ULL << 33) * 300 - last) % ((1ULL << 33) * 300) >= PCR_interval) {
+		PCR_checkpoints.push_back({ position, PCR, PID, {} });
+		last = PCR;
+	}
+}
+
+void StreamIndexWriter::on_section(const uint16_t PID, const uint8_t* section,
+	const uint16_t length, const uint64_t position)
+{
+	// Only long-form sections carry a version, and only intact ones count
+	if (length < 12 || !(section[1] & 0x80) || crc::_crc32(section, length) != 0) {
+		return;
+	}
+
+	const auto table_id = section[0];
+	const uint16_t table_id_extension = section[3] << 8 | section[4];
+	const uint8_t version_number = (section[5] >> 1) & 0x1f;
+	const auto section_number = section[6];
+
+	const auto key = (uint64_t)PID << 32 | (uint64_t)table_id << 24
+		| (uint64_t)table_id_extension << 8 | section_number;
+	const auto found = section_versions.find(key);
+	if (found != section_versions.end() && found->second == version_number) {
+		return;
+	}
+	section_versions[key] = version_number;
+
+	PSI_versions.push_back({ position, PID, table_id_extension, table_id,
+		version_number, section_number, 0 });
+}
+
+bool StreamIndexWriter::write(const std::string& file_path,
+	const std::array<PidType, TS_PID_MAX>& PID_types)
+{
+	std::vector<PIDEntry> PID_directory;
+	std::vector<Run> all_runs;
+	for (uint16_t PID = 0; PID < TS_PID_MAX; ++PID) {
+		if (!packet_counts[PID]) {
+			continue;
+		}
+		PID_directory.push_back({ PID, static_cast<uint8_t>(PID_types[PID]), 0,
+			static_cast<uint32_t>(runs[PID].size()), all_runs.size(), packet_counts[PID] });
+		all_runs.insert(all_runs.end(), runs[PID].begin(), runs[PID].end());
+	}
+
+	struct Table
+	{
+		uint32_t type;
+		uint32_t entry_size;
+		const void* data;
+		uint64_t count;
+	};
+	const Table tables[] = {
+		{ PID_DIRECTORY,        sizeof(PIDEntry),          PID_directory.data(),        PID_directory.size() },
+		{ PID_RUNS,             sizeof(Run),               all_runs.data(),             all_runs.size() },
+		{ PCR_CHECKPOINTS,      sizeof(ClockCheckpoint),   PCR_checkpoints.data(),      PCR_checkpoints.size() },
+		{ PTS_CHECKPOINTS,      sizeof(ClockCheckpoint),   PTS_checkpoints.data(),      PTS_checkpoints.size() },
+		{ RANDOM_ACCESS_POINTS, sizeof(RandomAccessPoint), random_access_points.data(), random_access_points.size() },
+		{ PSI_VERSIONS,         sizeof(PSIVersion),        PSI_versions.data(),         PSI_versions.size() },
+	};
+	constexpr auto table_count = sizeof(tables) / sizeof(tables[0]);
+
+	FileHeader header = {};
+	header.magic = MAGIC;
+	header.version = VERSION;
+	header.byte_order = ENDIAN_MARK;
+	header.unit_size = unit_size;
+	header.offset = offset;
+	header.section_count = table_count;
+	header.file_CRC = file_CRC;
+	header.file_size = file_size;
+	header.unit_count = unit_count;
+
+	// Arrays follow the directory, each aligned to 8 bytes
+	SectionEntry directory[table_count];
+	uint64_t position = sizeof(header) + sizeof(directory);
+	for (size_t i = 0; i < table_count; ++i) {
+		directory[i] = { tables[i].type, tables[i].entry_size, position, tables[i].count };
+		position += (tables[i].entry_size * tables[i].count + 7) & ~7ULL;
+	}
+
+	std::ofstream output(file_path, std::ios::out | std::ios::binary);
+	if (!output.is_open()) {
+		fprintf(stderr, "file open failed. [%s]\n", file_path.c_str());
+		return false;
+	}
+
+	const char padding[8] = {};
+	output.write(reinterpret_cast<const char *>(&header), sizeof(header));
+	output.write(reinterpret_cast<const char *>(directory), sizeof(directory));
+	for (const auto& table : tables) {
+		const auto bytes = table.entry_size * table.count;
+		output.write(static_cast<const char *>(table.data), bytes);
+		output.write(padding, ((bytes + 7) & ~7ULL) - bytes);
+	}
+
+	return output.good();
+}
+
+StreamIndex::StreamIndex() :
+	data(nullptr),
+	size(0),
+	header(nullptr)
+{}
+
+StreamIndex::~StreamIndex()
+{
+	close();
+}
+
+bool StreamIndex::open(const std::string& file_path)
+{
+	close();
+
+#if defined(_WIN32)
+	std::ifstream input(file_path, std::ios::in | std::ios::binary | std::ios::ate);
+	if (!input.is_open()) {
+		return false;
+	}
+	contents.resize(static_cast<size_t>(input.tellg()));
+	input.seekg(0, std::ios::beg);
+	input.read(reinterpret_cast<char *>(contents.data()), contents.size());
+	data = contents.data();
+	size = contents.size();
+#else
+	const auto fd = ::open(file_path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size == 0) {
+		::close(fd);
+		return false;
+	}
+	const auto mapped = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (mapped == MAP_FAILED) {
+		return false;
+	}
+	data = static_cast<const uint8_t*>(mapped);
+	size = static_cast<size_t>(st.st_size);
+#endif
+
+	header = reinterpret_cast<const FileHeader*>(data);
+	const auto valid = size >= sizeof(FileHeader)
+		&& header->magic == MAGIC && header->version == VERSION && header->byte_order == ENDIAN_MARK
+		&& size >= sizeof(FileHeader) + header->section_count * sizeof(SectionEntry);
+	if (!valid) {
+		fprintf(stderr, "unsupported index file. [%s]\n", file_path.c_str());
+		close();
+		return false;
+	}
+	return true;
+}
+
+void StreamIndex::close()
+{
+#if defined(_WIN32)
+	contents.clear();
+#else
+	if (data) {
+		munmap(const_cast<uint8_t*>(data), size);
+	}
+#endif
+	data = nullptr;
+	size = 0;
+	header = nullptr;
+}
+
+bool StreamIndex::matches(const uint64_t file_size, const uint32_t file_CRC) const
+{
+	return header && header->file_size == file_size && header->file_CRC == file_CRC;
+}
+
+template <typename Entry>
+const Entry* StreamIndex::get_section(const uint32_t type, size_t* count) const
+{
+	*count = 0;
+	if (!header) {
+		return nullptr;
+	}
+
+	const auto directory = reinterpret_cast<const SectionEntry*>(data + sizeof(FileHeader));
+	for (uint16_t i = 0; i < header->section_count; ++i) {
+		const auto& entry = directory[i];
+		if (entry.type != type) {
+			continue;
+		}
+		if (entry.entry_size != sizeof(Entry) || entry.offset > size
+			|| entry.count > (size - entry.offset) / sizeof(Entry)) {
+			return nullptr;
+		}
+		*count = static_cast<size_t>(entry.count);
+		return reinterpret_cast<const Entry*>(data + entry.offset);
+	}
+	return nullptr;
+}
+
+const PIDEntry* StreamIndex::find_PID(const uint16_t PID) const
+{
+	size_t count;
+	const auto entries = get_section<PIDEntry>(PID_DIRECTORY, &count);
+	// The directory is sorted by PID
+	const auto found = std::lower_bound(entries, entries + count, PID,
+		[](const PIDEntry& entry, const uint16_t PID) { return entry.PID < PID; });
+	return (found != entries + count && found->PID == PID) ? found : nullptr;
+}
+
+const Run* StreamIndex::get_runs(const uint16_t PID, size_t* count) const
+{
+	*count = 0;
+	const auto entry = find_PID(PID);
+	size_t run_count;
+	const auto all_runs = get_section<Run>(PID_RUNS, &run_count);
+	if (!entry || entry->first_run + entry->run_count > run_count) {
+		return nullptr;
+	}
+	*count = entry->run_count;
+	return all_runs + entry->first_run;
+}
+
+const ClockCheckpoint* StreamIndex::get_PCR_checkpoints(size_t* count) const
+{
+	return get_section<ClockCheckpoint>(PCR_CHECKPOINTS, count);
+}
+
+const ClockCheckpoint* StreamIndex::get_PTS_checkpoints(size_t* count) const
+{
+	return get_section<ClockCheckpoint>(PTS_CHECKPOINTS, count);
+}
+
+const RandomAccessPoint* StreamIndex::get_random_access_points(size_t* count) const
+{
+	return get_section<RandomAccessPoint>(RANDOM_ACCESS_POINTS, count);
+}
+
+const PSIVersion* StreamIndex::get_PSI_versions(size_t* count) const
+{
+	return get_section<PSIVersion>(PSI_VERSIONS, count);
+}
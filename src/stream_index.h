@@ -0,0 +1,172 @@
+#pragma once
+
+#include <array>
+#include <cinttypes>
+#include <map>
+#include <string>
+#include <vector>
+#include "ts_packet.h"
+
+// Sidecar index of a TS file, written during a full parse.
+// The file is a header, a section directory and arrays of fixed-size
+// entries in host byte order, so it can be mapped and used in place.
+namespace stream_index
+{
+	constexpr uint32_t MAGIC      = 0x58495354; // "TSIX"
+	constexpr uint16_t VERSION    = 2;
+	constexpr uint16_t ENDIAN_MARK = 0x0102;
+
+	enum SectionType : uint32_t
+	{
+		PID_DIRECTORY        = 1,
+		PID_RUNS             = 2,
+		PCR_CHECKPOINTS      = 3,
+		PTS_CHECKPOINTS      = 4,
+		RANDOM_ACCESS_POINTS = 5,
+		PSI_VERSIONS         = 6,
+	};
+
+	struct FileHeader
+	{
+		uint32_t magic;
+		uint16_t version;
+		uint16_t byte_order;
+		uint8_t  unit_size;
+		uint8_t  offset;
+		uint16_t section_count;
+		uint32_t file_CRC;   // of the head and tail of the indexed TS file
+		uint64_t file_size;  // of the indexed TS file
+		uint64_t unit_count;
+	};
+
+	struct SectionEntry
+	{
+		uint32_t type;
+		uint32_t entry_size;
+		uint64_t offset;     // from the start of the index file
+		uint64_t count;
+	};
+
+	struct PIDEntry
+	{
+		uint16_t PID;
+		uint8_t  type;       // PidType
+		uint8_t  reserved;
+		uint32_t run_count;
+		uint64_t first_run;  // index into PID_RUNS
+		uint64_t packet_count;
+	};
+
+	// Consecutive packet units of one PID
+	struct Run
+	{
+		uint32_t first_unit;
+		uint32_t unit_count;
+	};
+
+	// PCR (27MHz) or PTS (90kHz) at a packet, about once a second per PID
+	struct ClockCheckpoint
+	{
+		uint64_t position;
+		uint64_t value;
+		uint16_t PID;
+		uint16_t reserved[3];
+	};
+
+	// PES packet starting with random_access_indicator set
+	struct RandomAccessPoint
+	{
+		uint64_t position;
+		uint16_t PID;
+		uint16_t reserved[3];
+	};
+
+	// First occurrence of each version of a section.
+	// position is that of the packet completing the section.
+	struct PSIVersion
+	{
+		uint64_t position;
+		uint16_t PID;
+		uint16_t table_id_extension;
+		uint8_t  table_id;
+		uint8_t  version_number;
+		uint8_t  section_number;
+		uint8_t  reserved;
+	};
+}
+
+class StreamIndexWriter
+{
+public:
+	StreamIndexWriter(const uint8_t unit_size, const uint8_t offset, const uint64_t file_size,
+		const uint32_t file_CRC);
+	~StreamIndexWriter() = default;
+
+	// type: of PID when the packet was parsed
+	void on_packet(const uint16_t PID, const uint8_t* packet, const uint64_t position, const PidType type);
+	void on_PCR(const uint16_t PID, const uint64_t PCR, const uint64_t position);
+	void on_section(const uint16_t PID, const uint8_t* section, const uint16_t length, const uint64_t position);
+
+	// PID_types: as known at the end of the stream
+	bool write(const std::string& file_path, const std::array<PidType, TS_PID_MAX>& PID_types);
+
+private:
+	static constexpr uint64_t PCR_interval = 27'000'000;
+	static constexpr uint64_t PTS_interval = 90'000;
+
+	uint8_t  unit_size;
+	uint8_t  offset;
+	uint64_t file_size;
+	uint32_t file_CRC;
+	uint64_t unit_count;
+
+	std::vector<std::vector<stream_index::Run>> runs; // indexed by PID
+	std::vector<uint64_t> packet_counts;
+	std::vector<uint64_t> last_PCR;
+	std::vector<uint64_t> last_PTS;
+
+	std::vector<stream_index::ClockCheckpoint>   PCR_checkpoints;
+	std::vector<stream_index::ClockCheckpoint>   PTS_checkpoints;
+	std::vector<stream_index::RandomAccessPoint> random_access_points;
+	std::vector<stream_index::PSIVersion>        PSI_versions;
+
+	// PID, table_id, table_id_extension, section_number -> version_number
+	std::map<uint64_t, uint8_t> section_versions;
+};
+
+// Read-only view of an index file, mapped into memory where possible
+class StreamIndex
+{
+public:
+	StreamIndex();
+	~StreamIndex();
+
+	StreamIndex(const StreamIndex&) = delete;
+	StreamIndex& operator=(const StreamIndex&) = delete;
+
+	bool open(const std::string& file_path);
+	void close();
+
+	// False when the index was made from a file of another size or content
+	bool matches(const uint64_t file_size, const uint32_t file_CRC) const;
+
+	const stream_index::FileHeader& get_header() const { return *header; }
+
+	const stream_index::PIDEntry* find_PID(const uint16_t PID) const;
+	const stream_index::Run* get_runs(const uint16_t PID, size_t* count) const;
+	const stream_index::ClockCheckpoint* get_PCR_checkpoints(size_t* count) const;
+	const stream_index::ClockCheckpoint* get_PTS_checkpoints(size_t* count) const;
+	const stream_index::RandomAccessPoint* get_random_access_points(size_t* count) const;
+	const stream_index::PSIVersion* get_PSI_versions(size_t* count) const;
+
+private:
+	template <typename Entry>
+	const Entry* get_section(const uint32_t type, size_t* count) const;
+
+	const uint8_t* data;
+	size_t size;
+	const stream_index::FileHeader* header;
+#if defined(_WIN32)
+	std::vector<uint8_t> contents;
+#endif
+};
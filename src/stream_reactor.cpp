@@ -0,0 +1,248 @@
+#include <cerrno>
+#include <cstdio>
+#include "stream_reactor.h"
+#include "input_source.h"
+#include "transport_stream.h"
+
+#if defined(__linux__)
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+
+WorkerPool::WorkerPool(const unsigned thread_count) :
+	next_worker(0)
+{
+	for (unsigned i = 0; i < thread_count; ++i) {
+		workers.push_back(std::make_unique<Worker>());
+	}
+	for (auto& worker : workers) {
+		const auto w = worker.get();
+		w->thread = std::thread([this, w] { run(w); });
+	}
+}
+
+WorkerPool::~WorkerPool()
+{
+	for (auto& worker : workers) {
+		{
+			std::lock_guard<std::mutex> lock(worker->mutex);
+			worker->stopping = true;
+		}
+		worker->ready.notify_one();
+	}
+	for (auto& worker : workers) {
+		worker->thread.join();
+	}
+}
+
+void WorkerPool::post(std::function<void()> task)
+{
+	post(next_worker.fetch_add(1, std::memory_order_relaxed), std::move(task));
+}
+
+void WorkerPool::post(const size_t key, std::function<void()> task)
+{
+	if (workers.empty()) {
+		task();
+		return;
+	}
+	auto& worker = *workers[key % workers.size()];
+	{
+		std::lock_guard<std::mutex> lock(worker.mutex);
+		worker.tasks.push_back(std::move(task));
+	}
+	worker.ready.notify_one();
+}
+
+void WorkerPool::run(Worker* worker)
+{
+	for (;;) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lock(worker->mutex);
+			worker->ready.wait(lock, [worker] { return worker->stopping || !worker->tasks.empty(); });
+			if (worker->tasks.empty()) {
+				return;
+			}
+			task = std::move(worker->tasks.front());
+			worker->tasks.pop_front();
+		}
+		task();
+	}
+}
+
+StreamReactor::StreamReactor(const unsigned worker_count) :
+	epoll_fd(-1),
+	wake_fd(-1),
+	stopping(false),
+	workers(worker_count)
+{}
+
+StreamReactor::~StreamReactor()
+{
+#if defined(__linux__)
+	if (wake_fd >= 0) {
+		close(wake_fd);
+	}
+	if (epoll_fd >= 0) {
+		close(epoll_fd);
+	}
+#endif
+}
+
+bool StreamReactor::open()
+{
+#if defined(__linux__)
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd < 0 || wake_fd < 0) {
+		fprintf(stderr, "epoll failed.\n");
+		return false;
+	}
+
+	// Level-triggered, so that every loop thread sees a stop
+	struct epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.ptr = nullptr;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &event) == 0;
+#else
+	fprintf(stderr, "StreamReactor is not supported on this platform.\n");
+	return false;
+#endif
+}
+
+void StreamReactor::on_section(std::function<void(const int stream_id, const uint16_t PID,
+	const std::vector<uint8_t>& section)> handler)
+{
+	section_handler = std::move(handler);
+}
+
+void StreamReactor::on_end(std::function<void(const int stream_id)> handler)
+{
+	end_handler = std::move(handler);
+}
+
+int StreamReactor::add_stream(InputSource* source, TransportStream* stream)
+{
+	const auto fd = source->get_fd();
+	if (fd < 0 || epoll_fd < 0) {
+		return -1;
+	}
+
+	Stream* entry;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		streams.push_back(std::make_unique<Stream>(Stream{
+			static_cast<int>(streams.size()), source, stream, fd, false }));
+		entry = streams.back().get();
+	}
+
+	if (section_handler) {
+		const auto id = entry->id;
+		stream->on_section([this, id](const uint16_t PID, const uint8_t* section, const uint16_t length) {
+			std::vector<uint8_t> data(section, section + length);
+			// One worker per stream keeps its sections in order
+			workers.post(id, [this, id, PID, data = std::move(data)] { section_handler(id, PID, data); });
+		});
+	}
+
+	// The first turn reads what is there already; the fd is armed after it
+	push_ready(entry);
+	return entry->id;
+}
+
+void StreamReactor::push_ready(Stream* stream)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ready.push_back(stream);
+	}
+#if defined(__linux__)
+	const uint64_t one = 1;
+	(void)!write(wake_fd, &one, sizeof(one));
+#endif
+}
+
+// Called by one loop thread at a time for a given stream: the stream is
+// either in the ready list or armed in the epoll set, never both
+void StreamReactor::process(Stream* stream)
+{
+#if defined(__linux__)
+	bool more;
+	if (!stream->stream->parse_ready(stream->source, turn_bytes, &more)) {
+		if (stream->registered) {
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, stream->fd, nullptr);
+		}
+		if (end_handler) {
+			end_handler(stream->id);
+		}
+		return;
+	}
+
+	if (more) {
+		push_ready(stream);
+		return;
+	}
+
+	struct epoll_event event = {};
+	event.events = EPOLLIN | EPOLLONESHOT;
+	event.data.ptr = stream;
+	epoll_ctl(epoll_fd, stream->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, stream->fd, &event);
+	stream->registered = true;
+#else
+	(void)stream;
+#endif
+}
+
+void StreamReactor::run()
+{
+#if defined(__linux__)
+	struct epoll_event events[max_events];
+	std::vector<Stream*> turn;
+
+	while (!stopping) {
+		const auto count = epoll_wait(epoll_fd, events, max_events, -1);
+		if (count < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "epoll_wait failed.\n");
+			break;
+		}
+
+		for (auto i = 0; i < count; ++i) {
+			if (events[i].data.ptr) {
+				process(static_cast<Stream*>(events[i].data.ptr));
+			}
+		}
+		if (stopping) {
+			break;
+		}
+
+		// Streams pushed while processing wait for the next turn
+		uint64_t value;
+		(void)!read(wake_fd, &value, sizeof(value));
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			turn.swap(ready);
+		}
+		for (const auto stream : turn) {
+			process(stream);
+		}
+		turn.clear();
+	}
+
+	// The stop signal may have been taken from the other loops above
+	stop();
+#endif
+}
+
+void StreamReactor::stop()
+{
+	stopping = true;
+#if defined(__linux__)
+	const uint64_t one = 1;
+	(void)!write(wake_fd, &one, sizeof(one));
+#endif
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <cinttypes>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class InputSource;
+class TransportStream;
+
+// Threads running posted tasks, each from a queue of its own.
+// Tasks posted with the same key run on the same thread in order of
+// posting, never at once. With no threads, tasks run on the posting thread.
+class WorkerPool
+{
+public:
+	explicit WorkerPool(const unsigned thread_count);
+	// Runs the tasks still queued, then joins
+	~WorkerPool();
+
+	WorkerPool(const WorkerPool&) = delete;
+	WorkerPool& operator=(const WorkerPool&) = delete;
+
+	// Spread over the threads in turn
+	void post(std::function<void()> task);
+	void post(const size_t key, std::function<void()> task);
+
+private:
+	struct Worker
+	{
+		std::thread thread;
+		std::mutex mutex;
+		std::condition_variable ready;
+		std::deque<std::function<void()>> tasks;
+		bool stopping = false;
+	};
+
+	void run(Worker* worker);
+
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::atomic<size_t> next_worker;
+};
+
+// Parses many inputs (sockets, pipes, growing files) on a few threads.
+// Each stream keeps its own TransportStream; an event loop thread reads
+// whatever a stream's source has ready with epoll and parses it, and hands
+// sections on to a shared worker pool. A stream is handled by one loop
+// thread at a time, and its sections by one worker in order, so handlers
+// need no locking of their own.
+// Linux only (epoll).
+class StreamReactor
+{
+public:
+	explicit StreamReactor(const unsigned worker_count = 2);
+	~StreamReactor();
+
+	StreamReactor(const StreamReactor&) = delete;
+	StreamReactor& operator=(const StreamReactor&) = delete;
+
+	bool open();
+
+	// Neither source nor stream is owned; both must outlive the reactor.
+	// Returns the stream id, or -1 when source cannot be polled.
+	int add_stream(InputSource* source, TransportStream* stream);
+
+	// Sections of the streams added after this is set are copied and passed
+	// to handler on the worker pool, those of one stream in order on one
+	// worker. Replaces the streams' section handlers.
+	void on_section(std::function<void(const int stream_id, const uint16_t PID,
+		const std::vector<uint8_t>& section)> handler);
+	// Called on a loop thread once the input of a stream has ended
+	void on_end(std::function<void(const int stream_id)> handler);
+
+	// Runs task on the worker pool
+	void post(std::function<void()> task) { workers.post(std::move(task)); }
+
+	// Runs an event loop on the calling thread until stop().
+	// Several threads may run loops at once.
+	void run();
+	// May be called from any thread
+	void stop();
+
+private:
+	struct Stream
+	{
+		int              id;
+		InputSource*     source;
+		TransportStream* stream;
+		int              fd;
+		bool             registered; // added to the epoll set
+	};
+
+	// Bytes parsed for one stream before the others get a turn
+	static constexpr size_t turn_bytes  = 256 << 10;
+	static constexpr int    max_events  = 64;
+
+	void process(Stream* stream);
+	void push_ready(Stream* stream);
+
+	int epoll_fd;
+	int wake_fd;  // eventfd: ready list or stop
+	std::atomic<bool> stopping;
+
+	std::mutex mutex; // streams and ready
+	std::vector<std::unique_ptr<Stream>> streams;
+	// Streams to be processed without waiting for their fd: new ones,
+	// and those that used up their turn
+	std::vector<Stream*> ready;
+
+	std::function<void(const int, const uint16_t, const std::vector<uint8_t>&)> section_handler;
+	std::function<void(const int)> end_handler;
+
+	WorkerPool workers;
+};
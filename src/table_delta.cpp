@@ -0,0 +1,261 @@
+/*
+ * Reference: ITU-T Rec. H.222.0 (05/2006) 2.4.4.8, ARIB STD-B10 Part 2 5.2.6, 5.2.7
+ */
+
+#include <algorithm>
+#include "table_delta.h"
+#include "crc32.h"
+
+using Type = TableDelta::Type;
+
+void TableDiffer::on_delta(std::function<void(const TableDelta&)> handler)
+{
+	delta_handler = std::move(handler);
+}
+
+void TableDiffer::emit(const Type type, const uint8_t table_id, const uint16_t id, const uint16_t item,
+	const uint64_t old_value, const uint64_t new_value)
+{
+	if (delta_handler) {
+		delta_handler({ type, table_id, id, item, old_value, new_value });
+	}
+}
+
+// Reads the item loops of a PMT, SDT or EIT section
+bool TableDiffer::summarize(const uint8_t* section, const uint16_t length, Summary* summary)
+{
+	const auto table_id = section[0];
+	const auto end = section + length - crc::CRC32_SIZE;
+	summary->id = section[3] << 8 | section[4];
+	summary->header_value = 0;
+	summary->header_descriptors_CRC = 0;
+	summary->segment_last_section_number = section[6];
+	summary->items.clear();
+
+	const uint8_t* p;
+	size_t item_header_length;
+	if (table_id == 0x02) {
+		summary->header_value = (section[8] & 0x1F) << 8 | section[9];
+		const auto program_info_length = (section[10] & 0x0F) << 8 | section[11];
+		p = section + 12;
+		if (p + program_info_length > end) {
+			return false;
+		}
+		summary->header_descriptors_CRC = crc::_crc32(p, program_info_length);
+		p += program_info_length;
+		item_header_length = 5;
+	}
+	else if (table_id == 0x42 || table_id == 0x46) {
+		p = section + 11;
+		item_header_length = 5;
+	}
+	else {
+		summary->segment_last_section_number = section[12];
+		p = section + 14;
+		item_header_length = 12;
+	}
+
+	while (p + item_header_length <= end) {
+		Item item;
+		uint16_t descriptors_loop_length;
+		if (table_id == 0x02) {
+			item.key    = (p[1] & 0x1F) << 8 | p[2];
+			item.value  = p[0];
+			item.value2 = 0;
+			descriptors_loop_length = (p[3] & 0x0F) << 8 | p[4];
+		}
+		else if (item_header_length == 5) {
+			item.key    = p[0] << 8 | p[1];
+			item.value  = p[3] >> 5;
+			item.value2 = (p[3] >> 4) & 0x01;
+			descriptors_loop_length = (p[3] & 0x0F) << 8 | p[4];
+		}
+		else {
+			item.key    = p[0] << 8 | p[1];
+			item.value  = p[10] >> 5;
+			item.value2 = 0;
+			for (auto i = 2; i < 10; ++i) {
+				item.value2 = item.value2 << 8 | p[i];
+			}
+			descriptors_loop_length = (p[10] & 0x0F) << 8 | p[11];
+		}
+
+		p += item_header_length;
+		if (p + descriptors_loop_length > end) {
+			return false;
+		}
+		item.descriptors_CRC = crc::_crc32(p, descriptors_loop_length);
+		p += descriptors_loop_length;
+		summary->items.push_back(item);
+	}
+
+	std::sort(summary->items.begin(), summary->items.end());
+	return true;
+}
+
+// Every section of the version is there. EIT schedules are sent in
+// segments of 8 sections, each one only up to its
+// segment_last_section_number.
+bool TableDiffer::is_complete(const SubTable& table, const bool segmented)
+{
+	if (!segmented) {
+		return table.sections.size() == table.last_section_number + 1u;
+	}
+	for (unsigned first = 0; first <= table.last_section_number; first += 8) {
+		const auto found = table.sections.lower_bound(static_cast<uint8_t>(first));
+		if (found == table.sections.end() || found->first > first + 7) {
+			return false;
+		}
+		const auto last = std::min<unsigned>({ found->second.segment_last_section_number,
+			first + 7, table.last_section_number });
+		for (auto section_number = first; section_number <= last; ++section_number) {
+			if (!table.sections.count(static_cast<uint8_t>(section_number))) {
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+// The items of all sections as one, the header from section 0
+void TableDiffer::merge(const SubTable& table, Summary* merged)
+{
+	*merged = table.sections.begin()->second;
+	for (auto it = std::next(table.sections.begin()); it != table.sections.end(); ++it) {
+		merged->items.insert(merged->items.end(), it->second.items.begin(), it->second.items.end());
+	}
+	std::stable_sort(merged->items.begin(), merged->items.end());
+	merged->items.erase(std::unique(merged->items.begin(), merged->items.end(),
+		[](const Item& a, const Item& b) { return a.key == b.key; }), merged->items.end());
+}
+
+void TableDiffer::compare(const Kind& kind, const uint8_t table_id, const Summary* last, const Summary& next)
+{
+	const auto id = next.id;
+
+	if (table_id == 0x02) {
+		if (!last || last->header_value != next.header_value) {
+			emit(Type::PCR_PID_changed, table_id, id, 0, last ? last->header_value : 0, next.header_value);
+		}
+		if (last && last->header_descriptors_CRC != next.header_descriptors_CRC) {
+			emit(Type::program_descriptors_changed, table_id, id, 0, 0, 0);
+		}
+	}
+
+	static const std::vector<Item> none;
+	const auto& old_items = last ? last->items : none;
+	auto old_item = old_items.begin();
+	auto new_item = next.items.begin();
+
+	// Both are sorted by key
+	while (old_item != old_items.end() || new_item != next.items.end()) {
+		if (new_item == next.items.end() || (old_item != old_items.end() && old_item->key < new_item->key)) {
+			emit(kind.removed, table_id, id, old_item->key, old_item->value, 0);
+			++old_item;
+			continue;
+		}
+		if (old_item == old_items.end() || new_item->key < old_item->key) {
+			emit(kind.added, table_id, id, new_item->key, 0, new_item->value);
+			++new_item;
+			continue;
+		}
+
+		if (old_item->value != new_item->value) {
+			emit(kind.value_changed, table_id, id, new_item->key, old_item->value, new_item->value);
+		}
+		if (old_item->value2 != new_item->value2) {
+			emit(kind.value2_changed, table_id, id, new_item->key, old_item->value2, new_item->value2);
+		}
+		if (old_item->descriptors_CRC != new_item->descriptors_CRC) {
+			emit(kind.descriptors_changed, table_id, id, new_item->key, 0, 0);
+		}
+		++old_item;
+		++new_item;
+	}
+}
+
+void TableDiffer::on_section(const uint16_t, const uint8_t* section, const uint16_t length)
+{
+	static constexpr Kind PMT_kind = { Type::ES_added, Type::ES_removed,
+		Type::stream_type_changed, Type::stream_type_changed, Type::ES_descriptors_changed };
+	static constexpr Kind SDT_kind = { Type::service_added, Type::service_removed,
+		Type::running_status_changed, Type::free_CA_mode_changed, Type::service_descriptors_changed };
+	static constexpr Kind EIT_kind = { Type::event_added, Type::event_removed,
+		Type::event_running_status_changed, Type::event_time_changed, Type::event_descriptors_changed };
+
+	const auto table_id = section[0];
+	const Kind* kind;
+	if (table_id == 0x02) {
+		kind = &PMT_kind;
+	}
+	else if (table_id == 0x42 || table_id == 0x46) {
+		kind = &SDT_kind;
+	}
+	else if (0x4E <= table_id && table_id <= 0x6F) {
+		kind = &EIT_kind;
+	}
+	else {
+		return;
+	}
+	// section_syntax_indicator, current_next_indicator
+	if (length < 15 || !(section[1] & 0x80) || !(section[5] & 0x01)) {
+		return;
+	}
+
+	const auto version_number = static_cast<int8_t>((section[5] >> 1) & 0x1F);
+	const auto section_number = section[6];
+	const auto last_section_number = section[7];
+	uint64_t key = (uint64_t)table_id << 56 | (uint64_t)(section[3] << 8 | section[4]) << 40;
+	if (table_id != 0x02) {
+		// original_network_id of SDT, transport_stream_id and original_network_id of EIT
+		key |= (uint64_t)(section[8] << 8 | section[9]) << 24;
+		if (kind == &EIT_kind) {
+			key |= (uint64_t)(section[10] << 8 | section[11]) << 8;
+		}
+	}
+
+	const auto CRC = (uint32_t)section[length - 4] << 24 | section[length - 3] << 16
+		| section[length - 2] << 8 | section[length - 1];
+	const auto found = tables.find(key);
+	if (found != tables.end() && found->second.version_number == version_number) {
+		const auto known = found->second.sections.find(section_number);
+		if (known != found->second.sections.end() && known->second.CRC == CRC) {
+			return;
+		}
+	}
+	if (crc::_crc32(section, length) != 0) {
+		return;
+	}
+
+	Summary next;
+	if (!summarize(section, length, &next)) {
+		return;
+	}
+	next.CRC = CRC;
+
+	auto& table = found != tables.end() ? found->second : tables[key];
+	if (found == tables.end()) {
+		table.version_number = -1;
+		table.compared = false;
+	}
+	if (table.version_number != version_number) {
+		table.version_number = version_number;
+		table.sections.clear();
+	}
+	table.last_section_number = last_section_number;
+	table.sections[section_number] = std::move(next);
+	// Sections past a shortened table are not part of the version
+	table.sections.erase(table.sections.upper_bound(last_section_number), table.sections.end());
+
+	// Items may move between sections: the sub-table is compared as a
+	// whole once the version is complete
+	const auto segmented = kind == &EIT_kind && table_id >= 0x50;
+	if (table.sections.empty() || !is_complete(table, segmented)) {
+		return;
+	}
+	Summary merged;
+	merge(table, &merged);
+	compare(*kind, table_id, table.compared ? &table.table : nullptr, merged);
+	table.table = std::move(merged);
+	table.compared = true;
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <cinttypes>
+#include <functional>
+#include <map>
+#include <vector>
+
+// One change between two versions of a PMT, SDT or EIT sub-table
+struct TableDelta
+{
+	enum class Type : uint8_t
+	{
+		// PMT: id is program_number, item elementary_PID
+		ES_added,
+		ES_removed,
+		stream_type_changed,          // values: stream_type
+		ES_descriptors_changed,
+		PCR_PID_changed,              // item: 0; values: PCR_PID
+		program_descriptors_changed,  // item: 0
+
+		// SDT: id is transport_stream_id, item service_id
+		service_added,
+		service_removed,
+		running_status_changed,       // values: running_status
+		free_CA_mode_changed,         // values: free_CA_mode
+		service_descriptors_changed,  // service name, type, logo...
+
+		// EIT: id is service_id, item event_id
+		event_added,
+		event_removed,
+		event_running_status_changed, // values: running_status
+		event_time_changed,           // values: start_time (40 bits) << 24 | duration
+		event_descriptors_changed,    // title, genre, components...
+	};
+
+	Type     type;
+	uint8_t  table_id;
+	uint16_t id;
+	uint16_t item;
+	uint64_t old_value; // 0 for additions
+	uint64_t new_value; // 0 for removals
+};
+
+// Turns PMT, SDT and EIT version changes into TableDelta events, so that
+// consumers update what changed instead of rebuilding from whole tables.
+// Fed with every section (TransportStream::on_section); a section is only
+// looked into when its CRC differs from the last one with the same key.
+// A sub-table is compared as a whole, the items of all its sections
+// together, once every section of a new version has been seen, so that
+// items moving between sections (the following event becoming the present
+// one) are not reported. Items are compared by a compact summary (the
+// fields above and a CRC of their descriptor loop), not by fully decoded
+// descriptors. The first version of a sub-table reports all its items as
+// added.
+class TableDiffer
+{
+public:
+	void on_delta(std::function<void(const TableDelta&)> handler);
+	void on_section(const uint16_t PID, const uint8_t* section, const uint16_t length);
+
+	// Forgets every section seen; the next ones are reported as added
+	void reset() { tables.clear(); }
+
+private:
+	struct Item
+	{
+		uint16_t key;
+		uint64_t value;  // stream_type / running_status
+		uint64_t value2; // - / free_CA_mode / start_time and duration
+		uint32_t descriptors_CRC;
+
+		bool operator<(const Item& other) const { return key < other.key; }
+	};
+
+	struct Summary
+	{
+		uint32_t CRC;
+		uint16_t id;
+		uint64_t header_value;           // PCR_PID
+		uint32_t header_descriptors_CRC; // program_info
+		uint8_t  segment_last_section_number; // EIT
+		std::vector<Item> items;         // sorted by key
+	};
+
+	struct SubTable
+	{
+		int8_t   version_number;      // of sections, -1 before any
+		uint8_t  last_section_number;
+		std::map<uint8_t, Summary> sections; // by section_number
+		bool     compared;            // table holds a version
+		Summary  table;               // items of all sections, last compared
+	};
+
+	// Event types of one table kind, by what changed
+	struct Kind
+	{
+		TableDelta::Type added;
+		TableDelta::Type removed;
+		TableDelta::Type value_changed;
+		TableDelta::Type value2_changed;
+		TableDelta::Type descriptors_changed;
+	};
+
+	static bool summarize(const uint8_t* section, const uint16_t length, Summary* summary);
+	static bool is_complete(const SubTable& table, const bool segmented);
+	static void merge(const SubTable& table, Summary* merged);
+	void compare(const Kind& kind, const uint8_t table_id, const Summary* last, const Summary& next);
+	void emit(const TableDelta::Type type, const uint8_t table_id, const uint16_t id, const uint16_t item,
+		const uint64_t old_value, const uint64_t new_value);
+
+	// Sub-tables by table_id, table_id_extension and the ids of the TS
+	std::map<uint64_t, SubTable> tables;
+
+	std::function<void(const TableDelta&)> delta_handler;
+};
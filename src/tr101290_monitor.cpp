@@ -0,0 +1,559 @@
+/*
+ * Reference: ETSI TR 101 290 V1.4.1 (2020-06)
+ */
+
+#include <algorithm>
+#include "tr101290_monitor.h"
+#include "pcr_tracker.h"
+#include "crc32.h"
+
+Tr101290Monitor::Tr101290Monitor() :
+	packet_count(0),
+	now(0),
+	clock_PID(0x1FFF),
+	PAT_timer{ 0, false },
+	NIT_timer{ 0, false },
+	SDT_timer{ 0, false },
+	EIT_timer{ 0, false },
+	TDT_timer{ 0, false },
+	CAT_seen(false),
+	scrambled(false),
+	last_CAT_check(0)
+{
+	for (auto& count : counts) {
+		count.store(0, std::memory_order_relaxed);
+	}
+	for (auto& slot : good_sections) {
+		slot.key = 0;
+	}
+	for (uint16_t PID = 0; PID < TS_PID_MAX; ++PID) {
+		PIDs[PID] = { no_next_header, -1, 0, PID < 0x20 ? PidKind::SI : PidKind::unreferenced, 0, 0x80 };
+		times[PID] = { false, 0, 0, 0 };
+	}
+}
+
+const char* Tr101290Monitor::get_check_name(const Tr101290Check check)
+{
+	static const char* const names[] = {
+		"TS_sync_loss", "Sync_byte_error", "PAT_error", "Continuity_count_error", "PMT_error", "PID_error",
+		"Transport_error", "CRC_error", "PCR_error", "PCR_repetition_error",
+		"PCR_discontinuity_indicator_error", "PCR_accuracy_error", "PTS_error", "CAT_error",
+		"NIT_error", "SDT_error", "EIT_error", "RST_error", "TDT_error", "unreferenced_PID",
+	};
+	const auto index = static_cast<size_t>(check);
+	return index < sizeof(names) / sizeof(names[0]) ? names[index] : "";
+}
+
+bool Tr101290Monitor::overdue(uint64_t* last, const uint64_t period)
+{
+	if (now - *last > period) {
+		*last = now;
+		return true;
+	}
+	return false;
+}
+
+void Tr101290Monitor::arrive(Timer* timer, const uint64_t period, const Tr101290Check check)
+{
+	if (timer->active && overdue(&timer->last, period)) {
+		increment(check);
+	}
+	timer->last = now;
+	timer->active = true;
+}
+
+void Tr101290Monitor::on_units(const size_t count)
+{
+	packet_count.store(packet_count.load(std::memory_order_relaxed) + count, std::memory_order_relaxed);
+}
+
+// The packets on_packet() does not settle itself
+void Tr101290Monitor::check_packet(const TSPHeader& header, const AdaptationField* adapt,
+	const uint8_t* packet, const uint64_t position)
+{
+	const auto PID = header.PID;
+	// 2.1: nothing else in the header can be trusted
+	if (header.transport_error_indicator) {
+		increment(Tr101290Check::transport_error);
+	}
+	else {
+		auto& state = PIDs[PID];
+		const auto adaptation_field_control = header.adaptation_field_control;
+		const int8_t continuity_counter = header.continuity_counter;
+
+		// 1.4
+		if ((adaptation_field_control & 0x01) && state.last_CC >= 0
+			&& continuity_counter == ((state.last_CC + 1) & 0x0F)) {
+			state.duplicate_count = 0;
+		}
+		else {
+			check_continuity(PID, header, adapt && adapt->discontinuity_indicator);
+		}
+		state.last_CC = continuity_counter;
+		state.next_header = state.duplicate_count ? no_next_header : next_header_of(continuity_counter);
+		state.flags |= seen_flag;
+
+		// 1.3, 1.5: PAT and PMT must not be scrambled
+		if (header.transport_scrambling_control) {
+			check_scrambled(PID);
+		}
+		// 2.5: PES headers with a PTS, looked into until one is seen each tick
+		else if (header.payload_unit_start_indicator && (adaptation_field_control & 0x01)
+			&& state.kind == PidKind::ES && !(state.flags & PTS_seen_flag)) {
+			check_PTS(PID, packet);
+		}
+	}
+
+	if (adapt && adapt->PCR_flag) {
+		on_PCR(PID, adapt->program_clock_reference_base * 300 + adapt->program_clock_reference_extension,
+			position, adapt->discontinuity_indicator == 1);
+	}
+}
+
+void Tr101290Monitor::check_scrambled(const uint16_t PID)
+{
+	scrambled = true;
+	if (PID == 0x0000) {
+		increment(Tr101290Check::PAT_error);
+	}
+	else if (PIDs[PID].kind == PidKind::PMT) {
+		increment(Tr101290Check::PMT_error);
+	}
+}
+
+void Tr101290Monitor::check_PTS(const uint16_t PID, const uint8_t* packet)
+{
+	const auto start = packet[3] & 0x20 ? 5 + packet[4] : 4;
+	if (start + 8 > TS_PACKET_SIZE) {
+		return;
+	}
+	const auto p = packet + start;
+	const auto stream_id = p[3];
+	// Stream ids without the optional PES header
+	const auto has_header = stream_id != 0xBC && stream_id != 0xBE && stream_id != 0xBF
+		&& stream_id != 0xF0 && stream_id != 0xF1 && stream_id != 0xFF
+		&& stream_id != 0xF2 && stream_id != 0xF8;
+	if (p[0] == 0x00 && p[1] == 0x00 && p[2] == 0x01 && has_header && (p[7] & 0x80)) {
+		PIDs[PID].flags |= PTS_seen_flag;
+		PIDs[PID].slow_bits = slow_bits_of(PIDs[PID]);
+	}
+}
+
+// 1.4 apart from the common case: one duplicate is allowed, the counter
+// stays without payload, and discontinuity_indicator or a sync loss
+// allows anything
+void Tr101290Monitor::check_continuity(const uint16_t PID, const TSPHeader& header,
+	const bool discontinuity_indicator)
+{
+	auto& state = PIDs[PID];
+	const auto adaptation_field_control = header.adaptation_field_control;
+	const int8_t continuity_counter = header.continuity_counter;
+
+	if (state.last_CC == resync_CC) {
+		state.duplicate_count = 0;
+	}
+	else if (state.last_CC < 0) {
+		times[PID].last_seen = now;
+		if (state.kind == PidKind::unreferenced) {
+			unreferenced.emplace_back(PID, now);
+		}
+	}
+	else if (discontinuity_indicator) {
+		state.duplicate_count = 0;
+	}
+	else if (adaptation_field_control & 0x01) {
+		if (continuity_counter == state.last_CC) {
+			if (++state.duplicate_count > 1) {
+				increment(Tr101290Check::continuity_count_error);
+			}
+		}
+		else {
+			state.duplicate_count = 0;
+			increment(Tr101290Check::continuity_count_error);
+		}
+	}
+	else if (continuity_counter != state.last_CC) {
+		increment(Tr101290Check::continuity_count_error);
+	}
+}
+
+void Tr101290Monitor::on_PCR(const uint16_t PID, const uint64_t PCR, const uint64_t position,
+	const bool discontinuity_indicator)
+{
+	if (clock_PID == 0x1FFF) {
+		clock_PID = PID;
+		PAT_timer = { now, true };
+		last_CAT_check = now;
+	}
+
+	// A program or two carry a PCR each, so a search beats a map
+	auto found = std::find_if(PCR_states.begin(), PCR_states.end(),
+		[PID](const PcrState& state) { return state.PID == PID; });
+	if (found == PCR_states.end()) {
+		PCR_states.push_back({ PID, PCR, position, 0, position });
+		return;
+	}
+	auto& state = *found;
+	if (discontinuity_indicator) {
+		state = { PID, PCR, position, 0, position };
+		return;
+	}
+
+	const auto delta = PCR >= state.last_PCR ? PCR - state.last_PCR : PCR + PCR_WRAP - state.last_PCR;
+	const auto bytes = position - state.last_position;
+	auto elapsed = delta;
+
+	// 2.3: a jump back counts as a long one
+	if (delta > PCR_jump) {
+		increment(Tr101290Check::PCR_error);
+		increment(Tr101290Check::PCR_discontinuity_indicator_error);
+		// The stream time goes on at the last bitrate
+		elapsed = state.span && position > state.first_position
+			? bytes * state.span / (state.last_position - state.first_position) : 0;
+		state = { PID, PCR, position, 0, position };
+	}
+	else {
+		if (delta > PCR_period) {
+			increment(Tr101290Check::PCR_error);
+			increment(Tr101290Check::PCR_repetition_error);
+		}
+
+		// 2.4: against the PCR expected at the bitrate since the last discontinuity
+		// (scaled by the bytes since then, which saves a division)
+		if (state.span >= 1000 * ms && state.last_position > state.first_position) {
+			const auto range = static_cast<double>(state.last_position - state.first_position);
+			const auto error = static_cast<double>(delta) * range - static_cast<double>(bytes) * state.span;
+			if (error > PCR_accuracy * range || error < -PCR_accuracy * range) {
+				increment(Tr101290Check::PCR_accuracy_error);
+			}
+		}
+		state.last_PCR = PCR;
+		state.last_position = position;
+		state.span += delta;
+	}
+
+	if (PID == clock_PID) {
+		tick(elapsed);
+	}
+}
+
+void Tr101290Monitor::tick(const uint64_t elapsed)
+{
+	now += elapsed;
+
+	// 1.3
+	if (PAT_timer.active && overdue(&PAT_timer.last, PAT_period)) {
+		increment(Tr101290Check::PAT_error);
+	}
+	// 3.1, 3.5, 3.6, 3.8
+	if (NIT_timer.active && overdue(&NIT_timer.last, NIT_period)) {
+		increment(Tr101290Check::NIT_error);
+	}
+	if (SDT_timer.active && overdue(&SDT_timer.last, SDT_period)) {
+		increment(Tr101290Check::SDT_error);
+	}
+	if (EIT_timer.active && overdue(&EIT_timer.last, EIT_period)) {
+		increment(Tr101290Check::EIT_error);
+	}
+	if (TDT_timer.active && overdue(&TDT_timer.last, TDT_period)) {
+		increment(Tr101290Check::TDT_error);
+	}
+
+	for (const auto PID : watched) {
+		auto& state = PIDs[PID];
+		auto& time = times[PID];
+		if (state.flags & seen_flag) {
+			time.last_seen = now;
+		}
+		if (state.flags & PTS_seen_flag) {
+			time.has_PTS = true;
+			time.last_PTS = now;
+		}
+		state.flags = 0;
+		state.slow_bits = slow_bits_of(state);
+
+		if (state.kind == PidKind::PMT) {
+			// 1.5
+			if (overdue(&time.last_section, PMT_period)) {
+				increment(Tr101290Check::PMT_error);
+			}
+		}
+		else {
+			// 1.6, 2.5
+			if (overdue(&time.last_seen, PID_period)) {
+				increment(Tr101290Check::PID_error);
+			}
+			if (time.has_PTS && overdue(&time.last_PTS, PTS_period)) {
+				increment(Tr101290Check::PTS_error);
+			}
+		}
+	}
+
+	// 3.4: PIDs still not referenced a while after they appeared
+	const auto end = std::remove_if(unreferenced.begin(), unreferenced.end(),
+		[this](const std::pair<uint16_t, uint64_t>& entry) {
+			if (PIDs[entry.first].kind != PidKind::unreferenced) {
+				return true;
+			}
+			if (now - entry.second > unreferenced_period) {
+				increment(Tr101290Check::unreferenced_PID);
+				return true;
+			}
+			return false;
+		});
+	unreferenced.erase(end, unreferenced.end());
+
+	// 2.6: scrambled packets with no CAT
+	if (overdue(&last_CAT_check, CAT_period)) {
+		if (scrambled && !CAT_seen) {
+			increment(Tr101290Check::CAT_error);
+		}
+		scrambled = false;
+	}
+}
+
+void Tr101290Monitor::on_sync_error(const uint64_t, const bool lost)
+{
+	// 1.2 for each sync_byte missing; 1.1 at two in a row, after which the
+	// parser finds sync again before reporting any more
+	increment(Tr101290Check::sync_byte_error);
+	if (!lost) {
+		return;
+	}
+	increment(Tr101290Check::sync_byte_error);
+	increment(Tr101290Check::TS_sync_loss);
+
+	// Packets are missing: continuity and PCR arrival start over
+	for (auto& state : PIDs) {
+		if (state.last_CC >= 0) {
+			state.last_CC = resync_CC;
+			state.next_header = no_next_header;
+		}
+	}
+	PCR_states.clear();
+}
+
+void Tr101290Monitor::on_section(const uint16_t PID, const uint8_t* section, const uint16_t length)
+{
+	if (length < 3) {
+		return;
+	}
+	const auto table_id = section[0];
+
+	// 2.2: every section with a CRC_32 (TOT has one without the syntax)
+	bool changed = true;
+	if (((section[1] & 0x80) || table_id == 0x73) && !check_CRC(PID, section, length, &changed)) {
+		increment(Tr101290Check::CRC_error);
+		return;
+	}
+
+	switch (PID) {
+	case 0x0000:
+		if (table_id != 0x00) {
+			increment(Tr101290Check::PAT_error);
+			return;
+		}
+		arrive(&PAT_timer, PAT_period, Tr101290Check::PAT_error);
+		if (changed) {
+			on_PAT(section, length);
+		}
+		return;
+	case 0x0001:
+		if (table_id != 0x01) {
+			increment(Tr101290Check::CAT_error);
+			return;
+		}
+		on_CAT(section, length);
+		return;
+	case 0x0010:
+		if (table_id != 0x40 && table_id != 0x41 && table_id != 0x72) {
+			increment(Tr101290Check::NIT_error);
+		}
+		else if (table_id == 0x40) {
+			arrive(&NIT_timer, NIT_period, Tr101290Check::NIT_error);
+		}
+		return;
+	case 0x0011:
+		if (table_id != 0x42 && table_id != 0x46 && table_id != 0x4A && table_id != 0x72) {
+			increment(Tr101290Check::SDT_error);
+		}
+		else if (table_id == 0x42) {
+			arrive(&SDT_timer, SDT_period, Tr101290Check::SDT_error);
+		}
+		return;
+	case 0x0012:
+		if ((table_id < 0x4E || table_id > 0x6F) && table_id != 0x72) {
+			increment(Tr101290Check::EIT_error);
+		}
+		else if (table_id == 0x4E && length > 6 && section[6] == 0) {
+			arrive(&EIT_timer, EIT_period, Tr101290Check::EIT_error);
+		}
+		return;
+	case 0x0013:
+		if (table_id != 0x71 && table_id != 0x72) {
+			increment(Tr101290Check::RST_error);
+		}
+		return;
+	case 0x0014:
+		if (table_id != 0x70 && table_id != 0x72 && table_id != 0x73) {
+			increment(Tr101290Check::TDT_error);
+		}
+		else if (table_id != 0x72) {
+			arrive(&TDT_timer, TDT_period, Tr101290Check::TDT_error);
+		}
+		return;
+	default:
+		break;
+	}
+
+	if (PIDs[PID].kind != PidKind::PMT || table_id != 0x02) {
+		return;
+	}
+	auto& time = times[PID];
+	if (overdue(&time.last_section, PMT_period)) {
+		increment(Tr101290Check::PMT_error);
+	}
+	time.last_section = now;
+	if (changed) {
+		on_PMT(PID, section, length);
+	}
+}
+
+// Sections mostly repeat unchanged: comparing one with the last good copy
+// costs much less than computing its CRC. *changed is cleared for a copy.
+bool Tr101290Monitor::check_CRC(const uint16_t PID, const uint8_t* section, const uint16_t length,
+	bool* changed)
+{
+	if (length < 3 + crc::CRC32_SIZE) {
+		return false;
+	}
+	uint64_t key = (uint64_t)PID << 40 | (uint64_t)section[0] << 32;
+	if (length >= 8 && (section[1] & 0x80)) {
+		key |= (uint64_t)(section[3] << 8 | section[4]) << 8 | section[6];
+	}
+
+	auto& last = good_sections[(key * 0x9E3779B97F4A7C15) >> (64 - good_section_bits)];
+	if (last.key == key && last.bytes.size() == length
+		&& std::equal(last.bytes.begin(), last.bytes.end(), section)) {
+		*changed = false;
+		return true;
+	}
+	if (crc::_crc32(section, length) != 0) {
+		return false;
+	}
+	last.key = key;
+	last.bytes.assign(section, section + length);
+	return true;
+}
+
+void Tr101290Monitor::on_PAT(const uint8_t* section, const uint16_t length)
+{
+	if (length < 12) {
+		return;
+	}
+
+	PMT_PIDs.clear();
+	for (auto p = section + 8; p + 4 <= section + length - crc::CRC32_SIZE; p += 4) {
+		const uint16_t program_number = p[0] << 8 | p[1];
+		const uint16_t PID = (p[2] & 0x1F) << 8 | p[3];
+		// network_PID is not a PMT
+		if (program_number) {
+			PMT_PIDs.push_back(PID);
+		}
+	}
+	update_kinds();
+}
+
+void Tr101290Monitor::on_PMT(const uint16_t PID, const uint8_t* section, const uint16_t length)
+{
+	if (length < 16) {
+		return;
+	}
+
+	auto& PIDs_of_program = program_PIDs[PID];
+	PIDs_of_program.clear();
+	PIDs_of_program.push_back((section[8] & 0x1F) << 8 | section[9]); // PCR_PID
+
+	const auto end = section + length - crc::CRC32_SIZE;
+	const auto program_info_length = (section[10] & 0x0F) << 8 | section[11];
+	auto p = section + 12;
+	add_CA_PIDs(p, std::min(p + program_info_length, end), &PIDs_of_program);
+	p += program_info_length;
+
+	while (p + 5 <= end) {
+		const uint16_t elementary_PID = (p[1] & 0x1F) << 8 | p[2];
+		const auto ES_info_length = (p[3] & 0x0F) << 8 | p[4];
+		PIDs_of_program.push_back(elementary_PID);
+		p += 5;
+		add_CA_PIDs(p, std::min(p + ES_info_length, end), &PIDs_of_program);
+		p += ES_info_length;
+	}
+	update_kinds();
+}
+
+void Tr101290Monitor::on_CAT(const uint8_t* section, const uint16_t length)
+{
+	CAT_seen = true;
+	if (length < 12) {
+		return;
+	}
+	EMM_PIDs.clear();
+	add_CA_PIDs(section + 8, section + length - crc::CRC32_SIZE, &EMM_PIDs);
+	update_kinds();
+}
+
+// CA_PIDs of the CA descriptors in [p, end), tagged with the top bit
+void Tr101290Monitor::add_CA_PIDs(const uint8_t* p, const uint8_t* end, std::vector<uint16_t>* PIDs)
+{
+	while (p + 2 <= end) {
+		const auto descriptor_tag = p[0];
+		const auto descriptor_length = p[1];
+		if (descriptor_tag == 0x09 && descriptor_length >= 4 && p + 6 <= end) {
+			PIDs->push_back(0x8000 | (p[4] & 0x1F) << 8 | p[5]);
+		}
+		p += 2 + descriptor_length;
+	}
+}
+
+// Redoes the PID kinds after a PAT, PMT or CAT change
+void Tr101290Monitor::update_kinds()
+{
+	std::array<PidKind, TS_PID_MAX> kinds;
+	kinds.fill(PidKind::unreferenced);
+	std::fill(kinds.begin(), kinds.begin() + 0x20, PidKind::SI);
+
+	for (const auto PID : EMM_PIDs) {
+		kinds[PID & 0x1FFF] = PidKind::CA;
+	}
+	for (const auto PMT_PID : PMT_PIDs) {
+		const auto found = program_PIDs.find(PMT_PID);
+		if (found == program_PIDs.end()) {
+			continue;
+		}
+		for (const auto PID : found->second) {
+			if (PID & 0x8000) {
+				kinds[PID & 0x1FFF] = PidKind::CA;
+			}
+			else if (PID >= 0x20 && PID != 0x1FFF) {
+				kinds[PID] = PidKind::ES;
+			}
+		}
+	}
+	for (const auto PID : PMT_PIDs) {
+		kinds[PID & 0x1FFF] = PidKind::PMT;
+	}
+
+	watched.clear();
+	for (uint16_t PID = 0; PID < TS_PID_MAX; ++PID) {
+		auto& state = PIDs[PID];
+		if (state.kind != kinds[PID]) {
+			// Periods start when the PID is first referenced
+			state.kind = kinds[PID];
+			state.slow_bits = slow_bits_of(state);
+			times[PID] = { false, now, now, now };
+		}
+		if (state.kind == PidKind::PMT || state.kind == PidKind::ES) {
+			watched.push_back(PID);
+		}
+	}
+}
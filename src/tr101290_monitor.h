@@ -0,0 +1,237 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cinttypes>
+#include <map>
+#include <vector>
+#include "ts_packet.h"
+
+// Indicators of ETSI TR 101 290 (V1.4.1) 5.2
+enum class Tr101290Check : uint8_t
+{
+	// First priority
+	TS_sync_loss,
+	sync_byte_error,
+	PAT_error,
+	continuity_count_error,
+	PMT_error,
+	PID_error,
+
+	// Second priority
+	transport_error,
+	CRC_error,
+	PCR_error,                         // either of the next two
+	PCR_repetition_error,
+	PCR_discontinuity_indicator_error,
+	PCR_accuracy_error,
+	PTS_error,
+	CAT_error,
+
+	// Third priority
+	NIT_error,
+	SDT_error,
+	EIT_error,
+	RST_error,
+	TDT_error,
+	unreferenced_PID,
+
+	count
+};
+
+// Counts TR 101 290 errors while the stream is parsed. During
+// TransportStream's monitor_stream() the parser hands it each packet, with
+// the header and adaptation field it decodes anyway, each section and each
+// sync error, so that monitoring adds little to a parse.
+// Periods are measured on the stream's own clock, the first PCR_PID seen,
+// and checked at each of its PCRs; nothing times out before a PCR is seen.
+// Tables the TR wants every so often (NIT, SDT, EIT, TDT) are only
+// required once they have appeared. Buffer and data delay checks are not
+// made.
+// Counters may be read from any thread at any time without locking; each
+// one is written by the parser thread only.
+class Tr101290Monitor
+{
+public:
+	Tr101290Monitor();
+
+	Tr101290Monitor(const Tr101290Monitor&) = delete;
+	Tr101290Monitor& operator=(const Tr101290Monitor&) = delete;
+
+	// Parser thread only
+	// Units in sync, null packets included
+	void on_units(const size_t count);
+	// A packet other than a null one; adapt is null when the adaptation
+	// field could not be parsed
+	void on_packet(const TSPHeader& header, const AdaptationField* adapt,
+		const uint8_t* packet, const uint64_t position)
+	{
+		// Most packets are a payload with the next counter and nothing else
+		// to look at: one compare of their bytes 1 and 3 (the adaptation
+		// field bit aside) settles them, given no PCR or discontinuity
+		auto& state = PIDs[header.PID];
+		if (((packet[1] & state.slow_bits) << 8 | (packet[3] & 0xDF)) == state.next_header
+			&& adapt && !(adapt->flags & 0x90)) {
+			const int8_t continuity_counter = packet[3] & 0x0F;
+			state.last_CC = continuity_counter;
+			state.next_header = next_header_of(continuity_counter);
+			state.flags |= seen_flag;
+			return;
+		}
+		check_packet(header, adapt, packet, position);
+	}
+	void on_section(const uint16_t PID, const uint8_t* section, const uint16_t length);
+	void on_sync_error(const uint64_t position, const bool lost);
+
+	// Any thread
+	uint64_t get_count(const Tr101290Check check) const
+	{
+		return counts[static_cast<size_t>(check)].load(std::memory_order_relaxed);
+	}
+	uint64_t get_packet_count() const { return packet_count.load(std::memory_order_relaxed); }
+	static const char* get_check_name(const Tr101290Check check);
+
+private:
+	// Limits in 27MHz units
+	static constexpr uint64_t ms = 27'000;
+	static constexpr uint64_t PAT_period        = 500 * ms;
+	static constexpr uint64_t PMT_period        = 500 * ms;
+	static constexpr uint64_t PID_period        = 5000 * ms; // "user specified"
+	static constexpr uint64_t PCR_period        = 40 * ms;
+	static constexpr uint64_t PCR_jump          = 100 * ms;
+	static constexpr double   PCR_accuracy      = 13.5;      // 500ns
+	static constexpr uint64_t PTS_period        = 700 * ms;
+	static constexpr uint64_t NIT_period        = 10000 * ms;
+	static constexpr uint64_t SDT_period        = 2000 * ms;
+	static constexpr uint64_t EIT_period        = 2000 * ms;
+	static constexpr uint64_t TDT_period        = 30000 * ms;
+	static constexpr uint64_t unreferenced_period = 500 * ms;
+	static constexpr uint64_t CAT_period        = 500 * ms;
+
+	enum class PidKind : uint8_t
+	{
+		unreferenced,
+		SI,  // fixed PIDs 0x0000-0x001F
+		PMT,
+		ES,  // elementary stream or PCR of a program
+		CA,  // ECM / EMM
+	};
+
+	// Touched for every packet
+	struct PidState
+	{
+		// Byte 3 of the next packet, less adaptation_field_control's first
+		// bit, if it may take the fast path in on_packet(), with the bits of
+		// byte 1 in slow_bits clear
+		uint16_t next_header;
+		int8_t   last_CC;         // -1: not seen yet, resync_CC: not since sync loss
+		uint8_t  duplicate_count;
+		PidKind  kind;
+		uint8_t  flags;           // seen, PTS_seen since the last tick
+		uint8_t  slow_bits;       // transport_error_indicator, and payload_unit_start_indicator while a PTS is wanted
+	};
+	static constexpr int8_t   resync_CC     = -2;
+	static constexpr uint8_t  seen_flag     = 0x01;
+	static constexpr uint8_t  PTS_seen_flag = 0x02;
+	static constexpr uint16_t no_next_header = 0xFFFF; // never matches
+
+	// Not scrambled, a payload, the next continuity_counter
+	static uint16_t next_header_of(const int8_t continuity_counter)
+	{
+		return 0x10 | ((continuity_counter + 1) & 0x0F);
+	}
+	static uint8_t slow_bits_of(const PidState& state)
+	{
+		return state.kind == PidKind::ES && !(state.flags & PTS_seen_flag) ? 0xC0 : 0x80;
+	}
+
+	// Touched at ticks, for the watched PIDs
+	struct PidTimes
+	{
+		bool     has_PTS;
+		uint64_t last_seen;
+		uint64_t last_PTS;
+		uint64_t last_section;    // PMT
+	};
+
+	struct Timer
+	{
+		uint64_t last;
+		bool     active;
+	};
+
+	struct PcrState
+	{
+		uint16_t PID;
+		uint64_t last_PCR;
+		uint64_t last_position;
+		// Since the last discontinuity, for the bitrate the PCRs are checked against
+		uint64_t span;
+		uint64_t first_position;
+	};
+
+	void increment(const Tr101290Check check)
+	{
+		auto& count = counts[static_cast<size_t>(check)];
+		count.store(count.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+	}
+
+	// True once per period of absence, at the end of it
+	bool overdue(uint64_t* last, const uint64_t period);
+	void arrive(Timer* timer, const uint64_t period, const Tr101290Check check);
+	void tick(const uint64_t elapsed);
+	void check_packet(const TSPHeader& header, const AdaptationField* adapt,
+		const uint8_t* packet, const uint64_t position);
+	void on_PCR(const uint16_t PID, const uint64_t PCR, const uint64_t position,
+		const bool discontinuity_indicator);
+	void check_continuity(const uint16_t PID, const TSPHeader& header, const bool discontinuity_indicator);
+	void check_scrambled(const uint16_t PID);
+	void check_PTS(const uint16_t PID, const uint8_t* packet);
+
+	bool check_CRC(const uint16_t PID, const uint8_t* section, const uint16_t length, bool* changed);
+	void on_PAT(const uint8_t* section, const uint16_t length);
+	void on_PMT(const uint16_t PID, const uint8_t* section, const uint16_t length);
+	void on_CAT(const uint8_t* section, const uint16_t length);
+	void add_CA_PIDs(const uint8_t* p, const uint8_t* end, std::vector<uint16_t>* PIDs);
+	void update_kinds();
+
+	std::array<std::atomic<uint64_t>, static_cast<size_t>(Tr101290Check::count)> counts;
+	std::atomic<uint64_t> packet_count;
+
+	std::array<PidState, TS_PID_MAX> PIDs;
+	std::array<PidTimes, TS_PID_MAX> times;
+
+	// Stream time, advanced at each PCR of clock_PID
+	uint64_t now;
+	uint16_t clock_PID;
+	std::vector<PcrState> PCR_states;
+
+	Timer PAT_timer;
+	Timer NIT_timer;
+	Timer SDT_timer;
+	Timer EIT_timer;
+	Timer TDT_timer;
+
+	// From the tables, for PidKind
+	std::vector<uint16_t> PMT_PIDs;
+	std::map<uint16_t, std::vector<uint16_t>> program_PIDs; // by PMT PID
+	std::vector<uint16_t> EMM_PIDs;
+	bool CAT_seen;
+
+	// Last section with a good CRC in each slot, by a hash of PID, table_id,
+	// table_id_extension and section_number. Sections whose keys share a
+	// slot only have their CRC computed more often.
+	struct GoodSection
+	{
+		uint64_t key;
+		std::vector<uint8_t> bytes;
+	};
+	static constexpr int good_section_bits = 6;
+	std::array<GoodSection, 1 << good_section_bits> good_sections;
+
+	std::vector<uint16_t> watched; // PMT and ES PIDs
+	std::vector<std::pair<uint16_t, uint64_t>> unreferenced; // PID, first seen
+
+	bool     scrambled;  // since the last CAT check
+	uint64_t last_CAT_check;
+};
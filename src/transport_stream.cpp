@@ -3,22 +3,73 @@
  */
 
 #include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <vector>
 #include <fstream>
+#include <map>
 #include "transport_stream.h"
 #include "ts_packet.h"
 #include "ts_common_utils.h"
 #include "ts_tables.h"
+#include "crc32.h"
+#include "es_extractor.h"
+#include "partial_ts_writer.h"
+#include "ts_archive.h"
+#include "pcr_tracker.h"
+#include "stream_index.h"
+#include "keyframe_indexer.h"
+#include "audio_frame_indexer.h"
+#include "hls_segmenter.h"
+#include "file_watcher.h"
+#include "input_source.h"
+#include "shared_ring.h"
+#include "table_delta.h"
+#include "tr101290_monitor.h"
+
+// ITU-T Rec. H.222.0 Table 2-3, ARIB STD-B10 Part 2 Table 5-4
+static constexpr uint16_t SI_PIDs[] = {
+	0x0000, // PAT
+	0x0001, // CAT
+	0x0002, // TSDT
+	0x0010, // NIT
+	0x0011, // SDT, BAT
+	0x0012, // EIT (H-EIT)
+	0x0013, // RST
+	0x0014, // TDT, TOT
+	0x0023, // SDTT
+	0x0024, // BIT
+	0x0025, // NBIT, LDT
+	0x0026, // EIT (M-EIT)
+	0x0027, // EIT (L-EIT)
+	0x0028, // SDTT
+	0x0029, // CDT
+};
 
 TransportStream::TransportStream() :
 	last_continuity_counter(-1),
 	last_PID(0x1FFF),
 	last_PSI_PID(0x1FFF),
-	drop_count(0)
-{}
+	drop_count(0),
+	active_monitor(nullptr),
+	syncing(false),
+	following(false),
+	block_filled(0),
+	block_pending(0),
+	unit_size(0),
+	offset(0),
+	stream_position(0),
+	position(0)
+{
+	PID_types.fill(PidType::unknown);
+	for (const auto PID : SI_PIDs) {
+		PID_types[PID] = PidType::section;
+	}
+	PID_types[0x1FFF] = PidType::null;
+}
 
 template<typename String>
-auto TransportStream::open(const String file_path)
+void TransportStream::open(const String file_path)
 {
 	input.open(file_path, std::ios::in | std::ios::binary);
 	if (!input.is_open() || input.fail()) {
@@ -32,6 +83,7 @@ auto TransportStream::open(const String file_path)
 	}
 
 	offset = unit_size == TTS_PACKET_SIZE ? 4 : 0;
+	stream_position = 0;
 
 	//fprintf(stdout, "unit_size: %d", unit_size);
 }
@@ -78,7 +130,6 @@ bool TransportStream::check_continuity()
 				}
 			}
 			else {
-				fprintf(stderr, "%d, %d\n", last_continuity_counter, header.continuity_counter);
 				return false;
 			}
 		}
@@ -105,116 +156,104 @@ int TransportStream::check_TS_unit_size()
 
 	input.seekg(std::ios::beg);
 
-	auto sync_count = [buf_size, &buffer]
-		(const size_t unit_size, const ptrdiff_t offset = 0) {
-		auto cnt = 0;
-		for (auto i = 0; i < buf_size; i += unit_size) {
-			if (buffer[i + offset] == 0x47)
-				++cnt;
-		}
-		return cnt;
-	};
-
-	const auto ts_cnt = sync_count(TS_PACKET_SIZE);
-	const auto tts_cnt = sync_count(TTS_PACKET_SIZE, TTS_PACKET_SIZE - TS_PACKET_SIZE);
-	const auto fects_cnt = sync_count(FEC_TS_PACKET_SIZE);
+	return detect_unit_size(buffer.get(), buf_size);
+}
 
-	return (ts_cnt > tts_cnt && ts_cnt > fects_cnt) ? TS_PACKET_SIZE :
-		   (tts_cnt > fects_cnt) ? TTS_PACKET_SIZE : FEC_TS_PACKET_SIZE;
+bool TransportStream::parse_payload(TSPacket &tsp)
+{
+	switch (PID_types[header.PID]) {
+	case PidType::section:
+		return parse_section_payload(tsp);
+	case PidType::PES:
+		return parse_PES_payload(tsp);
+	default:
+		return false;
+	}
 }
 
-int resync(std::fstream &fs, uint8_t* buffer)
+bool TransportStream::parse_PES_payload(TSPacket &tsp)
 {
-	return 0;
+	if (PES_assembler.enabled()) {
+		PES_assembler.push(header.PID, header.payload_unit_start_indicator == 1,
+			adapt.random_access_indicator, position, buffer,
+			tsp.data_byte, tsp.data_byte_length);
+	}
+
+	return false;
 }
 
-bool TransportStream::parse_payload(TSPacket &tsp)
+bool TransportStream::parse_section_payload(TSPacket &tsp)
 {
-	const auto is_pes = tsp.is_PES();
 	bool exist_sections = false;
 
 	//printf("PID: %x", header.PID);
 	if (header.payload_unit_start_indicator == 1) {
-		if (is_pes) {
-			// the first byte of a PES packet
-			PesPacket pes;
-			if (!tsp.parse_PES_packet(&pes)) {
-				return false;
+		// the first byte of a PSI section
+		//     -> the first byte carries the pointer_field
+		// a value of 0x00 in the pointer_field indicates that
+		// the section starts immediately after the pointer_field
+		const auto pointer_field = tsp.data_byte[0];
+		if (pointer_field != 0 && !section_buffer.empty()) {
+			// Multiple sections
+			if (entire_section_length - section_buffer.size() == pointer_field) {
+				section_buffer.insert(
+					section_buffer.end(),
+					&tsp.data_byte[1],
+					&tsp.data_byte[1 + pointer_field]
+					);
+				section_list.push_back(section_buffer);
+				section_buffer.clear();
+				exist_sections = true;
 			}
-		}
-		else {
-			// the first byte of a PSI section
-			//     -> the first byte carries the pointer_field
-			// a value of 0x00 in the pointer_field indicates that
-			// the section starts immediately after the pointer_field
-			const auto pointer_field = tsp.data_byte[0];
-			if (pointer_field != 0 && !section_buffer.empty()) {
-				// Multiple sections
-				if (entire_section_length - section_buffer.size() == pointer_field) {
-					section_buffer.insert(
-						section_buffer.end(),
-						&tsp.data_byte[1],
-						&tsp.data_byte[1 + pointer_field]
-						);
-					section_list.push_back(section_buffer);
-					section_buffer.clear();
-					exist_sections = true;
-				}
-				else {
-					// invalid
-				}
+			else {
+				// invalid
 			}
+		}
 
-			// section_start_idx indicates the start of a section
-			auto section_start_idx = 1 + pointer_field;
+		// section_start_idx indicates the start of a section
+		auto section_start_idx = 1 + pointer_field;
 
-			do {
-				const auto table_id = tsp.data_byte[section_start_idx];
-				if (table_id == 0xFF) // Stuffing
-					break;
+		do {
+			const auto table_id = tsp.data_byte[section_start_idx];
+			if (table_id == 0xFF) // Stuffing
+				break;
 
-				entire_section_length = 3 + read_bits<uint16_t>(&tsp.data_byte[section_start_idx + 1], 4, 12);
+			entire_section_length = 3 + read_bits<uint16_t>(&tsp.data_byte[section_start_idx + 1], 4, 12);
 
-				section_buffer.assign(&tsp.data_byte[section_start_idx],
-					&tsp.data_byte[
-						std::min(
-							section_start_idx + entire_section_length,
-							static_cast<int>(tsp.data_byte_length))
-					]);
+			section_buffer.assign(&tsp.data_byte[section_start_idx],
+				&tsp.data_byte[
+					std::min(
+						section_start_idx + entire_section_length,
+						static_cast<int>(tsp.data_byte_length))
+				]);
 
-				if (entire_section_length == section_buffer.size()) {
-					section_list.push_back(section_buffer);
-					section_buffer.clear();
-					exist_sections = true;
-				}
+			if (entire_section_length == section_buffer.size()) {
+				section_list.push_back(section_buffer);
+				section_buffer.clear();
+				exist_sections = true;
+			}
 
-				section_start_idx += entire_section_length;
+			section_start_idx += entire_section_length;
 
-			} while (section_start_idx < tsp.data_byte_length);
+		} while (section_start_idx < tsp.data_byte_length);
 
-			last_PSI_PID = header.PID;
-		}
+		last_PSI_PID = header.PID;
 	}
 	else {
-		// no PES packet
-		if (is_pes) {
-		}
-		else {
-			// not the first byte of a PSI section
-			//     -> no pointer_field in the payload
-			if (!section_buffer.empty() && header.PID == last_PSI_PID) {
-				section_buffer.insert(section_buffer.end(), tsp.data_byte,
-					&tsp.data_byte[
-						std::min(
-							entire_section_length - section_buffer.size(),
-							static_cast<size_t>(tsp.data_byte_length))
-					]);
-
-				if (entire_section_length == section_buffer.size()) {
-					section_list.push_back(section_buffer);
-					section_buffer.clear();
-					exist_sections = true;
-				}
+		// not the first byte of a PSI section
+		//     -> no pointer_field in the payload
+		if (!section_buffer.empty() && header.PID == last_PSI_PID) {
+			section_buffer.insert(section_buffer.end(), tsp.data_byte,
+				&tsp.data_byte[
+					std::min(
+						entire_section_length - section_buffer.size(),
+						static_cast<size_t>(tsp.data_byte_length))
+				]);
+
+			if (entire_section_length == section_buffer.size()) {
+				section_list.push_back(section_buffer);
+				section_buffer.clear();
+				exist_sections = true;
 			}
 		}
 	}
@@ -222,56 +261,1585 @@ bool TransportStream::parse_payload(TSPacket &tsp)
 	return exist_sections;
 }
 
-template <typename String>
-bool TransportStream::parse_stream(const String filepath)
+void TransportStream::on_PAT(std::function<void(const ProgramAssociationSection&)> handler)
 {
-	open(filepath);
+	handlers.PAT = std::move(handler);
+}
 
-	buffer = std::make_unique<uint8_t[]>(unit_size);
-	if (!buffer) return false;
+void TransportStream::on_PMT(std::function<void(const ProgramMapSection&)> handler)
+{
+	handlers.PMT = std::move(handler);
+}
 
-	do {
-		input.read(reinterpret_cast<char *>(buffer.get()), unit_size);
-		if (input.eof())
-			break;
+void TransportStream::on_NIT(std::function<void(const NetworkInformationSection&)> handler)
+{
+	handlers.NIT = std::move(handler);
+}
+
+void TransportStream::on_SDT(std::function<void(const ServiceDescriptionSection&)> handler)
+{
+	handlers.SDT = std::move(handler);
+}
+
+void TransportStream::on_EIT(std::function<void(const EventInformationSection&)> handler)
+{
+	handlers.EIT = std::move(handler);
+}
+
+void TransportStream::on_TOT(std::function<void(const TimeOffsetSection&)> handler)
+{
+	handlers.TOT = std::move(handler);
+}
+
+void TransportStream::on_section(
+	std::function<void(const uint16_t PID, const uint8_t* section, const uint16_t length)> handler)
+{
+	handlers.section = std::move(handler);
+}
+
+void TransportStream::on_packet(std::function<void(const uint16_t PID, const uint8_t* packet)> handler)
+{
+	handlers.packet = std::move(handler);
+}
+
+void TransportStream::on_PCR(std::function<void(const uint16_t PID, const uint64_t PCR,
+	const uint64_t position, const bool discontinuity_indicator)> handler)
+{
+	handlers.PCR = std::move(handler);
+}
+
+void TransportStream::on_sync_error(std::function<void(const uint64_t position, const bool lost)> handler)
+{
+	handlers.sync_error = std::move(handler);
+}
+
+void TransportStream::on_PES(std::function<void(const PesData&)> handler)
+{
+	handlers.PES = handler;
+	PES_assembler.on_PES(std::move(handler));
+}
 
-		TSPacket tsp(&buffer[offset]);
-		if (!tsp.parse_TS_packet(&header, &adapt)) {
-			// TODO: need resync?
+void TransportStream::restore_handlers(Handlers saved)
+{
+	handlers = std::move(saved);
+	PES_assembler.on_PES(handlers.PES);
+}
+
+// PAT, CAT and PMT are needed for routing whether or not anybody subscribes
+// to them, so the PIDs are picked straight from the section bytes without
+// decoding descriptors. Each section replaces the PIDs its previous version
+// set, so PIDs a new version drops stop being routed.
+void TransportStream::update_PID_types(const uint8_t* section, const uint16_t length)
+{
+	const auto table_id = section[0];
+	if (table_id > 0x02 || length < 12) {
+		return;
+	}
+	// current_next_indicator
+	if ((section[5] & 0x01) == 0) {
+		return;
+	}
+	// CRC-32/MPEG over a section including its CRC_32 is zero
+	if (crc::_crc32(section, length) != 0) {
+		return;
+	}
+
+	const auto end = section + length - crc::CRC32_SIZE;
+	PidList PIDs;
+
+	auto add_CA_PIDs = [&PIDs](const uint8_t* p, const uint8_t* tail) {
+		while (p + 2 <= tail) {
+			const auto descriptor_tag = p[0];
+			const auto descriptor_length = p[1];
+			if (descriptor_tag == 0x09 && descriptor_length >= 4 && p + 6 <= tail) {
+				const uint16_t CA_PID = (p[4] & 0x1f) << 8 | p[5];
+				PIDs.emplace_back(CA_PID, PidType::section); // ECM, EMM
+			}
+			p += 2 + descriptor_length;
+		}
+	};
+
+	// PAT and CAT by section_number, PMT by its PID and program_number
+	const auto section_number = section[6];
+	const uint16_t program_number = section[3] << 8 | section[4];
+	uint64_t key = (uint64_t)table_id << 32 | section_number;
+
+	switch (table_id) {
+	case 0x00:
+		// Program Association Table
+		for (auto p = section + 8; p + 4 <= end; p += 4) {
+			const uint16_t PID = (p[2] & 0x1f) << 8 | p[3];
+			PIDs.emplace_back(PID, PidType::section); // network_PID or program_map_PID
+		}
+		break;
+	case 0x01:
+		// Conditional Access Table
+		add_CA_PIDs(section + 8, end);
+		break;
+	case 0x02: {
+		// Program Map Table
+		key = (uint64_t)table_id << 32 | (uint64_t)header.PID << 16 | program_number;
+
+		const uint16_t program_info_length = (section[10] & 0x0f) << 8 | section[11];
+		auto p = section + 12;
+		if (p + program_info_length > end) {
+			return;
+		}
+		add_CA_PIDs(p, p + program_info_length);
+		p += program_info_length;
+
+		while (p + 5 <= end) {
+			const auto stream_type = p[0];
+			const uint16_t elementary_PID = (p[1] & 0x1f) << 8 | p[2];
+			const uint16_t ES_info_length = (p[3] & 0x0f) << 8 | p[4];
+
+			switch (static_cast<StreamType>(stream_type)) {
+			case StreamType::STREAM_PRIVATE_SECTION:
+			case StreamType::STREAM_VIDEO_MPEG2_A:   // ISO/IEC 13818-6 sections
+			case StreamType::STREAM_VIDEO_MPEG2_B:
+			case StreamType::STREAM_VIDEO_MPEG2_C:
+			case StreamType::STREAM_VIDEO_MPEG2_D:
+				PIDs.emplace_back(elementary_PID, PidType::section);
+				break;
+			default:
+				PIDs.emplace_back(elementary_PID, PidType::PES);
+				break;
+			}
+
+			p += 5;
+			add_CA_PIDs(p, std::min(p + ES_info_length, end));
+			p += ES_info_length;
+		}
+		break;
+	}
+	default:
+		break;
+	}
+
+	if (!set_PID_source(key, std::move(PIDs)) || table_id != 0x00) {
+		return;
+	}
+
+	// PMTs on PIDs the PAT no longer lists go with their programs
+	for (auto it = PID_sources.lower_bound((uint64_t)0x02 << 32);
+		it != PID_sources.end() && (it->first >> 32) == 0x02;) {
+		const auto PMT_PID = static_cast<uint16_t>(it->first >> 16);
+		if (find_PID_type(PMT_PID) == PidType::section) {
+			++it;
 			continue;
 		}
+		const auto dropped = std::move(it->second);
+		it = PID_sources.erase(it);
+		for (const auto& entry : dropped) {
+			reset_PID_type(entry.first);
+		}
+	}
+}
+
+// Returns false when the PIDs of key have not changed
+bool TransportStream::set_PID_source(const uint64_t key, PidList PIDs)
+{
+	auto& source = PID_sources[key];
+	if (source == PIDs) {
+		return false;
+	}
+	const auto dropped = std::move(source);
+	source = std::move(PIDs);
+
+	for (const auto& entry : source) {
+		if (PID_types[entry.first] == PidType::PES && entry.second != PidType::PES) {
+			PES_assembler.drop(entry.first);
+		}
+		PID_types[entry.first] = entry.second;
+	}
+	for (const auto& entry : dropped) {
+		if (std::none_of(source.begin(), source.end(),
+			[&entry](const PidList::value_type& e) { return e.first == entry.first; })) {
+			reset_PID_type(entry.first);
+		}
+	}
+	return true;
+}
+
+// The type another table still gives PID, or its fixed one
+PidType TransportStream::find_PID_type(const uint16_t PID) const
+{
+	for (const auto& source : PID_sources) {
+		for (const auto& entry : source.second) {
+			if (entry.first == PID) {
+				return entry.second;
+			}
+		}
+	}
+	if (PID == 0x1FFF) {
+		return PidType::null;
+	}
+	return std::find(std::begin(SI_PIDs), std::end(SI_PIDs), PID) != std::end(SI_PIDs)
+		? PidType::section : PidType::unknown;
+}
+
+void TransportStream::reset_PID_type(const uint16_t PID)
+{
+	const auto type = find_PID_type(PID);
+	if (PID_types[PID] == PidType::PES && type != PidType::PES) {
+		PES_assembler.drop(PID);
+	}
+	PID_types[PID] = type;
+}
+
+void TransportStream::dispatch_section(const uint8_t* section, const uint16_t length)
+{
+	if (active_monitor) {
+		active_monitor->on_section(header.PID, section, length);
+	}
+	if (handlers.section) {
+		handlers.section(header.PID, section, length);
+	}
+
+	const auto table_id = section[0];
+
+	switch (table_id) {
+	case 0x00:
+		update_PID_types(section, length);
+		if (handlers.PAT) {
+			ProgramAssociationSection PAT;
+			if (PAT.parse(section, nullptr)) {
+				handlers.PAT(PAT);
+			}
+		}
+		break;
+	case 0x01:
+		update_PID_types(section, length);
+		break;
+	case 0x02:
+		update_PID_types(section, length);
+		if (handlers.PMT) {
+			ProgramMapSection PMT;
+			if (PMT.parse(section, nullptr)) {
+				handlers.PMT(PMT);
+			}
+		}
+		break;
+	case 0x40:
+	case 0x41:
+		if (handlers.NIT) {
+			NetworkInformationSection NIT;
+			if (NIT.parse(section, nullptr)) {
+				handlers.NIT(NIT);
+			}
+		}
+		break;
+	case 0x42:
+	case 0x46:
+		if (handlers.SDT) {
+			ServiceDescriptionSection SDT;
+			if (SDT.parse(section, nullptr)) {
+				handlers.SDT(SDT);
+			}
+		}
+		break;
+	case 0x73:
+		if (handlers.TOT) {
+			TimeOffsetSection TOT;
+			if (TOT.parse(section, nullptr)) {
+				handlers.TOT(TOT);
+			}
+		}
+		break;
+	default:
+		if (0x4E <= table_id && table_id <= 0x6F && handlers.EIT) {
+			EventInformationSection EIT;
+			if (EIT.parse(section, nullptr)) {
+				handlers.EIT(EIT);
+			}
+		}
+		break;
+	}
+}
+
+inline bool TransportStream::parse_packet(uint8_t* packet)
+{
+	TSPacket tsp(packet);
+	if (!tsp.parse_TS_packet(&header, &adapt)) {
+		// The header is still good when the adaptation field is not
+		if (active_monitor && packet[0] == TS_SYNC_BYTE) {
+			active_monitor->on_packet(header, nullptr, packet, position);
+		}
+		return packet[0] == TS_SYNC_BYTE;
+	}
+	if (active_monitor) {
+		active_monitor->on_packet(header, &adapt, packet, position);
+	}
+
+	// The PCR is valid even in a packet that fails the continuity check
+	if (adapt.PCR_flag && handlers.PCR) {
+		handlers.PCR(header.PID,
+			adapt.program_clock_reference_base * 300 + adapt.program_clock_reference_extension,
+			position, adapt.discontinuity_indicator == 1);
+	}
+
+	if (!check_continuity()) {
+		++drop_count;
+		PES_assembler.drop(header.PID);
+		return true;
+	}
+
+	if (header.PID != 0x1FFF && tsp.data_byte) {
+		const auto exist_tables = parse_payload(tsp);
+		if (exist_tables) {
+			for (const auto& section : section_list) {
+				dispatch_section(section.data(), static_cast<uint16_t>(section.size()));
+			}
+			section_list.clear();
+		}
+	}
+
+	last_continuity_counter = header.continuity_counter;
+	last_PID = header.PID;
+
+	return true;
+}
+
+// Parses the units of data from the first on up to one without the
+// sync_byte, data_position being the byte offset of data.
+// Returns how many it parsed.
+template <typename Format>
+size_t TransportStream::parse_block(uint8_t* data, const size_t unit_count, const uint64_t data_position)
+{
+	// Headers of the whole run are decoded up front so that sync loss
+	// and null packets are found without touching the packets one by one
+	const auto sync_error_index =
+		decode_TS_headers<Format>(data, unit_count, &header_batch);
+	if (active_monitor) {
+		active_monitor->on_units(sync_error_index);
+	}
 
-		if (!check_continuity()) {
-			++drop_count;
-			fprintf(stderr, "DROP\n");
+	for (size_t i = 0; i < sync_error_index; ++i) {
+		position = data_position + i * Format::unit_size;
+		if (handlers.packet) {
+			handlers.packet(header_batch.PID[i], &data[i * Format::unit_size + Format::offset]);
+		}
+		if (header_batch.PID[i] == 0x1FFF) {
+			last_continuity_counter = header_batch.continuity_counter[i];
+			last_PID = 0x1FFF;
 			continue;
 		}
+		parse_packet(&data[i * Format::unit_size + Format::offset]);
+	}
 
-		if (header.PID != 0x1FFF && tsp.data_byte) {
-			const auto exist_tables = parse_payload(tsp);
-			if (exist_tables) {
-				PsiTable table;
-				for (auto& section : section_list) {
-					table.decode(section.data(), static_cast<uint16_t>(section.size()));
-				}
-				section_list.clear();
+	return sync_error_index;
+}
+
+// Start of the first sync_acquire_units units in a row with the sync_byte,
+// or length when data has none
+template <typename Format>
+static size_t acquire_sync(const uint8_t* data, const size_t length, const size_t units)
+{
+	const auto span = (units - 1) * Format::unit_size + Format::offset;
+	for (size_t start = 0; start + span < length; ++start) {
+		size_t i = 0;
+		while (i < units && data[start + i * Format::unit_size + Format::offset] == TS_SYNC_BYTE) {
+			++i;
+		}
+		if (i == units) {
+			return start;
+		}
+	}
+	return length;
+}
+
+// Parses length bytes of data read at stream_position, going past the
+// units without the sync_byte when the sync error handler is set.
+// Returns the bytes done with; the rest is parsed with the bytes read
+// next. *stop is set when the parse cannot go on.
+template <typename Format>
+size_t TransportStream::parse_run(uint8_t* data, const size_t length, bool* stop)
+{
+	size_t done = 0;
+	for (;;) {
+		if (syncing) {
+			const auto start = acquire_sync<Format>(data + done, length - done, sync_acquire_units);
+			if (start == length - done) {
+				// The units sync may be acquired from need the next bytes
+				const auto keep = (sync_acquire_units - 1) * Format::unit_size + Format::offset;
+				return std::max(done, length - std::min(length, keep));
+			}
+			done += start;
+			syncing = false;
+		}
+
+		const auto unit_count = (length - done) / Format::unit_size;
+		if (!unit_count) {
+			return done;
+		}
+		done += parse_block<Format>(data + done, unit_count, stream_position + done) * Format::unit_size;
+		if (length - done < Format::unit_size) {
+			return done;
+		}
+
+		if (!handlers.sync_error && !active_monitor) {
+			fprintf(stderr, "sync_byte not found. [%x]\n", data[done + Format::offset]);
+			*stop = true;
+			return done;
+		}
+		// Whether sync is lost is told by the unit that follows
+		if (length - done < 2 * Format::unit_size) {
+			return done;
+		}
+		const auto lost = data[done + Format::unit_size + Format::offset] != TS_SYNC_BYTE;
+		if (active_monitor) {
+			active_monitor->on_sync_error(stream_position + done, lost);
+		}
+		if (handlers.sync_error) {
+			handlers.sync_error(stream_position + done, lost);
+		}
+		if (lost) {
+			reset_packet_state();
+			syncing = true;
+			++done;
+		}
+		else {
+			done += Format::unit_size;
+		}
+	}
+}
+
+std::shared_ptr<uint8_t> TransportStream::acquire_block(const size_t block_size)
+{
+	for (;;) {
+		for (const auto& block : block_pool) {
+			if (block.use_count() == 1) {
+				return block;
+			}
+		}
+		if (block_pool.size() * block_size < max_pinned_bytes) {
+			break;
+		}
+		// Every block is held: the PES packets that started first go,
+		// one at a time, until a block is free
+		if (!PES_assembler.drop_oldest()) {
+			break;
+		}
+	}
+
+	std::shared_ptr<uint8_t> block(new uint8_t[block_size], std::default_delete<uint8_t[]>());
+	if (block_pool.size() * block_size < max_pinned_bytes) {
+		block_pool.push_back(block);
+	}
+	return block;
+}
+
+// read_units(dst, max_units) fills dst with whole packet units
+// and returns how many it read, 0 at the end of the input
+template <typename Format, typename ReadUnits>
+bool TransportStream::parse_packets(ReadUnits read_units, const bool end_of_input)
+{
+	constexpr auto block_size = block_units * Format::unit_size;
+
+	for (;;) {
+		// Short reads (a pipe, a growing file) are packed into the current
+		// block, so that the blocks PES packets pin are full. The bytes not
+		// parsed yet (only while sync is lost) move to the next block.
+		if (!buffer || block_size - block_filled - block_pending < Format::unit_size) {
+			std::shared_ptr<uint8_t> last;
+			if (block_pending) {
+				last = std::move(buffer);
+			}
+			buffer.reset();
+			buffer = acquire_block(block_size);
+			if (last) {
+				std::copy_n(last.get() + block_filled, block_pending, buffer.get());
 			}
+			block_filled = 0;
 		}
 
-		last_continuity_counter = header.continuity_counter;
-		last_PID = header.PID;
+		const auto data = buffer.get() + block_filled;
+		const auto unit_count = read_units(data + block_pending,
+			(block_size - block_filled - block_pending) / Format::unit_size);
+		if (!unit_count)
+			break;
+
+		bool stop = false;
+		const auto length = block_pending + unit_count * Format::unit_size;
+		const auto done = parse_run<Format>(data, length, &stop);
+		stream_position += done;
+		block_filled += done;
+		block_pending = length - done;
+		if (stop)
+			break;
+	}
 
-	} while (buffer[0] == TS_SYNC_BYTE);
+	// Otherwise unbounded PES packets go on with the next call,
+	// and so does the block
+	if (end_of_input) {
+		PES_assembler.flush();
+		buffer.reset();
+		block_pending = 0;
+		syncing = false;
+	}
 
 	return true;
 }
 
-template <typename String>
-bool TransportStream::select_stream(const String filepath, const uint16_t PID)
+size_t TransportStream::read_input(uint8_t* dst, const size_t max_units)
+{
+	if (input.eof()) {
+		return 0;
+	}
+	input.read(reinterpret_cast<char *>(dst), max_units * unit_size);
+	return static_cast<size_t>(input.gcount()) / unit_size;
+}
+
+// Fills dst with whole units from source, keeping a partial unit for the
+// next call. Once a unit is complete, reads on only while more is ready,
+// so that a block is filled from a batch of datagrams without adding
+// latency. With end given, does not block at all and sets it when the
+// source has ended.
+size_t TransportStream::read_source(uint8_t* dst, const size_t max_units, InputSource* source,
+	bool* end)
+{
+	const auto capacity = max_units * unit_size;
+
+	auto length = std::min(source_carry.size(), capacity);
+	std::copy(source_carry.begin(), source_carry.begin() + length, dst);
+	source_carry.erase(source_carry.begin(), source_carry.begin() + length);
+
+	auto ended = false;
+	while (length < capacity) {
+		const auto count = length < unit_size && !end
+			? source->read(dst + length, capacity - length)
+			: source->read_ready(dst + length, capacity - length, &ended);
+		if (!count) {
+			break;
+		}
+		length += count;
+	}
+	if (end) {
+		*end = ended;
+	}
+
+	const auto unit_count = length / unit_size;
+	if (!unit_count && (!end || ended)) {
+		return 0; // a partial unit at the end is dropped
+	}
+	source_carry.insert(source_carry.begin(), dst + unit_count * unit_size, dst + length);
+	return unit_count;
+}
+
+// Tells the unit size from the head of the input in source_carry,
+// and drops the bytes before the first unit
+bool TransportStream::detect_source_format()
 {
+	const auto length = source_carry.size();
+
+	unit_size = detect_unit_size(source_carry.data(), length);
+	offset = unit_size == TTS_PACKET_SIZE ? 4 : 0;
+	auto start = find_sync(source_carry.data(), length, unit_size, offset);
+
+	// A pipe may be joined in the middle of a unit, where the sizes are
+	// told apart by the one that keeps sync
+	for (const auto size : { TS_PACKET_SIZE, TTS_PACKET_SIZE, FEC_TS_PACKET_SIZE }) {
+		if (start < length) {
+			break;
+		}
+		unit_size = static_cast<uint8_t>(size);
+		offset = unit_size == TTS_PACKET_SIZE ? 4 : 0;
+		start = find_sync(source_carry.data(), length, unit_size, offset);
+	}
+	if (start >= length) {
+		fprintf(stderr, "Unsupported file.\n");
+		unit_size = 0;
+		return false;
+	}
+	source_carry.erase(source_carry.begin(), source_carry.begin() + start);
+	stream_position = 0;
 	return true;
 }
 
+// Reads like read_input(), but waits at the end of the file for it to grow.
+// Returns 0 only when following stops.
+size_t TransportStream::follow_input(uint8_t* dst, const size_t max_units, FileWatcher* watcher,
+	const int idle_timeout_ms)
+{
+	auto idle_since = std::chrono::steady_clock::now();
+
+	while (following) {
+		input.clear();
+		input.read(reinterpret_cast<char *>(dst), max_units * unit_size);
+		const auto length = static_cast<size_t>(input.gcount());
+
+		// The writer is in the middle of a unit: it is read whole next time
+		const auto rest = length % unit_size;
+		if (rest) {
+			input.clear();
+			input.seekg(-static_cast<std::streamoff>(rest), std::ios::cur);
+		}
+		if (length >= unit_size) {
+			return length / unit_size;
+		}
+
+		// Truncated and written again from the start
+		if (input_size() < stream_position) {
+			fprintf(stderr, "file truncated.\n");
+			reset_position(0);
+			continue;
+		}
+
+		if (watcher->wait(follow_interval)) {
+			idle_since = std::chrono::steady_clock::now();
+		}
+		else if (idle_timeout_ms >= 0 && std::chrono::steady_clock::now() - idle_since
+			>= std::chrono::milliseconds(idle_timeout_ms)) {
+			break;
+		}
+	}
+	return 0;
+}
+
+template <typename ReadUnits>
+bool TransportStream::parse_units(ReadUnits read_units, const bool end_of_input)
+{
+	// Dispatch once to the loop specialized on the detected unit size
+	switch (unit_size) {
+	case TS_PACKET_SIZE:
+		return parse_packets<TSFormat>(read_units, end_of_input);
+	case TTS_PACKET_SIZE:
+		return parse_packets<TTSFormat>(read_units, end_of_input);
+	case FEC_TS_PACKET_SIZE:
+		return parse_packets<FECTSFormat>(read_units, end_of_input);
+	default:
+		return false;
+	}
+}
+
+template <typename String>
+bool TransportStream::parse_stream(const String filepath)
+{
+	open(filepath);
+
+	return parse_input();
+}
+
+bool TransportStream::parse_input()
+{
+	return parse_units([this](uint8_t* dst, const size_t max_units) {
+		return read_input(dst, max_units);
+	});
+}
+
+bool TransportStream::parse_source(InputSource* source)
+{
+	// The unit size is told from the first 4KiB, as for a file
+	source_carry.resize(source_head_size);
+	size_t length = 0;
+	while (length < source_head_size) {
+		const auto count = source->read(&source_carry[length], source_head_size - length);
+		if (!count) {
+			fprintf(stderr, "End-of-file.\n");
+			return false;
+		}
+		length += count;
+	}
+	if (!detect_source_format()) {
+		return false;
+	}
+
+	const auto success = parse_units([this, source](uint8_t* dst, const size_t max_units) {
+		return read_source(dst, max_units, source);
+	});
+
+	source_carry.clear();
+	return success;
+}
+
+bool TransportStream::parse_ready(InputSource* source, const size_t max_bytes, bool* more)
+{
+	*more = false;
+	auto end = false;
+
+	if (!unit_size) {
+		const auto filled = source_carry.size();
+		source_carry.resize(source_head_size);
+		const auto count = source->read_ready(&source_carry[filled], source_head_size - filled, &end);
+		source_carry.resize(filled + count);
+		if (source_carry.size() < source_head_size) {
+			return !end;
+		}
+		if (!detect_source_format()) {
+			return false;
+		}
+	}
+
+	size_t read_bytes = 0;
+	parse_units([&](uint8_t* dst, const size_t max_units) -> size_t {
+		if (read_bytes >= max_bytes) {
+			*more = true;
+			return 0;
+		}
+		const auto unit_count = read_source(dst, max_units, source, &end);
+		read_bytes += unit_count * unit_size;
+		return unit_count;
+	}, false);
+
+	if (end) {
+		PES_assembler.flush();
+		source_carry.clear();
+	}
+	return !end;
+}
+
+template <typename String>
+bool TransportStream::follow_stream(const String filepath, const int idle_timeout_ms)
+{
+	following = true;
+
+	FileWatcher watcher;
+	const auto start = std::chrono::steady_clock::now();
+
+	// The unit size is told from the first 4KiB, so wait for them
+	for (;;) {
+		std::ifstream file(filepath, std::ios::in | std::ios::binary | std::ios::ate);
+		if (file.is_open() && file.tellg() > 4096) {
+			break;
+		}
+		if (!following || (idle_timeout_ms >= 0 && std::chrono::steady_clock::now() - start
+			>= std::chrono::milliseconds(idle_timeout_ms))) {
+			return false;
+		}
+		watcher.wait(follow_interval);
+	}
+
+	open(filepath);
+	// Without inotify the file is polled every follow_interval
+	watcher.open(std::string(filepath));
+
+	const auto success = parse_units([this, &watcher, idle_timeout_ms](uint8_t* dst, const size_t max_units) {
+		return follow_input(dst, max_units, &watcher, idle_timeout_ms);
+	});
+
+	following = false;
+	return success;
+}
+
+template <typename String>
+bool TransportStream::parse_archive(const String filepath)
+{
+	TSArchiveReader reader;
+	if (!reader.open(filepath)) {
+		return false;
+	}
+
+	unit_size = reader.get_unit_size();
+	offset = reader.get_offset();
+
+	const auto success = parse_units([&reader](uint8_t* dst, const size_t max_units) {
+		return reader.read_units(dst, max_units);
+	});
+	return success && !reader.failed();
+}
+
+template <typename String>
+bool TransportStream::parse_stream(const String filepath, const std::string& index_path)
+{
+	open(filepath);
+
+	StreamIndexWriter writer(unit_size, offset, input_size(), input_CRC());
+
+	// The index is built alongside whatever handlers are registered
+	const auto saved_handlers = handlers;
+	on_packet([this, &writer, &saved_handlers](const uint16_t PID, const uint8_t* packet) {
+		writer.on_packet(PID, packet, position, PID_types[PID]);
+		if (saved_handlers.packet) {
+			saved_handlers.packet(PID, packet);
+		}
+	});
+	on_PCR([&writer, &saved_handlers](const uint16_t PID, const uint64_t PCR, const uint64_t position,
+		const bool discontinuity_indicator) {
+		writer.on_PCR(PID, PCR, position);
+		if (saved_handlers.PCR) {
+			saved_handlers.PCR(PID, PCR, position, discontinuity_indicator);
+		}
+	});
+	on_section([this, &writer, &saved_handlers](const uint16_t PID, const uint8_t* section, const uint16_t length) {
+		writer.on_section(PID, section, length, position);
+		if (saved_handlers.section) {
+			saved_handlers.section(PID, section, length);
+		}
+	});
+
+	const auto success = parse_input();
+
+	restore_handlers(saved_handlers);
+
+	return writer.write(index_path, PID_types) && success;
+}
+
+template <typename String>
+bool TransportStream::select_stream(const String filepath, const uint16_t PID)
+{
+	const auto index_path = std::string(filepath) + ".tsidx";
+
+	// The first run indexes the whole file; later runs read only the
+	// packets of PID
+	open(filepath);
+	const auto file_size = input_size();
+	const auto file_CRC = input_CRC();
+	input.close();
+
+	StreamIndex index;
+	if (!index.open(index_path) || !index.matches(file_size, file_CRC)) {
+		index.close();
+
+		TransportStream indexer;
+		if (!indexer.parse_stream(filepath, index_path) || !index.open(index_path)) {
+			return false;
+		}
+	}
+
+	open(filepath);
+
+	const auto entry = index.find_PID(PID);
+	if (!entry) {
+		return true; // PID is not in the stream
+	}
+	PID_types[PID] = static_cast<PidType>(entry->type);
+
+	size_t run_count;
+	const auto runs = index.get_runs(PID, &run_count);
+
+	// Each read covers part of one run, so the units of a read are
+	// consecutive. At a jump to the next run, stream_position moves to it
+	// and the sync state is reset, as reset_position does; the PES and
+	// sections of PID go on across its runs.
+	size_t run_index = 0;
+	uint32_t run_done = 0;
+	uint64_t next_start = UINT64_MAX;
+	return parse_units([&](uint8_t* dst, const size_t max_units) -> size_t {
+		if (run_index == run_count) {
+			return 0;
+		}
+		const auto& run = runs[run_index];
+		const auto count = std::min<size_t>(max_units, run.unit_count - run_done);
+		const auto start = (static_cast<uint64_t>(run.first_unit) + run_done) * unit_size;
+
+		input.clear();
+		input.seekg(start, std::ios::beg);
+		input.read(reinterpret_cast<char *>(dst), count * unit_size);
+		const auto units = static_cast<size_t>(input.gcount()) / unit_size;
+
+		if (start != next_start) {
+			// Bytes left unparsed before dst (sync was lost) belong before the
+			// jump, so the units read take their place and the packet in
+			// progress is dropped
+			if (block_pending) {
+				std::memmove(dst - block_pending, dst, units * unit_size);
+				block_pending = 0;
+				reset_packet_state();
+			}
+			syncing = false;
+			stream_position = start;
+		}
+		next_start = start + units * unit_size;
+
+		run_done += static_cast<uint32_t>(units);
+		if (run_done == run.unit_count || units < count) {
+			++run_index;
+			run_done = 0;
+		}
+		return units;
+	});
+}
+
+template <typename String>
+bool TransportStream::demux_stream(const String filepath, const std::string& output_prefix,
+	const uint16_t program_number)
+{
+	ElementaryStreamExtractor extractor(output_prefix, program_number);
+
+	const auto saved_handlers = handlers;
+	on_PMT([&extractor, &saved_handlers](const ProgramMapSection& PMT) {
+		extractor.on_PMT(PMT);
+		if (saved_handlers.PMT) {
+			saved_handlers.PMT(PMT);
+		}
+	});
+	on_PES([&extractor, &saved_handlers](const PesData& pes) {
+		extractor.on_PES(pes);
+		if (saved_handlers.PES) {
+			saved_handlers.PES(pes);
+		}
+	});
+
+	const auto success = parse_stream(filepath);
+
+	restore_handlers(saved_handlers);
+
+	return extractor.close() && success;
+}
+
+template <typename String>
+bool TransportStream::remux_stream(const String filepath, const std::string& output_path,
+	const uint16_t program_number)
+{
+	PartialTSWriter writer(program_number);
+	if (!writer.open(output_path)) {
+		return false;
+	}
+
+	const auto saved_handlers = handlers;
+	on_section([&writer, &saved_handlers](const uint16_t PID, const uint8_t* section, const uint16_t length) {
+		writer.on_section(PID, section, length);
+		if (saved_handlers.section) {
+			saved_handlers.section(PID, section, length);
+		}
+	});
+	on_packet([this, &writer, &saved_handlers](const uint16_t PID, const uint8_t* packet) {
+		writer.on_packet(PID, packet, current_block());
+		if (saved_handlers.packet) {
+			saved_handlers.packet(PID, packet);
+		}
+	});
+
+	const auto success = parse_stream(filepath);
+
+	restore_handlers(saved_handlers);
+
+	return writer.close() && success;
+}
+
+template <typename String>
+bool TransportStream::segment_stream(const String filepath, const std::string& output_prefix,
+	const uint16_t program_number, const double target_duration)
+{
+	HLSSegmenter segmenter(output_prefix, program_number, target_duration);
+
+	const auto saved_handlers = handlers;
+	on_PMT([&segmenter, &saved_handlers](const ProgramMapSection& PMT) {
+		segmenter.on_PMT(PMT);
+		if (saved_handlers.PMT) {
+			saved_handlers.PMT(PMT);
+		}
+	});
+	on_section([&segmenter, &saved_handlers](const uint16_t PID, const uint8_t* section, const uint16_t length) {
+		segmenter.on_section(PID, section, length);
+		if (saved_handlers.section) {
+			saved_handlers.section(PID, section, length);
+		}
+	});
+	on_PCR([&segmenter, &saved_handlers](const uint16_t PID, const uint64_t PCR, const uint64_t position,
+		const bool discontinuity_indicator) {
+		segmenter.on_PCR(PID, PCR, discontinuity_indicator);
+		if (saved_handlers.PCR) {
+			saved_handlers.PCR(PID, PCR, position, discontinuity_indicator);
+		}
+	});
+	on_packet([this, &segmenter, &saved_handlers](const uint16_t PID, const uint8_t* packet) {
+		segmenter.on_packet(PID, packet, position, current_block());
+		if (saved_handlers.packet) {
+			saved_handlers.packet(PID, packet);
+		}
+	});
+
+	const auto success = parse_stream(filepath);
+
+	restore_handlers(saved_handlers);
+
+	return segmenter.close() && success;
+}
+
+template <typename String>
+bool TransportStream::publish_stream(const String filepath, SharedRingWriter* ring, const bool packets)
+{
+	using shared_ring::RecordType;
+
+	// (PID, table_id, table_id_extension, section_number) -> CRC
+	std::map<uint64_t, uint32_t> section_CRCs;
+
+	// Deltas come out while the section completing a version is fed
+	TableDiffer differ;
+	uint16_t delta_PID = 0;
+	const uint8_t* delta_section = nullptr;
+	differ.on_delta([this, ring, &delta_PID, &delta_section](const TableDelta& delta) {
+		const shared_ring::TableDeltaRecord record = { static_cast<uint8_t>(delta.type), delta.table_id,
+			static_cast<uint8_t>((delta_section[5] >> 1) & 0x1f), delta_section[6],
+			delta.id, delta.item, delta.old_value, delta.new_value };
+		ring->write(RecordType::table_delta, delta_PID, position,
+			reinterpret_cast<const uint8_t*>(&record), sizeof(record));
+	});
+
+	const auto saved_handlers = handlers;
+	on_section([this, ring, &section_CRCs, &differ, &delta_PID, &delta_section, &saved_handlers](
+		const uint16_t PID, const uint8_t* section, const uint16_t length) {
+		ring->write(RecordType::section, PID, position, section, length);
+		if (saved_handlers.section) {
+			saved_handlers.section(PID, section, length);
+		}
+
+		delta_PID = PID;
+		delta_section = section;
+		differ.on_section(PID, section, length);
+
+		const auto section_syntax_indicator = section[1] >> 7;
+		if (!section_syntax_indicator || length < 12) {
+			return;
+		}
+		const auto table_id = section[0];
+		const auto table_id_extension = section[3] << 8 | section[4];
+		const auto section_number = section[6];
+		const auto key = (uint64_t)PID << 32 | (uint64_t)table_id << 24
+			| (uint64_t)table_id_extension << 8 | section_number;
+		const auto CRC = read_bits<uint32_t>(section + length - 4, 0, 32);
+
+		const auto found = section_CRCs.find(key);
+		if (found != section_CRCs.end() && found->second == CRC) {
+			return;
+		}
+		section_CRCs[key] = CRC;
+		ring->write(RecordType::table_version, PID, position, section, length);
+	});
+	on_PCR([ring, &saved_handlers](const uint16_t PID, const uint64_t PCR, const uint64_t position,
+		const bool discontinuity_indicator) {
+		const shared_ring::PCRRecord record = { position, discontinuity_indicator, {} };
+		ring->write(RecordType::PCR, PID, PCR, reinterpret_cast<const uint8_t*>(&record), sizeof(record));
+		if (saved_handlers.PCR) {
+			saved_handlers.PCR(PID, PCR, position, discontinuity_indicator);
+		}
+	});
+	if (packets) {
+		on_packet([this, ring, &saved_handlers](const uint16_t PID, const uint8_t* packet) {
+			ring->write(RecordType::packet, PID, position, packet, TS_PACKET_SIZE);
+			if (saved_handlers.packet) {
+				saved_handlers.packet(PID, packet);
+			}
+		});
+	}
+
+	const auto success = parse_stream(filepath);
+
+	restore_handlers(saved_handlers);
+
+	return success;
+}
+
+template <typename String>
+bool TransportStream::archive_stream(const String filepath, const std::string& output_path)
+{
+	open(filepath);
+
+	TSArchiveWriter writer;
+	if (!writer.open(output_path, unit_size, offset)) {
+		return false;
+	}
+
+	on_packet([this, &writer](const uint16_t PID, const uint8_t* packet) {
+		writer.on_packet(PID, packet, PID_types[PID] == PidType::section, current_block());
+	});
+
+	const auto success = parse_input();
+
+	on_packet(nullptr);
+
+	// Units after a sync loss and a partial unit at the end are not
+	// archived, and the input could not be restored from the archive
+	const auto complete = stream_position == input_size();
+	if (!complete) {
+		fprintf(stderr, "input not fully archived.\n");
+	}
+
+	return writer.close() && success && complete;
+}
+
+template <typename String>
+bool TransportStream::measure_stream(const String filepath, PcrTracker* tracker)
+{
+	open(filepath);
+	tracker->set_unit_size(unit_size);
+
+	const auto saved_handlers = handlers;
+	on_PMT([tracker, &saved_handlers](const ProgramMapSection& PMT) {
+		tracker->on_PMT(PMT);
+		if (saved_handlers.PMT) {
+			saved_handlers.PMT(PMT);
+		}
+	});
+	on_packet([tracker, &saved_handlers](const uint16_t PID, const uint8_t* packet) {
+		tracker->on_packet(PID);
+		if (saved_handlers.packet) {
+			saved_handlers.packet(PID, packet);
+		}
+	});
+	on_PCR([tracker, &saved_handlers](const uint16_t PID, const uint64_t PCR, const uint64_t position,
+		const bool discontinuity_indicator) {
+		tracker->on_PCR(PID, PCR, position, discontinuity_indicator);
+		if (saved_handlers.PCR) {
+			saved_handlers.PCR(PID, PCR, position, discontinuity_indicator);
+		}
+	});
+
+	const auto success = parse_input();
+
+	restore_handlers(saved_handlers);
+
+	return success;
+}
+
+template <typename String>
+bool TransportStream::monitor_stream(const String filepath, Tr101290Monitor* monitor)
+{
+	// The parser hands packets, sections and sync errors to monitor
+	// itself, so the handlers are left as they are
+	const auto saved_monitor = active_monitor;
+	active_monitor = monitor;
+
+	const auto success = parse_stream(filepath);
+
+	active_monitor = saved_monitor;
+
+	return success;
+}
+
+template <typename String>
+bool TransportStream::index_keyframes(const String filepath, KeyframeIndexer* indexer)
+{
+	const auto saved_handlers = handlers;
+	on_PMT([indexer, &saved_handlers](const ProgramMapSection& PMT) {
+		indexer->on_PMT(PMT);
+		if (saved_handlers.PMT) {
+			saved_handlers.PMT(PMT);
+		}
+	});
+	on_packet([this, indexer, &saved_handlers](const uint16_t PID, const uint8_t* packet) {
+		indexer->on_packet(PID, packet, position);
+		if (saved_handlers.packet) {
+			saved_handlers.packet(PID, packet);
+		}
+	});
+
+	const auto success = parse_stream(filepath);
+
+	restore_handlers(saved_handlers);
+
+	return success;
+}
+
+template <typename String>
+bool TransportStream::index_audio_frames(const String filepath, AudioFrameIndexer* indexer)
+{
+	const auto saved_handlers = handlers;
+	on_PMT([indexer, &saved_handlers](const ProgramMapSection& PMT) {
+		indexer->on_PMT(PMT);
+		if (saved_handlers.PMT) {
+			saved_handlers.PMT(PMT);
+		}
+	});
+	on_PES([indexer, &saved_handlers](const PesData& pes) {
+		indexer->on_PES(pes);
+		if (saved_handlers.PES) {
+			saved_handlers.PES(pes);
+		}
+	});
+
+	const auto success = parse_stream(filepath);
+
+	restore_handlers(saved_handlers);
+
+	return success;
+}
+
+uint64_t TransportStream::input_size()
+{
+	input.clear();
+	const auto current = input.tellg();
+	input.seekg(0, std::ios::end);
+	const auto size = static_cast<uint64_t>(input.tellg());
+	input.seekg(current, std::ios::beg);
+	return size;
+}
+
+// Of the first and last fingerprint_size bytes, enough to tell
+// a recording rewritten to the same size
+uint32_t TransportStream::input_CRC()
+{
+	const auto size = input_size();
+	const auto current = input.tellg();
+
+	std::vector<uint8_t> sample(read_window(0, fingerprint_size));
+	std::copy_n(probe_buffer.begin(), sample.size(), sample.begin());
+	if (size > fingerprint_size) {
+		const auto start = std::max<uint64_t>(size - fingerprint_size, fingerprint_size);
+		const auto length = read_window(start, static_cast<size_t>(size - start));
+		sample.insert(sample.end(), probe_buffer.begin(), probe_buffer.begin() + length);
+	}
+
+	input.clear();
+	input.seekg(current, std::ios::beg);
+	return crc::_crc32(sample.data(), sample.size());
+}
+
+void TransportStream::reset_position(const uint64_t position)
+{
+	input.clear();
+	input.seekg(position, std::ios::beg);
+	stream_position = position;
+	block_pending = 0;
+	syncing = false;
+
+	// Nothing carries over from the packets before the jump
+	reset_packet_state();
+}
+
+void TransportStream::reset_packet_state()
+{
+	last_continuity_counter = -1;
+	last_PID = 0x1FFF;
+	section_buffer.clear();
+	section_list.clear();
+	PES_assembler.drop_all();
+}
+
+bool TransportStream::probe_head(StreamProbe* probe, const uint16_t program_number)
+{
+	*probe = {};
+	probe->program_number = program_number;
+	probe->file_size = input_size();
+	reset_position(0);
+
+	// The head is parsed with the parser's own handlers only
+	auto saved_handlers = std::move(handlers);
+	auto saved_assembler = std::move(PES_assembler);
+	handlers = Handlers();
+	PES_assembler = PesAssembler();
+
+	// The PMT gives the PCR_PID; the first PCR of every PID is kept
+	// in case the PMT is not in the window. PCRs are read raw, as at the
+	// other sampling points.
+	uint16_t PCR_PID = TS_PID_MAX;
+	std::map<uint16_t, StreamProbe::Sample> first_PCRs;
+
+	on_PMT([&](const ProgramMapSection& PMT) {
+		if (PCR_PID == TS_PID_MAX && (program_number == 0 || PMT.program_number == program_number)) {
+			PCR_PID = PMT.PCR_PID;
+			probe->program_number = PMT.program_number;
+		}
+	});
+	on_packet([this, &first_PCRs](const uint16_t PID, const uint8_t* packet) {
+		uint64_t PCR;
+		if (read_PCR(packet, &PCR)) {
+			first_PCRs.emplace(PID, StreamProbe::Sample{ PCR, position });
+		}
+	});
+
+	auto head_units = probe_window / unit_size;
+	parse_units([this, &head_units](uint8_t* dst, const size_t max_units) {
+		const auto count = read_input(dst, std::min(max_units, head_units));
+		head_units -= count;
+		return count;
+	});
+
+	handlers = std::move(saved_handlers);
+	PES_assembler = std::move(saved_assembler);
+
+	if (PCR_PID == TS_PID_MAX && program_number == 0 && !first_PCRs.empty()) {
+		PCR_PID = std::min_element(first_PCRs.begin(), first_PCRs.end(),
+			[](const auto& a, const auto& b) { return a.second.position < b.second.position; })->first;
+	}
+	const auto first = first_PCRs.find(PCR_PID);
+	if (first == first_PCRs.end()) {
+		fprintf(stderr, "PCR not found.\n");
+		return false;
+	}
+	probe->PCR_PID = PCR_PID;
+	probe->samples.push_back(first->second);
+	return true;
+}
+
+bool TransportStream::sample_PCR(const uint16_t PCR_PID, uint64_t start, const size_t length,
+	const bool last, uint64_t* PCR, uint64_t* position)
+{
+	// Read raw: only the PCR of PCR_PID is looked at
+	start -= start % unit_size;
+	const auto size = read_window(start, length);
+
+	auto found = false;
+	for (auto i = find_sync(probe_buffer.data(), size, unit_size, offset); i + unit_size <= size; i += unit_size) {
+		const auto packet = &probe_buffer[i + offset];
+		const uint16_t PID = (packet[1] & 0x1f) << 8 | packet[2];
+		if (PID == PCR_PID && read_PCR(packet, PCR)) {
+			*position = start + i;
+			found = true;
+			if (!last) {
+				break;
+			}
+		}
+	}
+	return found;
+}
+
+bool TransportStream::sample_tail(const uint16_t PCR_PID, const uint64_t file_size,
+	uint64_t* PCR, uint64_t* position)
+{
+	// Widened until a PCR turns up
+	for (size_t length = probe_window;; length *= 4) {
+		const auto start = file_size > length ? file_size - length : 0;
+		if (sample_PCR(PCR_PID, start, length, true, PCR, position)) {
+			return true;
+		}
+		if (start == 0 || length >= max_probe_window) {
+			return false;
+		}
+	}
+}
+
+// First PCR of PCR_PID in [start, end). PCRs may be up to 100ms apart,
+// more than seek_window at high bitrates, so windows are read one after
+// another, growing, until a PCR turns up or end is reached.
+bool TransportStream::sample_next_PCR(const uint16_t PCR_PID, uint64_t start, const uint64_t end,
+	uint64_t* PCR, uint64_t* position)
+{
+	for (size_t length = seek_window; start < end; start += length, length = std::min(length * 4, max_probe_window)) {
+		if (sample_PCR(PCR_PID, start, length, false, PCR, position)) {
+			return *position < end;
+		}
+	}
+	return false;
+}
+
+size_t TransportStream::read_window(const uint64_t start, const size_t length)
+{
+	probe_buffer.resize(length);
+	input.clear();
+	input.seekg(start, std::ios::beg);
+	input.read(reinterpret_cast<char *>(probe_buffer.data()), length);
+	return static_cast<size_t>(input.gcount());
+}
+
+template <typename String>
+bool TransportStream::probe_stream(const String filepath, StreamProbe* probe,
+	const uint16_t program_number, const uint16_t mid_samples)
+{
+	open(filepath);
+
+	if (!probe_head(probe, program_number)) {
+		return false;
+	}
+
+	auto& samples = probe->samples;
+	StreamProbe::Sample sample;
+	for (uint16_t i = 1; i <= mid_samples; ++i) {
+		if (sample_PCR(probe->PCR_PID, probe->file_size / (mid_samples + 1) * i, probe_window,
+				false, &sample.PCR, &sample.position)
+			&& sample.position > samples.back().position) {
+			samples.push_back(sample);
+		}
+	}
+	if (sample_tail(probe->PCR_PID, probe->file_size, &sample.PCR, &sample.position)
+		&& sample.position > samples.back().position) {
+		samples.push_back(sample);
+	}
+
+	if (samples.size() < 2) {
+		fprintf(stderr, "only one PCR found.\n");
+		return false;
+	}
+
+	// Spans between samples; each is assumed to wrap at most once
+	std::vector<uint64_t> ticks;
+	std::vector<double> rates; // bytes per tick
+	for (size_t i = 1; i < samples.size(); ++i) {
+		ticks.push_back((samples[i].PCR + PCR_WRAP - samples[i - 1].PCR) % PCR_WRAP);
+		rates.push_back(ticks.back() ? static_cast<double>(samples[i].position - samples[i - 1].position) / ticks.back() : 0);
+	}
+
+	// A span far off the others holds a discontinuity
+	if (rates.size() >= 2) {
+		auto sorted = rates;
+		std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+		const auto median = sorted[sorted.size() / 2];
+		for (size_t i = 0; i < rates.size(); ++i) {
+			if (rates[i] < median / 2 || rates[i] > median * 2) {
+				probe->discontinuity = true;
+				// With a majority to go by, the span is timed at the median rate
+				if (rates.size() >= 3 && median > 0) {
+					ticks[i] = static_cast<uint64_t>((samples[i + 1].position - samples[i].position) / median);
+				}
+			}
+		}
+	}
+
+	uint64_t total_ticks = 0;
+	for (const auto t : ticks) {
+		total_ticks += t;
+	}
+	if (!total_ticks) {
+		return false;
+	}
+
+	probe->duration = static_cast<double>(total_ticks) / PCR_FREQUENCY;
+	probe->bitrate = static_cast<double>(samples.back().position - samples.front().position)
+		* 8 * PCR_FREQUENCY / total_ticks * TS_PACKET_SIZE / unit_size;
+
+	return true;
+}
+
+bool TransportStream::seek_to_time(const double seconds, const uint16_t program_number)
+{
+	StreamProbe probe;
+	if (!probe_head(&probe, program_number)) {
+		return false;
+	}
+
+	// Time is counted from the first PCR, modulo wraparound
+	const auto first = probe.samples.front();
+	auto elapsed = [&first](const uint64_t PCR) {
+		return (PCR + PCR_WRAP - first.PCR) % PCR_WRAP;
+	};
+	// Converted only within [0, PCR_WRAP), where the cast is defined
+	const auto target = static_cast<uint64_t>(
+		std::min(std::max(seconds, 0.0) * PCR_FREQUENCY, static_cast<double>(PCR_WRAP - 1)));
+
+	struct Bound
+	{
+		uint64_t position;
+		uint64_t elapsed;
+	};
+	Bound lo{ first.position, 0 };
+	Bound hi;
+	uint64_t PCR;
+	if (!sample_tail(probe.PCR_PID, probe.file_size, &PCR, &hi.position)) {
+		return false;
+	}
+	hi.elapsed = elapsed(PCR);
+
+	if (target >= hi.elapsed) {
+		lo = hi;
+	}
+
+	// Interpolation search: the first guess is where the average bitrate
+	// puts the target. A bisection step follows any guess that did not
+	// halve the range, so a VBR stream cannot stall the search.
+	auto bisect = false;
+	for (auto probes = 0; probes < max_seek_probes && lo.position != hi.position
+			&& hi.position - lo.position > seek_window; ++probes) {
+		uint64_t guess;
+		if (bisect || hi.elapsed <= lo.elapsed) {
+			guess = lo.position + (hi.position - lo.position) / 2;
+		}
+		else {
+			guess = lo.position + static_cast<uint64_t>(
+				static_cast<double>(target - lo.elapsed) / (hi.elapsed - lo.elapsed) * (hi.position - lo.position));
+		}
+		guess = std::min(std::max(guess, lo.position + unit_size), hi.position - unit_size);
+
+		const auto range = hi.position - lo.position;
+		Bound found;
+		if (!sample_next_PCR(probe.PCR_PID, guess, hi.position, &PCR, &found.position)) {
+			// Not a single PCR between the guess and hi, so the last one at
+			// or before the target lies before the guess
+			hi.position = guess;
+			bisect = true;
+			continue;
+		}
+		found.elapsed = elapsed(PCR);
+
+		if (found.elapsed <= target) {
+			lo = found;
+		}
+		else {
+			hi = found;
+		}
+		bisect = hi.position - lo.position > range / 2;
+	}
+
+	// Last PCR at or before the target within the remaining range
+	uint64_t target_position = lo.position;
+	const auto size = read_window(lo.position, static_cast<size_t>(
+		std::min<uint64_t>(hi.position - lo.position + unit_size, max_probe_window)));
+	for (size_t i = 0; i + unit_size <= size; i += unit_size) {
+		const auto packet = &probe_buffer[i + offset];
+		const uint16_t PID = (packet[1] & 0x1f) << 8 | packet[2];
+		if (PID == probe.PCR_PID && read_PCR(packet, &PCR)) {
+			if (elapsed(PCR) > target) {
+				break;
+			}
+			target_position = lo.position + i;
+		}
+	}
+
+	// Start at a random access point of the PCR_PID if it carries PES
+	// (usually video), else of any PES
+	const auto random_access_PID = PID_types[probe.PCR_PID] == PidType::PES ? probe.PCR_PID : TS_PID_MAX;
+	auto is_random_access = [this, random_access_PID](const uint8_t* packet) {
+		const uint16_t PID = (packet[1] & 0x1f) << 8 | packet[2];
+		if (random_access_PID != TS_PID_MAX ? PID != random_access_PID : PID_types[PID] != PidType::PES) {
+			return false;
+		}
+		// payload_unit_start_indicator, adaptation field, random_access_indicator
+		return (packet[1] & 0x40) && (packet[3] & 0x20) && packet[4] > 0 && (packet[5] & 0x40);
+	};
+
+	// Backwards first: decoding has to start at or before the target.
+	// Windows hold whole units, target_position being a unit boundary.
+	const auto window = probe_window - probe_window % unit_size;
+	auto seek_position = target_position;
+	auto found = false;
+	for (uint64_t end = target_position + unit_size, scanned = 0;
+		!found && end > 0 && scanned < max_probe_window; scanned += window) {
+		const auto start = end > window ? end - window : 0;
+		const auto size = read_window(start, static_cast<size_t>(end - start));
+		for (auto i = size / unit_size; i-- > 0;) {
+			if (is_random_access(&probe_buffer[i * unit_size + offset])) {
+				seek_position = start + i * unit_size;
+				found = true;
+				break;
+			}
+		}
+		end = start;
+	}
+	for (uint64_t start = target_position; !found && start < std::min(probe.file_size, target_position + max_probe_window);
+		start += window) {
+		const auto size = read_window(start, window);
+		for (size_t i = 0; i + unit_size <= size; i += unit_size) {
+			if (is_random_access(&probe_buffer[i + offset])) {
+				seek_position = start + i;
+				found = true;
+				break;
+			}
+		}
+	}
+
+	// Without one the input is left at the last PCR before the target
+	reset_position(seek_position);
+	return found;
+}
+
+// The entry points taking a file path are defined in this file only, so
+// they are instantiated here for the path types callers use (the const
+// of the parameter is not part of the signature)
+#define INSTANTIATE_FILE_ENTRY_POINTS(String) \
+	template void TransportStream::open(String); \
+	template bool TransportStream::parse_stream(String); \
+	template bool TransportStream::follow_stream(String, const int); \
+	template bool TransportStream::parse_archive(String); \
+	template bool TransportStream::parse_stream(String, const std::string&); \
+	template bool TransportStream::select_stream(String, const uint16_t); \
+	template bool TransportStream::demux_stream(String, const std::string&, const uint16_t); \
+	template bool TransportStream::remux_stream(String, const std::string&, const uint16_t); \
+	template bool TransportStream::segment_stream(String, const std::string&, const uint16_t, \
+		const double); \
+	template bool TransportStream::publish_stream(String, SharedRingWriter*, const bool); \
+	template bool TransportStream::archive_stream(String, const std::string&); \
+	template bool TransportStream::measure_stream(String, PcrTracker*); \
+	template bool TransportStream::monitor_stream(String, Tr101290Monitor*); \
+	template bool TransportStream::probe_stream(String, StreamProbe*, const uint16_t, \
+		const uint16_t); \
+	template bool TransportStream::index_keyframes(String, KeyframeIndexer*); \
+	template bool TransportStream::index_audio_frames(String, AudioFrameIndexer*);
+
+INSTANTIATE_FILE_ENTRY_POINTS(std::string)
+INSTANTIATE_FILE_ENTRY_POINTS(const char*)
+
+#undef INSTANTIATE_FILE_ENTRY_POINTS
+
 int main(int argc, char* argv[])
 {
 	TransportStream ts;
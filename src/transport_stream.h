@@ -1,8 +1,30 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <cinttypes>
+#include <fstream>
+#include <functional>
+#include <map>
 #include <memory>
+#include <string>
 #include "TS_packet.h"
+#include "pes_assembler.h"
+
+struct ProgramAssociationSection;
+struct ProgramMapSection;
+struct NetworkInformationSection;
+struct ServiceDescriptionSection;
+struct EventInformationSection;
+struct TimeOffsetSection;
+class PcrTracker;
+struct StreamProbe;
+class KeyframeIndexer;
+class AudioFrameIndexer;
+class FileWatcher;
+class InputSource;
+class SharedRingWriter;
+class Tr101290Monitor;
 
 class TransportStream
 {
@@ -11,19 +33,167 @@ public:
 	~TransportStream() = default;
 
 	template<typename String>
-	auto open(const String file_path);
+	void open(const String file_path);
 
 	int check_TS_unit_size();
 	bool check_continuity();
 
 	bool parse_payload(TSPacket &tsp);
+	bool parse_section_payload(TSPacket &tsp);
+	bool parse_PES_payload(TSPacket &tsp);
+
+	// Handlers are called while parsing. The arguments refer to the parser's
+	// own buffers and are valid only during the call. Tables are decoded
+	// only when a handler for them is registered.
+	void on_PAT(std::function<void(const ProgramAssociationSection&)> handler);
+	void on_PMT(std::function<void(const ProgramMapSection&)> handler);
+	void on_NIT(std::function<void(const NetworkInformationSection&)> handler);
+	void on_SDT(std::function<void(const ServiceDescriptionSection&)> handler);
+	void on_EIT(std::function<void(const EventInformationSection&)> handler);
+	void on_TOT(std::function<void(const TimeOffsetSection&)> handler);
+	void on_section(std::function<void(const uint16_t PID, const uint8_t* section, const uint16_t length)> handler);
+	void on_packet(std::function<void(const uint16_t PID, const uint8_t* packet)> handler);
+	// PCR in 27MHz units, with the byte offset of its packet unit
+	void on_PCR(std::function<void(const uint16_t PID, const uint64_t PCR, const uint64_t position,
+		const bool discontinuity_indicator)> handler);
+	// PES packets are reassembled only when this handler is registered
+	void on_PES(std::function<void(const PesData&)> handler);
+	// The unit at position has no sync_byte. A single one is skipped; with
+	// the next one bad too, sync is lost and lost is set, and the parse goes
+	// on once sync_acquire_units units in a row have it again. Without this
+	// handler (or a monitor_stream() running) the parse stops at the first
+	// one.
+	void on_sync_error(std::function<void(const uint64_t position, const bool lost)> handler);
+
+	// The input block the packet passed to the packet handler lives in
+	const std::shared_ptr<uint8_t>& current_block() const { return buffer; }
 
 	template <typename String>
 	bool parse_stream(const String filepath);
+	// Parses a non-seekable input (pipe, UDP) until it ends. The unit size
+	// is told from the first bytes read.
+	bool parse_source(InputSource* source);
+	// Parses what source has ready without blocking, keeping every state
+	// for the next call, for event loops. Stops after about max_bytes with
+	// *more set. Returns false once the source has ended.
+	bool parse_ready(InputSource* source, const size_t max_bytes, bool* more);
+	// Parses a recording that is still being written, waiting at its end for
+	// more data with the parser state kept. Returns after idle_timeout_ms
+	// without growth, or (-1) only once stop_following() is called.
+	template <typename String>
+	bool follow_stream(const String filepath, const int idle_timeout_ms = -1);
+	// May be called from another thread
+	void stop_following() { following = false; }
+	// Parses a TS archive written by archive_stream() as the original stream
+	template <typename String>
+	bool parse_archive(const String filepath);
+	// Also writes a sidecar index of the stream to index_path
+	template <typename String>
+	bool parse_stream(const String filepath, const std::string& index_path);
+	// Parses only the packets of PID, found through <filepath>.tsidx.
+	// The index is built by a full pass first when it is missing or stale.
 	template <typename String>
 	bool select_stream(const String filepath, const uint16_t PID);
+	// Writes each elementary stream of program_number (0: every program)
+	// to <output_prefix>_<PID>.<ext>. Handlers registered before are still
+	// called, and kept afterwards.
+	template <typename String>
+	bool demux_stream(const String filepath, const std::string& output_prefix,
+		const uint16_t program_number = 0);
+	// Writes program_number alone as a partial TS with regenerated PAT/PMT.
+	// Handlers registered before are still called, and kept afterwards.
+	template <typename String>
+	bool remux_stream(const String filepath, const std::string& output_path,
+		const uint16_t program_number);
+	// Cuts program_number into HLS segments of about target_duration seconds
+	// at keyframes: <output_prefix>_<n>.ts and the playlist <output_prefix>.m3u8.
+	// Handlers registered before are still called, and kept afterwards.
+	template <typename String>
+	bool segment_stream(const String filepath, const std::string& output_prefix,
+		const uint16_t program_number, const double target_duration = 6.0);
+	// Publishes the parse to ring for consumer processes: every packet (when
+	// packets is set), section and PCR, each section again as a
+	// table_version record when its CRC changes, and the changes of PMT,
+	// SDT and EIT sub-tables as table_delta records. Handlers registered
+	// before are still called, and kept afterwards.
+	template <typename String>
+	bool publish_stream(const String filepath, SharedRingWriter* ring, const bool packets = true);
+	// Writes a compact archive without null packets and repeated PSI packets.
+	// The original stream is restored by restore_archive() or parse_archive().
+	// Fails when the input does not parse to its end as whole units.
+	template <typename String>
+	bool archive_stream(const String filepath, const std::string& output_path);
+	// Runs the whole stream through tracker for PCR and bitrates. Handlers
+	// registered before are still called, and kept afterwards.
+	template <typename String>
+	bool measure_stream(const String filepath, PcrTracker* tracker);
+	// Runs the whole stream through the TR 101 290 checks of monitor.
+	// Handlers registered before are still called, and left as they are.
+	template <typename String>
+	bool monitor_stream(const String filepath, Tr101290Monitor* monitor);
+	// Duration and bitrate from the PCRs at the head and tail of the file
+	// (and at mid_samples points in between) without reading the rest.
+	// program_number 0 takes the first PMT.
+	template <typename String>
+	bool probe_stream(const String filepath, StreamProbe* probe,
+		const uint16_t program_number = 0, const uint16_t mid_samples = 0);
+
+	// Collects the keyframes of the video PIDs into indexer.
+	// Handlers registered before are still called, and kept afterwards.
+	template <typename String>
+	bool index_keyframes(const String filepath, KeyframeIndexer* indexer);
+
+	// Collects the frames of the AAC and AC-3 PIDs into indexer.
+	// Handlers registered before are still called, and kept afterwards.
+	template <typename String>
+	bool index_audio_frames(const String filepath, AudioFrameIndexer* indexer);
+
+	// Moves the opened input to the random access point nearest before
+	// seconds past the first PCR of program_number (0: the first PMT), or
+	// the first one after when none is near before. The file is bisected
+	// on PCRs, so only a few windows are read. Returns false when there is
+	// no random access point around the time, leaving the input at the
+	// last PCR before it.
+	bool seek_to_time(const double seconds, const uint16_t program_number = 0);
+	// Parses the opened input from its current position
+	bool parse_input();
 
 private:
+	template <typename Format, typename ReadUnits>
+	bool parse_packets(ReadUnits read_units, const bool end_of_input);
+	template <typename ReadUnits>
+	bool parse_units(ReadUnits read_units, const bool end_of_input = true);
+	size_t read_input(uint8_t* dst, const size_t max_units);
+	size_t read_source(uint8_t* dst, const size_t max_units, InputSource* source,
+		bool* end = nullptr);
+	bool detect_source_format();
+	size_t follow_input(uint8_t* dst, const size_t max_units, FileWatcher* watcher,
+		const int idle_timeout_ms);
+	template <typename Format>
+	size_t parse_block(uint8_t* data, const size_t unit_count, const uint64_t data_position);
+	template <typename Format>
+	size_t parse_run(uint8_t* data, const size_t length, bool* stop);
+	std::shared_ptr<uint8_t> acquire_block(const size_t block_size);
+	uint64_t input_size();
+	uint32_t input_CRC();
+	void reset_position(const uint64_t position);
+	void reset_packet_state();
+	bool probe_head(StreamProbe* probe, const uint16_t program_number);
+	bool sample_PCR(const uint16_t PCR_PID, uint64_t start, const size_t length,
+		const bool last, uint64_t* PCR, uint64_t* position);
+	bool sample_tail(const uint16_t PCR_PID, const uint64_t file_size,
+		uint64_t* PCR, uint64_t* position);
+	bool sample_next_PCR(const uint16_t PCR_PID, uint64_t start, const uint64_t end,
+		uint64_t* PCR, uint64_t* position);
+	size_t read_window(const uint64_t start, const size_t length);
+	bool parse_packet(uint8_t* packet);
+	void dispatch_section(const uint8_t* section, const uint16_t length);
+	void update_PID_types(const uint8_t* section, const uint16_t length);
+	typedef std::vector<std::pair<uint16_t, PidType>> PidList;
+	bool set_PID_source(const uint64_t key, PidList PIDs);
+	PidType find_PID_type(const uint16_t PID) const;
+	void reset_PID_type(const uint16_t PID);
+
 	std::ifstream input;
 
 	int8_t   last_continuity_counter;
@@ -33,11 +203,77 @@ private:
 
 	TSPHeader header;
 	AdaptationField adapt;
+	TSPHeaderBatch header_batch;
+
+	// Given each packet, section and sync error as parsed, during
+	// monitor_stream()
+	Tr101290Monitor* active_monitor;
+
+	// Units in a row with the sync_byte that acquire sync (TR 101 290 1.1)
+	static constexpr size_t sync_acquire_units = 5;
+	bool syncing; // looking for sync after losing it
+
+	// Number of packet units read from the input at once
+	static constexpr size_t block_units = 1024;
 
-	std::unique_ptr<uint8_t[]> buffer;
+	// Bytes read at each point probe_stream() samples
+	static constexpr size_t probe_window     = 256 << 10;
+	static constexpr size_t max_probe_window = 16 << 20;
+	static constexpr size_t fingerprint_size = 64 << 10;
+	// Bytes read per bisection step, and the most steps taken
+	static constexpr size_t seek_window      = 64 << 10;
+	static constexpr int    max_seek_probes  = 32;
+	std::vector<uint8_t> probe_buffer;
+
+	// Longest wait for a growing file without a change notification
+	static constexpr int follow_interval = 50; // ms
+	std::atomic<bool> following;
+
+	// Bytes read from an InputSource but not parsed yet (a partial unit,
+	// or the head the unit size is told from)
+	static constexpr size_t source_head_size = 1 << 12;
+	std::vector<uint8_t> source_carry;
+
+	// Blocks are shared with PES slices still being assembled,
+	// and recycled once nobody else holds them. Past max_pinned_bytes of
+	// them, the oldest PES packets are dropped to free one.
+	static constexpr size_t max_pinned_bytes = 64 << 20;
+	std::vector<std::shared_ptr<uint8_t>> block_pool;
+	std::shared_ptr<uint8_t> buffer;
+	size_t block_filled;  // bytes of buffer parsed
+	size_t block_pending; // bytes of buffer past block_filled not parsed yet
 	uint8_t unit_size;
 	uint8_t offset;
 
+	uint64_t stream_position; // byte offset of buffer + block_filled
+	uint64_t position;        // byte offset of the current packet unit
+
+	PesAssembler PES_assembler;
+
+	struct Handlers
+	{
+		std::function<void(const ProgramAssociationSection&)> PAT;
+		std::function<void(const ProgramMapSection&)>         PMT;
+		std::function<void(const NetworkInformationSection&)> NIT;
+		std::function<void(const ServiceDescriptionSection&)> SDT;
+		std::function<void(const EventInformationSection&)>   EIT;
+		std::function<void(const TimeOffsetSection&)>         TOT;
+		std::function<void(const uint16_t, const uint8_t*, const uint16_t)> section;
+		std::function<void(const uint16_t, const uint8_t*)> packet;
+		std::function<void(const uint16_t, const uint64_t, const uint64_t, const bool)> PCR;
+		std::function<void(const uint64_t, const bool)> sync_error;
+		std::function<void(const PesData&)> PES; // as given to PES_assembler
+	} handlers;
+	// The entry points chain their handlers in front of the caller's and
+	// put the caller's back with this once they are done
+	void restore_handlers(Handlers saved);
+
+	// Filled with the well-known SI PIDs and from PAT/PMT
+	std::array<PidType, TS_PID_MAX> PID_types;
+	// The PIDs each PAT/CAT section (by table_id, section_number) and PMT
+	// (by table_id, PID, program_number) gave a type
+	std::map<uint64_t, PidList> PID_sources;
+
 	// Table buffer
 	std::vector<uint8_t> section_buffer;
 	uint16_t entire_section_length;
@@ -0,0 +1,342 @@
+#include <algorithm>
+#include <cstring>
+#include "ts_archive.h"
+#include "crc32.h"
+
+using namespace ts_archive;
+
+static_assert(SLOT_COUNT == 256, "slot numbers are stored in one byte");
+
+static const uint8_t archive_magic[4] = { 'T', 'S', 'A', 'R' };
+
+// Null packets the reader can regenerate from header byte 3 alone
+static bool is_plain_null_packet(const uint8_t* packet)
+{
+	if (packet[1] != 0x1f || packet[2] != 0xff || (packet[3] & 0xf0) != 0x10) {
+		return false;
+	}
+	return std::all_of(packet + 4, packet + TS_PACKET_SIZE,
+		[](const uint8_t b) { return b == 0xff; });
+}
+
+// PSI packets are compared without the continuity_counter
+static void mask_packet(const uint8_t* packet, Packet* masked)
+{
+	std::copy(packet, packet + TS_PACKET_SIZE, masked->begin());
+	(*masked)[3] &= 0xf0;
+}
+
+TSArchiveWriter::TSArchiveWriter() :
+	unit_size(TS_PACKET_SIZE),
+	offset(0),
+	success(true),
+	record_tag(0),
+	record_count(0),
+	section_slots(TS_PID_MAX),
+	units(0),
+	nulls(0),
+	repeats(0)
+{}
+
+bool TSArchiveWriter::open(const std::string& file_path, const uint8_t unit_size, const uint8_t offset)
+{
+	this->unit_size = unit_size;
+	this->offset = offset;
+
+	success = output.open(file_path);
+	if (!success) {
+		return false;
+	}
+
+	uint8_t header[HEADER_SIZE] = {};
+	std::copy(archive_magic, archive_magic + 4, header);
+	header[4] = VERSION;
+	header[5] = unit_size;
+	header[6] = offset;
+	success = output.append(header, sizeof(header));
+
+	return success;
+}
+
+bool TSArchiveWriter::close()
+{
+	end_record();
+	return output.close() && success;
+}
+
+void TSArchiveWriter::on_packet(const uint16_t PID, const uint8_t* packet, const bool is_section,
+	const std::shared_ptr<uint8_t>& block)
+{
+	if (!output.is_open()) {
+		return;
+	}
+	++units;
+
+	if (PID == 0x1FFF && is_plain_null_packet(packet)) {
+		begin_record(NULLS);
+		append_reduced(packet);
+		++nulls;
+		return;
+	}
+
+	if (!is_section) {
+		begin_record(RUN);
+		append_unit(packet, block);
+		return;
+	}
+
+	auto& slots = section_slots[PID];
+	if (!slots) {
+		slots = std::make_unique<SectionSlots>();
+	}
+
+	Packet masked;
+	mask_packet(packet, &masked);
+	const auto hash = crc::_crc32(masked.data(), masked.size());
+
+	const auto found = slots->index.find(hash);
+	if (found != slots->index.end() && slots->packets[found->second] == masked) {
+		// Same bytes as an archived packet: keep a reference only
+		begin_record(REPEAT);
+		record_bytes.push_back(PID >> 8);
+		record_bytes.push_back(PID & 0xff);
+		record_bytes.push_back(found->second);
+		append_reduced(packet);
+		++repeats;
+		return;
+	}
+
+	begin_record(SECTION);
+	append_unit(packet, block);
+
+	// The reader fills its slots in the same order
+	const auto slot = slots->next_slot++;
+	if (slots->packets.size() < SLOT_COUNT) {
+		slots->packets.push_back(masked);
+	}
+	else {
+		const auto evicted = slots->index.find(slots->hashes[slot]);
+		if (evicted != slots->index.end() && evicted->second == slot) {
+			slots->index.erase(evicted);
+		}
+		slots->packets[slot] = masked;
+	}
+	slots->hashes[slot] = hash;
+	slots->index[hash] = slot;
+}
+
+void TSArchiveWriter::begin_record(const uint8_t tag)
+{
+	if (record_tag != tag || record_count == MAX_RECORD_COUNT) {
+		end_record();
+		record_tag = tag;
+	}
+	++record_count;
+}
+
+void TSArchiveWriter::end_record()
+{
+	if (!record_count) {
+		return;
+	}
+
+	const uint8_t record_header[3] = {
+		record_tag, static_cast<uint8_t>(record_count >> 8), static_cast<uint8_t>(record_count & 0xff) };
+	if (!output.append(record_header, sizeof(record_header))) {
+		success = false;
+	}
+
+	for (const auto& slice : record_slices) {
+		if (!output.append(slice)) {
+			success = false;
+		}
+	}
+	if (!record_bytes.empty() && !output.append(record_bytes.data(), record_bytes.size())) {
+		success = false;
+	}
+
+	record_slices.clear();
+	record_bytes.clear();
+	record_count = 0;
+}
+
+void TSArchiveWriter::append_unit(const uint8_t* packet, const std::shared_ptr<uint8_t>& block)
+{
+	const auto unit = packet - offset;
+
+	// Consecutive units of the same block become one slice
+	if (!record_slices.empty()) {
+		auto& last = record_slices.back();
+		const auto same_block = !last.data.owner_before(block) && !block.owner_before(last.data);
+		if (same_block && last.data.get() + last.length == unit
+			&& last.length + unit_size <= UINT16_MAX) {
+			last.length += unit_size;
+			return;
+		}
+	}
+	record_slices.push_back({ std::shared_ptr<const uint8_t>(block, unit), unit_size });
+}
+
+void TSArchiveWriter::append_reduced(const uint8_t* packet)
+{
+	const auto unit = packet - offset;
+	const auto suffix_length = unit_size - offset - TS_PACKET_SIZE;
+
+	record_bytes.insert(record_bytes.end(), unit, packet);
+	record_bytes.push_back(packet[3]);
+	record_bytes.insert(record_bytes.end(),
+		packet + TS_PACKET_SIZE, packet + TS_PACKET_SIZE + suffix_length);
+}
+
+TSArchiveReader::TSArchiveReader() :
+	unit_size(0),
+	offset(0),
+	error(false),
+	record_tag(0),
+	record_remaining(0),
+	section_slots(TS_PID_MAX),
+	next_slot(TS_PID_MAX, 0)
+{}
+
+bool TSArchiveReader::open(const std::string& file_path)
+{
+	input.open(file_path, std::ios::in | std::ios::binary);
+	if (!input.is_open()) {
+		fprintf(stderr, "file open failed. [%s]\n", file_path.c_str());
+		return false;
+	}
+
+	uint8_t header[HEADER_SIZE];
+	input.read(reinterpret_cast<char *>(header), sizeof(header));
+	if (!input || !std::equal(archive_magic, archive_magic + 4, header)) {
+		return fail("not a TS archive.");
+	}
+	if (header[4] != VERSION) {
+		return fail("unsupported archive version.");
+	}
+
+	unit_size = header[5];
+	offset = header[6];
+	if ((unit_size != TS_PACKET_SIZE && unit_size != TTS_PACKET_SIZE && unit_size != FEC_TS_PACKET_SIZE)
+		|| offset + TS_PACKET_SIZE > unit_size) {
+		return fail("unsupported unit size.");
+	}
+	return true;
+}
+
+size_t TSArchiveReader::read_units(uint8_t* dst, const size_t max_units)
+{
+	size_t count = 0;
+	while (count < max_units && read_unit(dst + count * unit_size)) {
+		++count;
+	}
+	return count;
+}
+
+bool TSArchiveReader::read_unit(uint8_t* unit)
+{
+	if (error) {
+		return false;
+	}
+
+	while (!record_remaining) {
+		uint8_t record_header[3];
+		input.read(reinterpret_cast<char *>(record_header), sizeof(record_header));
+		if (input.gcount() == 0) {
+			return false; // end of archive
+		}
+		if (!input || record_header[0] < RUN || record_header[0] > REPEAT) {
+			return fail("broken record.");
+		}
+		record_tag = record_header[0];
+		record_remaining = record_header[1] << 8 | record_header[2];
+	}
+
+	const auto packet = unit + offset;
+	const auto suffix_length = unit_size - offset - TS_PACKET_SIZE;
+	auto read = [this](uint8_t* dst, const size_t length) {
+		input.read(reinterpret_cast<char *>(dst), length);
+	};
+
+	switch (record_tag) {
+	case RUN:
+		read(unit, unit_size);
+		break;
+	case SECTION: {
+		read(unit, unit_size);
+		const uint16_t PID = (packet[1] & 0x1f) << 8 | packet[2];
+		auto& slots = section_slots[PID];
+		if (!slots) {
+			slots = std::make_unique<std::vector<Packet>>();
+		}
+		Packet masked;
+		mask_packet(packet, &masked);
+		const auto slot = next_slot[PID]++;
+		if (slots->size() < SLOT_COUNT) {
+			slots->push_back(masked);
+		}
+		else {
+			(*slots)[slot] = masked;
+		}
+		break;
+	}
+	case NULLS:
+		read(unit, offset);
+		read(&packet[3], 1);
+		read(packet + TS_PACKET_SIZE, suffix_length);
+		packet[0] = TS_SYNC_BYTE;
+		packet[1] = 0x1f;
+		packet[2] = 0xff;
+		std::fill(packet + 4, packet + TS_PACKET_SIZE, 0xff);
+		break;
+	case REPEAT: {
+		uint8_t reference[3];
+		read(reference, sizeof(reference));
+		const uint16_t PID = (reference[0] << 8 | reference[1]) & 0x1fff;
+		const auto& slots = section_slots[PID];
+		if (!slots || reference[2] >= slots->size()) {
+			return fail("broken packet reference.");
+		}
+		std::copy((*slots)[reference[2]].begin(), (*slots)[reference[2]].end(), packet);
+		read(unit, offset);
+		read(&packet[3], 1);
+		read(packet + TS_PACKET_SIZE, suffix_length);
+		break;
+	}
+	}
+
+	if (!input) {
+		return fail("archive truncated.");
+	}
+	--record_remaining;
+	return true;
+}
+
+bool TSArchiveReader::fail(const char* message)
+{
+	fprintf(stderr, "%s\n", message);
+	error = true;
+	return false;
+}
+
+bool restore_archive(const std::string& archive_path, const std::string& output_path)
+{
+	TSArchiveReader reader;
+	if (!reader.open(archive_path)) {
+		return false;
+	}
+
+	std::ofstream output(output_path, std::ios::out | std::ios::binary);
+	if (!output.is_open()) {
+		fprintf(stderr, "file open failed. [%s]\n", output_path.c_str());
+		return false;
+	}
+
+	constexpr size_t block_units = 1024;
+	std::vector<uint8_t> block(block_units * reader.get_unit_size());
+	while (const auto count = reader.read_units(block.data(), block_units)) {
+		output.write(reinterpret_cast<const char *>(block.data()), count * reader.get_unit_size());
+	}
+
+	return !reader.failed() && output.good();
+}
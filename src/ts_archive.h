@@ -0,0 +1,130 @@
+#pragma once
+
+#include <array>
+#include <cinttypes>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "ts_packet.h"
+#include "vectored_writer.h"
+
+// Compact archive of a TS recording.
+// Null packets are reduced to the bytes that cannot be regenerated
+// (TTS timestamp, continuity_counter byte, FEC parity) and a PSI packet
+// already archived on its PID is stored as a reference to the earlier copy.
+// The reader restores the original packet units byte for byte.
+//
+// File layout (big-endian):
+//   "TSAR" version(1) unit_size(1) offset(1) reserved(1)
+//   records: tag(1) count(2) body
+//     RUN     count raw units
+//     NULLS   count x { prefix, header byte 3, suffix }
+//     SECTION count raw units, each remembered in its PID's slots
+//     REPEAT  count x { PID(2), slot(1), prefix, header byte 3, suffix }
+//   prefix/suffix are the unit bytes before/after the 188-byte packet.
+namespace ts_archive
+{
+	enum RecordTag : uint8_t
+	{
+		RUN     = 0x01,
+		NULLS   = 0x02,
+		SECTION = 0x03,
+		REPEAT  = 0x04,
+	};
+
+	constexpr uint8_t VERSION = 1;
+	constexpr size_t  HEADER_SIZE = 8;
+	constexpr size_t  MAX_RECORD_COUNT = UINT16_MAX;
+
+	// Archived PSI packets remembered per PID
+	constexpr size_t  SLOT_COUNT = 256;
+	using Packet = std::array<uint8_t, TS_PACKET_SIZE>;
+}
+
+class TSArchiveWriter
+{
+public:
+	TSArchiveWriter();
+	~TSArchiveWriter() = default;
+
+	bool open(const std::string& file_path, const uint8_t unit_size, const uint8_t offset);
+	bool close();
+
+	// packet points at the 188-byte packet inside a unit of block.
+	// is_section enables deduplication for the PID.
+	void on_packet(const uint16_t PID, const uint8_t* packet, const bool is_section,
+		const std::shared_ptr<uint8_t>& block);
+
+	uint64_t unit_count() const { return units; }
+	uint64_t null_count() const { return nulls; }
+	uint64_t repeat_count() const { return repeats; }
+
+private:
+	struct SectionSlots
+	{
+		std::vector<ts_archive::Packet> packets;
+		std::array<uint32_t, ts_archive::SLOT_COUNT> hashes;
+		std::unordered_map<uint32_t, uint8_t> index; // hash -> slot
+		uint8_t next_slot = 0;
+	};
+
+	void begin_record(const uint8_t tag);
+	void end_record();
+	void append_unit(const uint8_t* packet, const std::shared_ptr<uint8_t>& block);
+	void append_reduced(const uint8_t* packet);
+
+	VectoredWriter output;
+	uint8_t unit_size;
+	uint8_t offset;
+	bool    success;
+
+	// The record being built
+	uint8_t  record_tag;
+	uint16_t record_count;
+	std::vector<PayloadSlice> record_slices;
+	std::vector<uint8_t> record_bytes;
+
+	std::vector<std::unique_ptr<SectionSlots>> section_slots;
+
+	uint64_t units;
+	uint64_t nulls;
+	uint64_t repeats;
+};
+
+class TSArchiveReader
+{
+public:
+	TSArchiveReader();
+	~TSArchiveReader() = default;
+
+	bool open(const std::string& file_path);
+
+	uint8_t get_unit_size() const { return unit_size; }
+	uint8_t get_offset() const { return offset; }
+
+	// Restores up to max_units packet units into dst.
+	// Returns the number restored, 0 at the end or on a broken archive.
+	size_t read_units(uint8_t* dst, const size_t max_units);
+
+	bool failed() const { return error; }
+
+private:
+	bool read_unit(uint8_t* unit);
+	bool fail(const char* message);
+
+	std::ifstream input;
+	uint8_t unit_size;
+	uint8_t offset;
+	bool    error;
+
+	uint8_t  record_tag;
+	uint16_t record_remaining;
+
+	std::vector<std::unique_ptr<std::vector<ts_archive::Packet>>> section_slots;
+	std::vector<uint8_t> next_slot;
+};
+
+// Writes the TS an archive was made from
+bool restore_archive(const std::string& archive_path, const std::string& output_path);
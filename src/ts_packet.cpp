@@ -3,9 +3,14 @@
  *            ARIB STD-B10 v5.7
  */
 
+#include <algorithm>
 #include <chrono>
 #include "ts_packet.h"
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
 template<typename T>
 constexpr T twos_complement(T value)
 {
@@ -63,23 +68,34 @@ bool TSPacket::parse_TS_packet(TSPHeader* header, AdaptationField* adapt = nullp
 	header->payload_unit_start_indicator =  (packet[1] & 0x40) >> 6;
 	header->transport_priority           =  (packet[1] & 0x20) >> 5;
 	header->PID                          = ((packet[1] & 0x1f) << 8) | packet[2];
-	header->transport_scrambling_control =  (packet[3] & 0x60) >> 6;
+	header->transport_scrambling_control =  (packet[3] & 0xc0) >> 6;
 	header->adaptation_field_control     =  (packet[3] & 0x30) >> 4;
 	header->continuity_counter           =  (packet[3] & 0x0f);
 
 	bit_index = 4;
 
-	if (header->transport_scrambling_control != 0) {
-		// scrambled
-		return false;
-	}
-
 	//fprintf(stdout, "PID: %x\n", h->PID);
 	if (header->adaptation_field_control == 0b10 || header->adaptation_field_control == 0b11) {
-		if (!parse_adaptation_field(adapt)) {
+		if (!adapt) {
+			bit_index += 1 + packet[bit_index];
+		}
+		else if (!parse_adaptation_field(adapt)) {
 			fprintf(stderr, "Adaptation field parse-error.\n");
+			return false;
 		}
 	}
+	else if (adapt) {
+		// do not carry the flags of a previous packet over
+		adapt->flags = 0;
+		adapt->discontinuity_indicator = 0;
+		adapt->random_access_indicator = 0;
+		adapt->PCR_flag = 0;
+	}
+	// Only the payload is scrambled: the adaptation field (and its PCR)
+	// is still read, but no payload is given
+	if (header->transport_scrambling_control != 0) {
+		return true;
+	}
 	if (header->adaptation_field_control == 0b01 || header->adaptation_field_control == 0b11) {
 		/* payload */
 		data_byte = &packet[bit_index];
@@ -89,6 +105,222 @@ bool TSPacket::parse_TS_packet(TSPHeader* header, AdaptationField* adapt = nullp
 	return true;
 }
 
+void TSPHeaderBatch::resize(const size_t n)
+{
+	PID.resize(n);
+	transport_error_indicator.resize(n);
+	payload_unit_start_indicator.resize(n);
+	transport_scrambling_control.resize(n);
+	adaptation_field_control.resize(n);
+	continuity_counter.resize(n);
+	count = n;
+}
+
+static size_t decode_TS_headers_scalar(const uint8_t* first_packet, const size_t stride,
+	const size_t begin, const size_t end, TSPHeaderBatch* batch)
+{
+	auto sync_error_index = end;
+
+	for (auto i = begin; i < end; ++i) {
+		const auto p = &first_packet[i * stride];
+		if (p[0] != TS_SYNC_BYTE && sync_error_index == end) {
+			sync_error_index = i;
+		}
+		batch->transport_error_indicator[i]    =  (p[1] & 0x80) >> 7;
+		batch->payload_unit_start_indicator[i] =  (p[1] & 0x40) >> 6;
+		batch->PID[i]                          = ((p[1] & 0x1f) << 8) | p[2];
+		batch->transport_scrambling_control[i] =  (p[3] & 0xc0) >> 6;
+		batch->adaptation_field_control[i]     =  (p[3] & 0x30) >> 4;
+		batch->continuity_counter[i]           =  (p[3] & 0x0f);
+	}
+
+	return sync_error_index;
+}
+
+#if defined(__AVX2__)
+// Decodes 8 headers per iteration. The 4 header bytes of each packet are
+// gathered as one little-endian 32-bit lane: b0 | b1 << 8 | b2 << 16 | b3 << 24
+static size_t decode_TS_headers_avx2(const uint8_t* first_packet, const size_t stride,
+	const size_t unit_count, TSPHeaderBatch* batch, size_t* decoded_count)
+{
+	const auto index = _mm256_mullo_epi32(
+		_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+		_mm256_set1_epi32(static_cast<int>(stride)));
+	const auto sync  = _mm256_set1_epi32(TS_SYNC_BYTE);
+	const auto byte  = _mm256_set1_epi32(0xff);
+	const auto one   = _mm256_set1_epi32(0x01);
+	// Groups byte k of every 32-bit lane together within each 128-bit lane
+	const auto transpose = _mm256_setr_epi8(
+		0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+		0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+	const auto interleave = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+	auto sync_error_index = unit_count;
+	size_t i = 0;
+
+	for (; i + 8 <= unit_count; i += 8) {
+		const auto w = _mm256_i32gather_epi32(
+			reinterpret_cast<const int*>(&first_packet[i * stride]), index, 1);
+
+		const auto in_sync = _mm256_cmpeq_epi32(_mm256_and_si256(w, byte), sync);
+		const auto sync_mask = _mm256_movemask_ps(_mm256_castsi256_ps(in_sync));
+		if (sync_mask != 0xff && sync_error_index == unit_count) {
+			auto k = 0;
+			while (sync_mask & (1 << k)) ++k;
+			sync_error_index = i + k;
+		}
+
+		const auto PID = _mm256_or_si256(
+			_mm256_and_si256(w, _mm256_set1_epi32(0x1f00)),
+			_mm256_and_si256(_mm256_srli_epi32(w, 16), byte));
+		const auto TEI  = _mm256_and_si256(_mm256_srli_epi32(w, 15), one);
+		const auto PUSI = _mm256_and_si256(_mm256_srli_epi32(w, 14), one);
+		const auto TSC  = _mm256_srli_epi32(w, 30);
+		const auto AFC  = _mm256_and_si256(_mm256_srli_epi32(w, 28), _mm256_set1_epi32(0x03));
+		const auto CC   = _mm256_and_si256(_mm256_srli_epi32(w, 24), _mm256_set1_epi32(0x0f));
+
+		// PID: 32-bit -> 16-bit lanes
+		const auto PID16 = _mm256_permute4x64_epi64(_mm256_packus_epi32(PID, PID), 0b1000);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(&batch->PID[i]),
+			_mm256_castsi256_si128(PID16));
+
+		// TEI, PUSI, AFC and CC share one vector, one field per byte,
+		// then get transposed to four runs of 8 bytes
+		const auto fields = _mm256_or_si256(
+			_mm256_or_si256(TEI, _mm256_slli_epi32(PUSI, 8)),
+			_mm256_or_si256(_mm256_slli_epi32(AFC, 16), _mm256_slli_epi32(CC, 24)));
+		const auto runs = _mm256_permutevar8x32_epi32(
+			_mm256_shuffle_epi8(fields, transpose), interleave);
+		const auto lo = _mm256_castsi256_si128(runs);
+		const auto hi = _mm256_extracti128_si256(runs, 1);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(&batch->transport_error_indicator[i]), lo);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(&batch->payload_unit_start_indicator[i]),
+			_mm_unpackhi_epi64(lo, lo));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(&batch->adaptation_field_control[i]), hi);
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(&batch->continuity_counter[i]),
+			_mm_unpackhi_epi64(hi, hi));
+
+		// TSC: 32-bit -> 8-bit lanes
+		const auto TSC16 = _mm256_packus_epi32(TSC, TSC);
+		const auto TSC8  = _mm256_permutevar8x32_epi32(
+			_mm256_packus_epi16(TSC16, TSC16), _mm256_setr_epi32(0, 4, 0, 0, 0, 0, 0, 0));
+		_mm_storel_epi64(reinterpret_cast<__m128i*>(&batch->transport_scrambling_control[i]),
+			_mm256_castsi256_si128(TSC8));
+	}
+
+	*decoded_count = i;
+	return sync_error_index;
+}
+#endif
+
+size_t decode_TS_headers(const uint8_t* first_packet, const size_t stride,
+	const size_t unit_count, TSPHeaderBatch* batch)
+{
+	if (batch->PID.size() < unit_count) {
+		batch->resize(unit_count);
+	}
+	batch->count = unit_count;
+
+	size_t begin = 0;
+	auto sync_error_index = unit_count;
+
+#if defined(__AVX2__)
+	sync_error_index = decode_TS_headers_avx2(first_packet, stride, unit_count, batch, &begin);
+#endif
+
+	const auto tail_error_index =
+		decode_TS_headers_scalar(first_packet, stride, begin, unit_count, batch);
+
+	return std::min(sync_error_index, tail_error_index);
+}
+
+void packetize_section(const uint16_t PID, const uint8_t* section, const uint16_t length,
+	uint8_t* continuity_counter, std::vector<uint8_t>* out)
+{
+	size_t written = 0;
+	auto unit_start = true;
+
+	while (written < length || unit_start) {
+		const auto packet_index = out->size();
+		out->resize(packet_index + TS_PACKET_SIZE, 0xff);
+		auto p = &(*out)[packet_index];
+
+		*continuity_counter = (*continuity_counter + 1) & 0x0f;
+		p[0] = TS_SYNC_BYTE;
+		p[1] = (unit_start ? 0x40 : 0x00) | (PID >> 8 & 0x1f);
+		p[2] = PID & 0xff;
+		p[3] = 0x10 | *continuity_counter; // payload only
+		p += 4;
+
+		size_t space = TS_PACKET_SIZE - 4;
+		if (unit_start) {
+			*p++ = 0x00; // pointer_field
+			space -= 1;
+			unit_start = false;
+		}
+
+		const auto n = std::min<size_t>(space, length - written);
+		std::copy(section + written, section + written + n, p);
+		written += n;
+	}
+}
+
+uint8_t detect_unit_size(const uint8_t* data, const size_t length)
+{
+	auto sync_count = [data, length](const size_t unit_size, const size_t offset = 0) {
+		auto count = 0;
+		for (auto i = offset; i < length; i += unit_size) {
+			if (data[i] == TS_SYNC_BYTE)
+				++count;
+		}
+		return count;
+	};
+
+	const auto ts_count = sync_count(TS_PACKET_SIZE);
+	const auto tts_count = sync_count(TTS_PACKET_SIZE, TTS_PACKET_SIZE - TS_PACKET_SIZE);
+	const auto fects_count = sync_count(FEC_TS_PACKET_SIZE);
+
+	return (ts_count > tts_count && ts_count > fects_count) ? TS_PACKET_SIZE :
+		   (tts_count > fects_count) ? TTS_PACKET_SIZE : FEC_TS_PACKET_SIZE;
+}
+
+size_t find_sync(const uint8_t* data, const size_t length, const uint16_t unit_size,
+	const uint8_t offset)
+{
+	constexpr size_t check_units = 8;
+
+	for (size_t start = 0; start < unit_size; ++start) {
+		size_t count = 0;
+		for (auto i = start + offset; i < length && data[i] == TS_SYNC_BYTE; i += unit_size) {
+			if (++count == check_units) {
+				return start;
+			}
+		}
+		// Short data: every remaining unit must be in sync
+		if (count && start + offset + count * unit_size >= length) {
+			return start;
+		}
+	}
+	return length;
+}
+
+bool read_PCR(const uint8_t* packet, uint64_t* PCR)
+{
+	// adaptation_field_control 0b1x, adaptation_field_length >= 7, PCR_flag
+	if (packet[0] != TS_SYNC_BYTE || !(packet[3] & 0x20) || packet[4] < 7 || !(packet[5] & 0x10)) {
+		return false;
+	}
+	const auto q = &packet[6];
+	const auto PCR_base = (uint64_t)q[0] << 25
+						| (uint64_t)q[1] << 17
+						| (uint64_t)q[2] << 9
+						| (uint64_t)q[3] << 1
+						| (uint64_t)q[4] >> 7;
+	const uint16_t PCR_ext = (q[4] & 0x01) << 8 | q[5];
+	*PCR = PCR_base * 300 + PCR_ext;
+	return true;
+}
+
 inline void print_PCR(const uint64_t PCR_base, const uint16_t PCR_ext)
 {
 	// PCR_base: 90kHz, PCR_ext: 27kHz
@@ -105,129 +337,137 @@ inline void print_PCR(const uint64_t PCR_base, const uint16_t PCR_ext)
 /* ITU-T Rec. H.222.0 */
 bool TSPacket::parse_adaptation_field(AdaptationField* adapt)
 {
-	//uint8_t buf[24] = {
-	//	       183, 0b11111111, 0b10101010, 0b10101010, 0b10101010, 0b10101010,
-	//	0b10101010, 0b10101010, 0b10101010, 0b10101010, 0b10101010, 0b10101010,
-	//	0b10101010, 0b10101010, 0b10101010, 0b10101010, 0b10101010, 0b10101010,
-	//	0b10101010, 0b10101010, 0b10101010, 0b10101010, 0b10101010, 0b10101010 };
-	//auto p = &buf[0];
-
-	auto p = &packet[bit_index];
-
-	if ((adapt->adaptation_field_length = *(p++)) <= 0) {
+	const auto p = &packet[bit_index];
+	const uint8_t length = p[0];
+
+	adapt->adaptation_field_length = length;
+	if (length > TS_PACKET_SIZE - 5) {
+		adapt->flags = 0;
+		adapt->discontinuity_indicator = 0;
+		adapt->random_access_indicator = 0;
+		adapt->PCR_flag = 0;
 		return false;
 	}
-	//fprintf(stdout, "Adaptation field length: %d\n", adapt->adaptation_field_length);
-	const auto tail = p + adapt->adaptation_field_length;
-	if (p + 1 > tail) {
-		return false;
+
+	// A zero-length field is a single stuffing byte and carries no flags
+	const uint8_t flags = length ? p[1] : 0;
+
+	adapt->flags                                = flags;
+	adapt->discontinuity_indicator              = (flags & 0x80) >> 7;
+	adapt->random_access_indicator              = (flags & 0x40) >> 6;
+	adapt->elementary_stream_priority_indicator = (flags & 0x20) >> 5;
+	adapt->PCR_flag                             = (flags & 0x10) >> 4;
+
+	// The 6 PCR bytes always lie inside the packet, so they are decoded
+	// unconditionally and only kept when PCR_flag is set
+	const auto q = p + 2;
+	const auto PCR_base = (uint64_t)q[0] << 25
+		                | (uint64_t)q[1] << 17
+		                | (uint64_t)q[2] << 9
+		                | (uint64_t)q[3] << 1
+		                | (uint64_t)(q[4] & 0x80) >> 7;
+	const uint16_t PCR_ext = (q[4] & 0x01) << 8 | q[5];
+	const uint8_t PCR_length = adapt->PCR_flag ? 6 : 0;
+
+	adapt->program_clock_reference_base      = PCR_length ? PCR_base : 0;
+	adapt->program_clock_reference_extension = PCR_length ? PCR_ext : 0;
+
+	if (length < 1 + PCR_length) {
+		if (length != 0) {
+			return false;
+		}
+		adapt->optional_fields_length = 0;
+	}
+	else {
+		adapt->optional_fields_length = length - 1 - PCR_length;
 	}
+	adapt->optional_fields = q + PCR_length;
 
-	adapt->discontinuity_indicator              = (*p & 0x80) >> 7;
-	adapt->random_access_indicator              = (*p & 0x40) >> 6;
-	adapt->elementary_stream_priority_indicator = (*p & 0x20) >> 5;
-	adapt->PCR_flag                             = (*p & 0x10) >> 4;
-	adapt->OPCR_flag                            = (*p & 0x08) >> 3;
-	adapt->splicing_point_flag                  = (*p & 0x04) >> 2;
-	adapt->transport_private_data_flag          = (*p & 0x02) >> 1;
-	adapt->adaptation_field_extension_flag      = (*p & 0x01);
+	bit_index += 1 + length;
 
-	p += 1;
+	return true;
+}
 
-	if (adapt->PCR_flag == 1) {
-		if (p + 6 > tail) {
-			return false;
-		}
-		// PCR is a 33 + 9 = 42-bit field
-		adapt->program_clock_reference_base = (uint64_t)p[0] << 25
-			                                | (uint64_t)p[1] << 17
-			                                | (uint64_t)p[2] << 9
-			                                | (uint64_t)p[3] << 1
-			                                | (uint64_t)(p[4] & 0x80) >> 7;
-		//adapt->program_clock_reference_base <<= 9;
-		adapt->program_clock_reference_extension = ((p[4] & 0x01) << 8 | p[5]);
+/* ITU-T Rec. H.222.0 */
+bool AdaptationFieldExtension::parse(const AdaptationField& adapt)
+{
+	auto p = adapt.optional_fields;
+	const auto tail = p + adapt.optional_fields_length;
 
-		//print_PCR(adapt->program_clock_reference_base, adapt->program_clock_reference_extension);
+	OPCR_flag                       = (adapt.flags & 0x08) >> 3;
+	splicing_point_flag             = (adapt.flags & 0x04) >> 2;
+	transport_private_data_flag     = (adapt.flags & 0x02) >> 1;
+	adaptation_field_extension_flag = (adapt.flags & 0x01);
 
-		p += 6;
-	}
-	if (adapt->OPCR_flag == 1) {
+	if (OPCR_flag == 1) {
 		if (p + 6 > tail) {
 			return false;
 		}
-		adapt->original_program_clock_reference_base = (uint64_t)p[0] << 25
-			                                         | (uint64_t)p[1] << 17
-			                                         | (uint64_t)p[2] << 9
-			                                         | (uint64_t)p[3] << 1
-			                                         | (uint64_t)(p[4] & 0x80) >> 7;
-		//adapt->original_program_clock_reference_base <<= 9;
-		adapt->original_program_clock_reference_extension = ((p[4] & 0x01) << 8 | p[5]);
-
-		auto OPCR = adapt->original_program_clock_reference_base * 300
-			      + adapt->original_program_clock_reference_extension;
-		//fprintf(stdout, "OPCR: %lld\n", OPCR);
-
+		original_program_clock_reference_base = (uint64_t)p[0] << 25
+		                                      | (uint64_t)p[1] << 17
+		                                      | (uint64_t)p[2] << 9
+		                                      | (uint64_t)p[3] << 1
+		                                      | (uint64_t)(p[4] & 0x80) >> 7;
+		original_program_clock_reference_extension = ((p[4] & 0x01) << 8 | p[5]);
 		p += 6;
 	}
-	if (adapt->splicing_point_flag == 1) {
+	if (splicing_point_flag == 1) {
 		if (p + 1 > tail) {
 			return false;
 		}
-		adapt->splice_countdown = *p;
+		splice_countdown = *p;
 		p += 1;
 	}
-	if (adapt->transport_private_data_flag == 1) {
+	if (transport_private_data_flag == 1) {
 		if (p + 1 > tail) {
 			return false;
 		}
-		adapt->transport_private_data_length = *p;
-		p += adapt->transport_private_data_length;
+		transport_private_data_length = *p;
+		private_data_byte = p + 1;
+		p += 1 + transport_private_data_length;
 		if (p > tail) {
 			return false;
 		}
 	}
-	if (adapt->adaptation_field_extension_flag == 1) {
+	if (adaptation_field_extension_flag == 1) {
 		if (p + 2 > tail) {
 			return false;
 		}
-		adapt->adaptation_field_extension_length = *(p++);
-		adapt->ltw_flag                          = (*p & 0x80) >> 7;
-		adapt->piecewise_flag                    = (*p & 0x40) >> 6;
-		adapt->seamless_splice_flag              = (*p & 0x20) >> 5;
+		adaptation_field_extension_length = *(p++);
+		ltw_flag                          = (*p & 0x80) >> 7;
+		piecewise_flag                    = (*p & 0x40) >> 6;
+		seamless_splice_flag              = (*p & 0x20) >> 5;
 		p += 1;
 
-		if (adapt->ltw_flag == 1) {
-			if (adapt->adaptation_field_extension_length < 2) {
+		if (ltw_flag == 1) {
+			if (adaptation_field_extension_length < 2) {
 				return false;
 			}
-			adapt->ltw_valid_flag = (p[0] & 0x80) >> 7;
-			adapt->ltw_offset     = (p[0] & 0x3f) << 8 | p[1];
+			ltw_valid_flag = (p[0] & 0x80) >> 7;
+			ltw_offset     = (p[0] & 0x3f) << 8 | p[1];
 			p += 2;
 		}
-		if (adapt->piecewise_flag == 1) {
-			if (adapt->adaptation_field_extension_length < 3) {
+		if (piecewise_flag == 1) {
+			if (adaptation_field_extension_length < 3) {
 				return false;
 			}
-			adapt->piecewise_rate = (p[0] & 0x7f) << 16 | (p[1]) << 8 | p[2];
+			piecewise_rate = (p[0] & 0x7f) << 16 | (p[1]) << 8 | p[2];
 			p += 3;
 		}
-		if (adapt->seamless_splice_flag == 1) {
-			if (adapt->adaptation_field_extension_length < 5) {
+		if (seamless_splice_flag == 1) {
+			if (adaptation_field_extension_length < 5) {
 				return false;
 			}
-			adapt->splice_type = (p[0] & 0xf0) >> 4;
-			adapt->DTS_next_AU = (p[0] & 0x0e) << 14 | p[1] << 7 | (p[2] & 0xfe) >> 1;
-			adapt->DTS_next_AU <<= 15;
-			adapt->DTS_next_AU |= (p[3] << 7 | (p[4] & 0xfe) >> 1);
+			splice_type = (p[0] & 0xf0) >> 4;
+			DTS_next_AU = (p[0] & 0x0e) << 14 | p[1] << 7 | (p[2] & 0xfe) >> 1;
+			DTS_next_AU <<= 15;
+			DTS_next_AU |= (p[3] << 7 | (p[4] & 0xfe) >> 1);
 			p += 5;
 
-			//fprintf(stdout, "DTS next AU: %llx\n", adapt->DTS_next_AU);
+			//fprintf(stdout, "DTS next AU: %llx\n", DTS_next_AU);
 		}
-
 	}
 
-	bit_index += 1 + adapt->adaptation_field_length;
-
 	return true;
 }
 
@@ -246,24 +486,48 @@ auto TSPacket::is_PES() const ->bool
 /* ITU-T Rec. H.222.0 */
 bool TSPacket::parse_PES_packet(PesPacket* pes)
 {
-	auto p = &packet[bit_index];
+	uint16_t header_length;
+	if (!parse_PES_header(&packet[bit_index], TS_PACKET_SIZE - bit_index, pes, &header_length)) {
+		return false;
+	}
+
+	bit_index += header_length;
 
-	auto getTimeStamp = [](uint8_t* p) -> uint64_t {
+	return true;
+}
+
+/* ITU-T Rec. H.222.0: 2.4.3.6 PES packet */
+bool parse_PES_header(const uint8_t* p, const size_t length, PesPacket* pes, uint16_t* header_length)
+{
+	const auto head = p;
+	const auto tail = p + length;
+
+	// 33-bit PTS/DTS: '4 bits prefix' [32..30] marker [29..15] marker [14..0] marker
+	auto get_time_stamp = [](const uint8_t* p, uint64_t* time_stamp) -> bool {
 		if ((p[0] & 0x01) != 0x01 ||
 			(p[2] & 0x01) != 0x01 ||
 			(p[4] & 0x01) != 0x01) {
 			fprintf(stderr, "marker_bit must have the value '1'\n");
-			exit(EXIT_FAILURE);
+			return false;
 		}
-		return
+		*time_stamp =
 			(uint64_t)(p[0] & 0x0e) << 29 |
 			(uint64_t) p[1] << 22         |
 			(uint64_t)(p[2] & 0xfe) << 14 |
 			(uint64_t) p[3] << 7          |
 			(uint64_t)(p[4] & 0xfe) >> 1;
+		return true;
 	};
 
-	p += 3; // Skip packet_start_code_prefix
+	if (length < 6) {
+		return false;
+	}
+
+	const uint32_t packet_start_code_prefix = p[0] << 16 | p[1] << 8 | p[2];
+	if (packet_start_code_prefix != 0x000'001) {
+		return false;
+	}
+	p += 3;
 
 	pes->stream_id = static_cast<PesPacket::StreamIdType>(*p);
 	p += 1;
@@ -272,137 +536,180 @@ bool TSPacket::parse_PES_packet(PesPacket* pes)
 	// if 0, payload consists of bytes from a video elementary stream
 	p += 2;
 
-	if (pes->stream_id != PesPacket::StreamIdType::program_stream_map       &&
-		pes->stream_id != PesPacket::StreamIdType::padding_stream           &&
-		pes->stream_id != PesPacket::StreamIdType::private_stream_2         &&
-		pes->stream_id != PesPacket::StreamIdType::ecm_stream               &&
-		pes->stream_id != PesPacket::StreamIdType::emm_stream               &&
-		pes->stream_id != PesPacket::StreamIdType::program_stream_directory &&
-		pes->stream_id != PesPacket::StreamIdType::dsmcc_stream             &&
-		pes->stream_id != PesPacket::StreamIdType::h222_type_e)
+	pes->PTS_DTS_flags = 0;
+
+	if (pes->stream_id == PesPacket::StreamIdType::program_stream_map
+	 || pes->stream_id == PesPacket::StreamIdType::padding_stream
+	 || pes->stream_id == PesPacket::StreamIdType::private_stream_2
+	 || pes->stream_id == PesPacket::StreamIdType::ecm_stream
+	 || pes->stream_id == PesPacket::StreamIdType::emm_stream
+	 || pes->stream_id == PesPacket::StreamIdType::program_stream_directory
+	 || pes->stream_id == PesPacket::StreamIdType::dsmcc_stream
+	 || pes->stream_id == PesPacket::StreamIdType::h222_type_e)
 	{
-		pes->PES_scrambling_control   = (*p & 0x30) >> 4;
-		pes->PES_priority             = (*p & 0x08) >> 3;
-		pes->data_alignment_indicator = (*p & 0x04) >> 2;
-		pes->copyright                = (*p & 0x02) >> 1;
-		pes->original_or_copy         = (*p & 0x01);
-		p += 1;
+		// PES_packet_data_byte follows PES_packet_length immediately
+		*header_length = 6;
+		return true;
+	}
 
-		pes->PTS_DTS_flags             = (*p & 0xc0) >> 6;
-		pes->ESCR_flag                 = (*p & 0x20) >> 5;
-		pes->es_rate_flag              = (*p & 0x10) >> 4;
-		pes->DSM_trick_mode_flag       = (*p & 0x08) >> 3;
-		pes->additional_copy_info_flag = (*p & 0x04) >> 2;
-		pes->PES_CRC_flag              = (*p & 0x02) >> 1;
-		pes->PES_extension_flag        = (*p & 0x01);
-		p += 1;
+	if (p + 3 > tail) {
+		return false;
+	}
 
-		pes->PES_header_data_length = *p;
-		p += 1;
+	pes->PES_scrambling_control   = (*p & 0x30) >> 4;
+	pes->PES_priority             = (*p & 0x08) >> 3;
+	pes->data_alignment_indicator = (*p & 0x04) >> 2;
+	pes->copyright                = (*p & 0x02) >> 1;
+	pes->original_or_copy         = (*p & 0x01);
+	p += 1;
 
-		if (pes->PTS_DTS_flags == 0b10) {
-			if ((*p & 0xe0) != 0b0010) {
-				return false;
-			}
-			pes->PTS = getTimeStamp(p);
-			p += 5;
+	pes->PTS_DTS_flags             = (*p & 0xc0) >> 6;
+	pes->ESCR_flag                 = (*p & 0x20) >> 5;
+	pes->es_rate_flag              = (*p & 0x10) >> 4;
+	pes->DSM_trick_mode_flag       = (*p & 0x08) >> 3;
+	pes->additional_copy_info_flag = (*p & 0x04) >> 2;
+	pes->PES_CRC_flag              = (*p & 0x02) >> 1;
+	pes->PES_extension_flag        = (*p & 0x01);
+	p += 1;
+
+	pes->PES_header_data_length = *p;
+	p += 1;
+
+	*header_length = 9 + pes->PES_header_data_length;
+	const auto header_tail = head + *header_length;
+	if (header_tail > tail) {
+		return false;
+	}
+
+	if (pes->PTS_DTS_flags == 0b10) {
+		if (p + 5 > header_tail || (*p & 0xf0) >> 4 != 0b0010) {
+			return false;
 		}
-		if (pes->PTS_DTS_flags == 0b11) {
-			if ((*p & 0xe0) != 0b0011) {
-				return false;
-			}
-			pes->PTS = getTimeStamp(p);
-			p += 5;
-			if ((*p & 0xe0) != 0b0001) {
-				return false;
-			}
-			pes->DTS = getTimeStamp(p);
-			p += 5;
+		if (!get_time_stamp(p, &pes->PTS)) {
+			return false;
 		}
-		if (pes->ESCR_flag == 1) {
-			pes->ESCR = (uint64_t)(p[0] & 0x38) << 27
-				      | (uint64_t)(p[0] & 0x03) << 28
-				      | (uint64_t) p[1] << 20
-				      | (uint64_t)(p[2] & 0xf8) << 12
-				      | (uint64_t)(p[2] & 0x03) << 13
-				      | (uint64_t) p[3] << 5
-				      | (uint64_t)(p[4] & 0xf8) >> 3;
-			pes->ESCR <<= 9;
-			// extension
-			pes->ESCR |= (p[5] & 0x03) << 7 | (p[5] & 0xfe) >> 1;
-			p += 6;
-		}
-		if (pes->es_rate_flag == 1) {
-			pes->es_rate = (p[0] & 0xef) << 14 | p[1] << 7 | (p[2] & 0xfe) >> 1;
-			p += 3;
+		p += 5;
+	}
+	if (pes->PTS_DTS_flags == 0b11) {
+		if (p + 10 > header_tail || (*p & 0xf0) >> 4 != 0b0011) {
+			return false;
 		}
-		if (pes->DSM_trick_mode_flag == 1) {
-			pes->trick_mode_control =
-				static_cast<PesPacket::TMCType>((*p & 0xe0) >> 5);
-			if (pes->trick_mode_control == PesPacket::TMCType::fast_forward ||
-				pes->trick_mode_control == PesPacket::TMCType::fast_reverse) {
-				pes->field_id             = (*p & 0x18) >> 3;
-				pes->intra_slice_refresh  = (*p & 0x04) >> 2;
-				pes->frequency_truncation =  *p & 0x03;
-			}
-			else if (pes->trick_mode_control == PesPacket::TMCType::slow_motion
-				  || pes->trick_mode_control == PesPacket::TMCType::slow_reverse) {
-				pes->rep_cntrl = *p & 0x1f;
-			}
-			else if (pes->trick_mode_control == PesPacket::TMCType::freeze_frame) {
-				pes->field_id = (*p & 0x18) >> 3;
-			}
-			p += 1;
+		if (!get_time_stamp(p, &pes->PTS)) {
+			return false;
 		}
-		if (pes->additional_copy_info_flag == 1) {
-			pes->additional_copy_info = *p & 0x7f;
-			p += 1;
+		p += 5;
+		if ((*p & 0xf0) >> 4 != 0b0001) {
+			return false;
 		}
-		if (pes->PES_CRC_flag == 1) {
-			pes->previous_PES_packet_CRC = (p[0] << 8) | p[1];
-			p += 2;
+		if (!get_time_stamp(p, &pes->DTS)) {
+			return false;
 		}
-		if (pes->PES_extension_flag == 1) {
+		p += 5;
+	}
+	if (pes->ESCR_flag == 1) {
+		if (p + 6 > header_tail) {
+			return false;
 		}
+		pes->ESCR = (uint64_t)(p[0] & 0x38) << 27
+			      | (uint64_t)(p[0] & 0x03) << 28
+			      | (uint64_t) p[1] << 20
+			      | (uint64_t)(p[2] & 0xf8) << 12
+			      | (uint64_t)(p[2] & 0x03) << 13
+			      | (uint64_t) p[3] << 5
+			      | (uint64_t)(p[4] & 0xf8) >> 3;
+		pes->ESCR <<= 9;
+		// extension
+		pes->ESCR |= (p[4] & 0x03) << 7 | (p[5] & 0xfe) >> 1;
+		p += 6;
 	}
-	else if (pes->stream_id == PesPacket::StreamIdType::program_stream_map
-		  || pes->stream_id == PesPacket::StreamIdType::private_stream_2
-		  || pes->stream_id == PesPacket::StreamIdType::ecm_stream
-		  || pes->stream_id == PesPacket::StreamIdType::emm_stream
-		  || pes->stream_id == PesPacket::StreamIdType::program_stream_directory
-		  || pes->stream_id == PesPacket::StreamIdType::dsmcc_stream
-		  || pes->stream_id == PesPacket::StreamIdType::h222_type_e)
-	{
+	if (pes->es_rate_flag == 1) {
+		if (p + 3 > header_tail) {
+			return false;
+		}
+		pes->es_rate = (p[0] & 0x7f) << 15 | p[1] << 7 | (p[2] & 0xfe) >> 1;
+		p += 3;
+	}
+	if (pes->DSM_trick_mode_flag == 1) {
+		if (p + 1 > header_tail) {
+			return false;
+		}
+		pes->trick_mode_control =
+			static_cast<PesPacket::TMCType>((*p & 0xe0) >> 5);
+		if (pes->trick_mode_control == PesPacket::TMCType::fast_forward ||
+			pes->trick_mode_control == PesPacket::TMCType::fast_reverse) {
+			pes->field_id             = (*p & 0x18) >> 3;
+			pes->intra_slice_refresh  = (*p & 0x04) >> 2;
+			pes->frequency_truncation =  *p & 0x03;
+		}
+		else if (pes->trick_mode_control == PesPacket::TMCType::slow_motion
+			  || pes->trick_mode_control == PesPacket::TMCType::slow_reverse) {
+			pes->rep_cntrl = *p & 0x1f;
+		}
+		else if (pes->trick_mode_control == PesPacket::TMCType::freeze_frame) {
+			pes->field_id = (*p & 0x18) >> 3;
+		}
+		p += 1;
+	}
+	if (pes->additional_copy_info_flag == 1) {
+		if (p + 1 > header_tail) {
+			return false;
+		}
+		pes->additional_copy_info = *p & 0x7f;
+		p += 1;
+	}
+	if (pes->PES_CRC_flag == 1) {
+		if (p + 2 > header_tail) {
+			return false;
+		}
+		pes->previous_PES_packet_CRC = (p[0] << 8) | p[1];
+		p += 2;
+	}
+	if (pes->PES_extension_flag == 1) {
+		if (p + 1 > header_tail) {
+			return false;
+		}
 		pes->PES_private_data_flag                = (*p & 0x80) >> 7;
 		pes->pack_header_field_flag               = (*p & 0x40) >> 6;
 		pes->program_packet_sequence_counter_flag = (*p & 0x20) >> 5;
 		pes->P_STD_buffer_flag                    = (*p & 0x10) >> 4;
 		pes->PES_extension_flag_2                 = (*p & 0x01);
+		p += 1;
+
 		if (pes->PES_private_data_flag == 1) {
+			if (p + 16 > header_tail) {
+				return false;
+			}
 			p += 16;
 		}
 		if (pes->pack_header_field_flag == 1) {
+			if (p + 1 > header_tail) {
+				return false;
+			}
 			pes->pack_field_length = *p;
 			p += 1;
 
+			if (p + pes->pack_field_length > header_tail) {
+				return false;
+			}
 			p += pes->pack_field_length;
 		}
 		if (pes->program_packet_sequence_counter_flag == 1) {
+			if (p + 2 > header_tail) {
+				return false;
+			}
 			p += 2;
 		}
 		if (pes->P_STD_buffer_flag == 0x01) {
+			if (p + 2 > header_tail) {
+				return false;
+			}
 			p += 2;
 		}
-		if (pes->PES_extension_flag_2 == 1) {
+		if (pes->PES_extension_flag_2 == 1 && p < header_tail) {
 			pes->PES_extension_field_length = *p & 0x7f;
 			pes->stream_id_extension_flag = (*p & 0x80) >> 7;
-
-			p += pes->PES_extension_field_length;
 		}
 	}
 
-	bit_index += pes->PES_packet_length + 6;
-
 	return true;
 }
-
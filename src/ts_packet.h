@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cinttypes>
+#include <vector>
 
 constexpr uint16_t TS_PACKET_SIZE     = 188;
 constexpr uint16_t TTS_PACKET_SIZE    = 192; // Timestamped TS
@@ -8,6 +9,28 @@ constexpr uint16_t FEC_TS_PACKET_SIZE = 204; // Forward Error Correction
 constexpr uint16_t TS_SYNC_BYTE       = 0x47;
 constexpr uint16_t TS_PID_MAX         = 8192; // 0x2000
 
+// Where the payload of a PID goes
+enum class PidType : uint8_t
+{
+	unknown, // not referenced by PAT/PMT (yet): dropped
+	section, // PSI/SI sections
+	PES,
+	null,
+};
+
+// Packet unit layouts. The unit size of a file never changes, so the
+// packet loop is instantiated per layout and stride/offset are constants.
+template <uint16_t UnitSize, uint8_t Offset>
+struct PacketFormat
+{
+	static constexpr uint16_t unit_size = UnitSize;
+	static constexpr uint8_t  offset    = Offset; // position of sync_byte
+};
+
+using TSFormat    = PacketFormat<TS_PACKET_SIZE, 0>;
+using TTSFormat   = PacketFormat<TTS_PACKET_SIZE, TTS_PACKET_SIZE - TS_PACKET_SIZE>;
+using FECTSFormat = PacketFormat<FEC_TS_PACKET_SIZE, 0>;
+
 struct TSPHeader
 {
 	int8_t   synchronization_byte;
@@ -20,27 +43,72 @@ struct TSPHeader
 	uint8_t  continuity_counter;
 };
 
+// Structure-of-arrays form of the 4-byte headers of consecutive packets
+struct TSPHeaderBatch
+{
+	std::vector<uint16_t> PID;
+	std::vector<uint8_t>  transport_error_indicator;
+	std::vector<uint8_t>  payload_unit_start_indicator;
+	std::vector<uint8_t>  transport_scrambling_control;
+	std::vector<uint8_t>  adaptation_field_control;
+	std::vector<uint8_t>  continuity_counter;
+	size_t count;
+
+	TSPHeaderBatch() : count(0) {}
+	void resize(const size_t n);
+};
+
+// Decodes the headers of unit_count packets laid out every stride bytes,
+// starting at the sync_byte of the first packet.
+// Returns the index of the first packet whose sync_byte is wrong
+// (unit_count if all packets are in sync).
+size_t decode_TS_headers(const uint8_t* first_packet, const size_t stride,
+	const size_t unit_count, TSPHeaderBatch* batch);
+
+template <typename Format>
+inline size_t decode_TS_headers(const uint8_t* block, const size_t unit_count,
+	TSPHeaderBatch* batch)
+{
+	return decode_TS_headers(block + Format::offset, Format::unit_size, unit_count, batch);
+}
+
+// Fields needed for almost every packet carrying an adaptation field.
+// The rarely present fields are left in place and decoded on demand
+// by AdaptationFieldExtension.
 struct AdaptationField
 {
 	uint8_t  adaptation_field_length;
+	uint8_t  flags; // the 8 flag bits, discontinuity_indicator first
+
 	int8_t   discontinuity_indicator;
 	int8_t   random_access_indicator;
 	int8_t   elementary_stream_priority_indicator;
-
 	int8_t   PCR_flag;
+
+	uint64_t program_clock_reference_base;
+	uint16_t program_clock_reference_extension;
+
+	// Bytes following the PCR (OPCR onwards).
+	// Points into the packet buffer and is valid as long as the packet is.
+	const uint8_t* optional_fields;
+	uint8_t        optional_fields_length;
+};
+
+// Cold part of the adaptation field: OPCR, splice, private data and
+// the adaptation field extension (ltw, piecewise, seamless splice)
+struct AdaptationFieldExtension
+{
 	int8_t   OPCR_flag;
 	int8_t   splicing_point_flag;
 	int8_t   transport_private_data_flag;
 	int8_t   adaptation_field_extension_flag;
 
-	uint64_t program_clock_reference_base;
-	uint16_t program_clock_reference_extension;
 	uint64_t original_program_clock_reference_base;
 	uint16_t original_program_clock_reference_extension;
 
 	uint8_t  splice_countdown;
 	uint8_t  transport_private_data_length;
-	int8_t   private_data_byte;
+	const uint8_t* private_data_byte;
 	uint8_t  adaptation_field_extension_length;
 	int8_t   ltw_flag;
 	int8_t   piecewise_flag;
@@ -51,7 +119,7 @@ struct AdaptationField
 	int8_t   splice_type;
 	int64_t  DTS_next_AU;
 
-	int8_t   stuffing_byte;
+	bool parse(const AdaptationField& adapt);
 };
 
 struct PesPacket
@@ -134,6 +202,28 @@ struct PesPacket
 	uint8_t  stream_id_extension;
 };
 
+// Splits a section into 188-byte TS packets (pointer_field 0, 0xFF stuffing)
+// and appends them to out. continuity_counter is advanced per packet.
+void packetize_section(const uint16_t PID, const uint8_t* section, const uint16_t length,
+	uint8_t* continuity_counter, std::vector<uint8_t>* out);
+
+// Tells the packet unit size (188, 192 or 204) from the sync_bytes of data,
+// which should hold a few KiB from the start of a stream
+uint8_t detect_unit_size(const uint8_t* data, const size_t length);
+
+// Returns the first byte offset in data from which sync_bytes repeat
+// every unit_size bytes for a few units (length if there is none).
+size_t find_sync(const uint8_t* data, const size_t length, const uint16_t unit_size,
+	const uint8_t offset);
+
+// Reads the PCR of one packet in 27MHz units without parsing the rest.
+// Returns false when the packet carries no PCR.
+bool read_PCR(const uint8_t* packet, uint64_t* PCR);
+
+// Parses the PES header at p. header_length receives the offset of the
+// first PES_packet_data_byte.
+bool parse_PES_header(const uint8_t* p, const size_t length, PesPacket* pes, uint16_t* header_length);
+
 class TSPacket
 {
 public:
@@ -80,6 +80,42 @@ bool ProgramAssociationSection::parse(const uint8_t* p, uint16_t* read_length)
 	return true;
 }
 
+void ProgramAssociationSection::write(std::vector<uint8_t>* out) const
+{
+	const uint16_t length = static_cast<uint16_t>(
+		5 + 4 * (network_PIDs.size() + PMT_list.size()) + crc::CRC32_SIZE);
+
+	out->clear();
+	out->reserve(3 + length);
+	out->push_back(0x00);                                 // table_id
+	out->push_back(0xb0 | ((length >> 8) & 0x0f));        // section_syntax_indicator, '0', reserved
+	out->push_back(length & 0xff);
+	out->push_back(transport_stream_id >> 8);
+	out->push_back(transport_stream_id & 0xff);
+	out->push_back(0xc0 | (version_number & 0x1f) << 1 | 0x01); // current_next_indicator
+	out->push_back(section_number);
+	out->push_back(last_section_number);
+
+	for (const auto PID : network_PIDs) {
+		out->push_back(0x00);
+		out->push_back(0x00);
+		out->push_back(0xe0 | PID >> 8);
+		out->push_back(PID & 0xff);
+	}
+	for (const auto& info : PMT_list) {
+		out->push_back(info.program_number >> 8);
+		out->push_back(info.program_number & 0xff);
+		out->push_back(0xe0 | info.program_map_PID >> 8);
+		out->push_back(info.program_map_PID & 0xff);
+	}
+
+	const auto CRC_32 = crc::_crc32(out->data(), out->size());
+	out->push_back((CRC_32 >> 24) & 0xff);
+	out->push_back((CRC_32 >> 16) & 0xff);
+	out->push_back((CRC_32 >>  8) & 0xff);
+	out->push_back( CRC_32        & 0xff);
+}
+
 bool CASection::parse(const uint8_t* p, uint16_t* read_length)
 {
 	table_id = p[0];
@@ -121,8 +157,7 @@ bool CASection::parse(const uint8_t* p, uint16_t* read_length)
 	return true;
 }
 
-template <typename T>
-std::string get_stream_type(const T stream_type)
+std::string get_stream_type(const uint8_t stream_type)
 {
 	auto stream_type_ = static_cast<StreamType>(stream_type);
 	std::string str;
@@ -140,6 +175,9 @@ std::string get_stream_type(const T stream_type)
 	case StreamType::STREAM_VIDEO_AVC:
 		str = ".avc";
 		break;
+	case StreamType::STREAM_VIDEO_HEVC:
+		str = ".hevc";
+		break;
 	case StreamType::STREAM_VIDEO_VC1:
 		str = ".vc1";
 		break;
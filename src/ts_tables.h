@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <memory>
+#include <string>
 #include "ts_descriptors.h"
 
 // PSI: PAT, PMT, NIT, CAT, TSDT, ICIT
@@ -33,6 +34,8 @@ struct ProgramAssociationSection
 	~ProgramAssociationSection() = default;
 
 	bool parse(const uint8_t* p, uint16_t* read_length);
+	// Serializes the section with section_length and CRC_32 recomputed
+	void write(std::vector<uint8_t>* out) const;
 };
 
 struct CASection
@@ -72,6 +75,7 @@ enum class StreamType : uint8_t
 	STREAM_VIDEO_MP4        = 0x10,    // ISO/IEC 14496-2 Visual
 	STREAM_AUDIO_MP4        = 0x11,    // ISO/IEC 14496-3 Audio with the LATM transport syntax as defined in ISO/IEC 14496-3 / AMD 1
 	STREAM_VIDEO_AVC        = 0x1B,    // ISO/IEC 14496-10
+	STREAM_VIDEO_HEVC       = 0x24,    // ITU-T Rec. H.265 | ISO/IEC 23008-2
 	STREAM_VIDEO_PRIVATE    = 0x80,    // Private Video or Linear PCM
 	STREAM_AUDIO_LPCM       = 0x80,
 	STREAM_AUDIO_AC3_DTS    = 0x81,    // AC-3 or DTS
@@ -87,6 +91,9 @@ enum class StreamType : uint8_t
 	STREAM_INVALID          = 0xFF
 };
 
+// File extension for the elementary stream of stream_type ("unknown" if none)
+std::string get_stream_type(const uint8_t stream_type);
+
 struct ProgramMapSection
 {
 	struct ESInfo {
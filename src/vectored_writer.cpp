@@ -0,0 +1,166 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include "vectored_writer.h"
+
+#if defined(_WIN32)
+#include <memory>
+#else
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <climits>
+#endif
+
+VectoredWriter::VectoredWriter() :
+#if defined(_WIN32)
+	file(nullptr),
+#else
+	fd(-1),
+#endif
+	pending_bytes(0),
+	written(0)
+{
+	pending.reserve(max_slices);
+}
+
+VectoredWriter::~VectoredWriter()
+{
+	close();
+}
+
+bool VectoredWriter::open(const std::string& file_path)
+{
+	close();
+
+#if defined(_WIN32)
+	file = fopen(file_path.c_str(), "wb");
+	if (!file) {
+		fprintf(stderr, "file open failed. [%s]\n", file_path.c_str());
+		return false;
+	}
+	// No writev(): let the CRT buffer absorb the slices
+	setvbuf(file, nullptr, _IOFBF, max_bytes);
+#else
+	fd = ::open(file_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		fprintf(stderr, "file open failed. [%s]\n", file_path.c_str());
+		return false;
+	}
+#endif
+	written = 0;
+	return true;
+}
+
+bool VectoredWriter::is_open() const
+{
+#if defined(_WIN32)
+	return file != nullptr;
+#else
+	return fd >= 0;
+#endif
+}
+
+bool VectoredWriter::close()
+{
+	if (!is_open()) {
+		return true;
+	}
+
+	const auto success = flush();
+#if defined(_WIN32)
+	fclose(file);
+	file = nullptr;
+#else
+	::close(fd);
+	fd = -1;
+#endif
+	return success;
+}
+
+bool VectoredWriter::append(const PayloadSlice& slice)
+{
+	if (!slice.length) {
+		return true;
+	}
+
+	pending.push_back(slice);
+	pending_bytes += slice.length;
+
+	if (pending.size() >= max_slices || pending_bytes >= max_bytes) {
+		return flush();
+	}
+	return true;
+}
+
+bool VectoredWriter::append(const uint8_t* data, const size_t length)
+{
+	// Slices are at most 64KiB long
+	for (size_t i = 0; i < length; i += UINT16_MAX) {
+		const auto n = std::min<size_t>(length - i, UINT16_MAX);
+		std::shared_ptr<uint8_t> copy(new uint8_t[n], std::default_delete<uint8_t[]>());
+		std::memcpy(copy.get(), data + i, n);
+		if (!append(PayloadSlice{ copy, static_cast<uint16_t>(n) })) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool VectoredWriter::flush()
+{
+	if (pending.empty()) {
+		return true;
+	}
+
+	auto success = true;
+
+#if defined(_WIN32)
+	for (const auto& slice : pending) {
+		if (fwrite(slice.data.get(), 1, slice.length, file) != slice.length) {
+			success = false;
+			break;
+		}
+		written += slice.length;
+	}
+#else
+	constexpr size_t iov_max = IOV_MAX < max_slices ? IOV_MAX : max_slices;
+	struct iovec iov[iov_max];
+
+	size_t index = 0;   // first slice not completely written
+	size_t skip  = 0;   // bytes of pending[index] already written
+	while (index < pending.size()) {
+		size_t count = 0;
+		for (auto i = index; i < pending.size() && count < iov_max; ++i, ++count) {
+			const auto head = (i == index) ? skip : 0;
+			iov[count].iov_base = const_cast<uint8_t*>(pending[i].data.get()) + head;
+			iov[count].iov_len  = pending[i].length - head;
+		}
+
+		const auto result = ::writev(fd, iov, static_cast<int>(count));
+		if (result < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			fprintf(stderr, "writev failed. [%s]\n", strerror(errno));
+			success = false;
+			break;
+		}
+		written += result;
+
+		// Advance past what the kernel took; writes may be partial
+		auto rest = static_cast<size_t>(result);
+		while (index < pending.size() && rest >= pending[index].length - skip) {
+			rest -= pending[index].length - skip;
+			skip = 0;
+			++index;
+		}
+		skip += rest;
+	}
+#endif
+
+	pending.clear();
+	pending_bytes = 0;
+
+	return success;
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cinttypes>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "pes_assembler.h"
+
+// Output file fed with slices of packet buffers. Slices are queued
+// without copying and written with one writev() per batch.
+class VectoredWriter
+{
+public:
+	VectoredWriter();
+	~VectoredWriter();
+
+	VectoredWriter(const VectoredWriter&) = delete;
+	VectoredWriter& operator=(const VectoredWriter&) = delete;
+
+	bool open(const std::string& file_path);
+	bool close();
+	bool is_open() const;
+
+	// Queues a slice; the writer keeps its buffer alive until written
+	bool append(const PayloadSlice& slice);
+	// Queues a copy of data
+	bool append(const uint8_t* data, const size_t length);
+
+	bool flush();
+
+	uint64_t bytes_written() const { return written; }
+
+private:
+	// A batch is written once either limit is reached
+	static constexpr size_t max_slices = 1024;
+	static constexpr size_t max_bytes  = 4 << 20;
+
+#if defined(_WIN32)
+	FILE* file;
+#else
+	int fd;
+#endif
+	std::vector<PayloadSlice> pending;
+	size_t pending_bytes;
+	uint64_t written;
+};